@@ -16,10 +16,10 @@ from pathlib import Path
 from dataclasses import dataclass
 from sys import executable
 from tarfile import open as tar_open, TarInfo
-from json import load as json_load
+from json import dump as json_dump, load as json_load
 import platform as host_platform
 
-from typing import Dict, Union, List, Tuple
+from typing import Dict, Optional, Union, List, Tuple
 
 NAME = "microkit"
 VERSION = "1.2.6"
@@ -36,6 +36,12 @@ AARCH64_TOOLCHAIN = "aarch64-none-elf-"
 # We can use the same toolchain for both 32-bit and 64-bit RISC-V builds.
 RISCV_TOOLCHAIN = "riscv64-unknown-elf-"
 
+# Single core kernels are built with a placeholder domain schedule that the
+# tool replaces with the domain schedule of the system. Domains are not used
+# on multicore kernels.
+KERNEL_NUM_DOMAINS = 16
+KERNEL_DOMAIN_SCHEDULE = Path("kernel/domain_schedule.c")
+
 # @ivanv: temporary, this can be removed by looking at the architecture in gen_config.yaml
 class BoardArch:
     AARCH64 = 1
@@ -49,6 +55,12 @@ class BoardArch:
 # useful imo
 # @ivanv: find a way to consistently pass in mabi and march to the various Makefiles
 
+@dataclass
+class CacheInfo:
+    size: int
+    ways: int
+
+
 @dataclass
 class BoardInfo:
     name: str
@@ -57,6 +69,9 @@ class BoardInfo:
     loader_link_address: int
     kernel_options: KERNEL_CONFIG_TYPE
     examples: Dict[str, Path]
+    # The geometry of the shared L2 cache, which determines the number of
+    # page colours the tool can allocate memory from
+    l2_cache: Optional[CacheInfo] = None
 
 
 @dataclass
@@ -86,6 +101,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a53",
         loader_link_address=0x40000000,
+        l2_cache=CacheInfo(size=0x10_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "zynqmp",
             "KernelARMPlatform": "zcu102",
@@ -103,6 +119,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a53",
         loader_link_address=0x41000000,
+        l2_cache=CacheInfo(size=0x10_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "imx8mq-evk",
             "KernelIsMCS": True,
@@ -116,6 +133,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a53",
         loader_link_address=0x41000000,
+        l2_cache=CacheInfo(size=0x8_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "imx8mm-evk",
             "KernelIsMCS": True,
@@ -129,6 +147,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a53",
         loader_link_address=0x41000000,
+        l2_cache=CacheInfo(size=0x8_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "imx8mm-evk",
             "KernelIsMCS": True,
@@ -141,6 +160,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a53",
         loader_link_address=0x41000000,
+        l2_cache=CacheInfo(size=0x8_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "imx8mm-evk",
             "KernelIsMCS": True,
@@ -154,6 +174,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a53",
         loader_link_address=0x41000000,
+        l2_cache=CacheInfo(size=0x8_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "imx8mm-evk",
             "KernelIsMCS": True,
@@ -167,6 +188,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a53",
         loader_link_address=0x41000000,
+        l2_cache=CacheInfo(size=0x8_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "imx8mm-evk",
             "KernelIsMCS": True,
@@ -181,6 +203,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a53",
         loader_link_address=0x40000000,
+        l2_cache=CacheInfo(size=0x10_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "zynqmp",
             "KernelARMPlatform": "ultra96v2",
@@ -196,6 +219,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a53",
         loader_link_address=0x40000000,
+        l2_cache=CacheInfo(size=0x10_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "zynqmp",
             "KernelARMPlatform": "ultra96v2",
@@ -287,6 +311,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a53",
         loader_link_address=0x20000000,
+        l2_cache=CacheInfo(size=0x8_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "odroidc2",
             "KernelIsMCS": True,
@@ -298,6 +323,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a53",
         loader_link_address=0x20000000,
+        l2_cache=CacheInfo(size=0x8_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "odroidc2",
             "KernelIsMCS": True,
@@ -338,6 +364,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a53",
         loader_link_address=0x10000000,
+        l2_cache=CacheInfo(size=0x8_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "bcm2837",
             "KernelARMPlatform": "rpi3",
@@ -352,6 +379,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a72",
         loader_link_address=0x10000000,
+        l2_cache=CacheInfo(size=0x10_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "bcm2711",
             "KernelARMPlatform": "rpi4",
@@ -366,6 +394,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a57",
         loader_link_address=0x81000000,
+        l2_cache=CacheInfo(size=0x20_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "tx2",
             "KernelIsMCS": True,
@@ -377,6 +406,7 @@ SUPPORTED_BOARDS = (
         arch=BoardArch.AARCH64,
         gcc_flags="GCC_CPU=cortex-a53",
         loader_link_address=0x50000000,
+        l2_cache=CacheInfo(size=0x10_0000, ways=16),
         kernel_options = {
             "KernelPlatform": "maaxboard",
             "KernelIsMCS": True,
@@ -625,6 +655,11 @@ def build_sel4(
     print(f"Building seL4: {sel4_dir=} {root_dir=} {build_dir=} {board=} {config=}")
 
     config_args = list(board.kernel_options.items()) + list(config.kernel_options.items())
+    if dict(config_args).get("KernelMaxNumNodes", 1) == 1:
+        config_args += [
+            ("KernelNumDomains", KERNEL_NUM_DOMAINS),
+            ("KernelDomainSchedule", KERNEL_DOMAIN_SCHEDULE.absolute()),
+        ]
     config_strs = []
     for arg, val in sorted(config_args):
         if isinstance(val, bool):
@@ -806,6 +841,8 @@ def build_sel4_config_component(
     # Here we are just copying the auto-generated kernel config, "gen_config.json".
     # This is because it is needed for the tool so it can deal with seL4/platform
     # specific configuration. It is also used in this build script.
+    # The kernel does not know the geometry of the L2 cache, so that is added
+    # for the tool to colour memory by.
     sel4_build_dir = build_dir / board.name / config.name / "sel4" / "build"
     sel4_gen_config = sel4_build_dir / "gen_config" / "kernel" / "gen_config.json"
     dest = root_dir / "board" / board.name / config.name / "config.json"
@@ -814,7 +851,14 @@ def build_sel4_config_component(
         sel4_config = json_load(f)
 
     dest.unlink(missing_ok=True)
-    copy(sel4_gen_config, dest)
+    if board.l2_cache is None:
+        copy(sel4_gen_config, dest)
+    else:
+        tool_config = dict(sel4_config)
+        tool_config["L2_CACHE_SIZE"] = board.l2_cache.size
+        tool_config["L2_CACHE_WAYS"] = board.l2_cache.ways
+        with open(dest, "w") as f:
+            json_dump(tool_config, f, indent=4)
 
     return sel4_config
 
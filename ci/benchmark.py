@@ -0,0 +1,323 @@
+#
+# Copyright 2021, Breakaway Consulting Pty. Ltd.
+#
+# SPDX-License-Identifier: BSD-2-Clause
+#
+# The purpose of this script is to measure how the Microkit tool scales with
+# the size of the system it is given, so that regressions in the tool show up
+# before they hurt real builds.
+#
+# Each benchmark case generates a synthetic system description, along with
+# dummy program images for its protection domains, and runs the tool on it.
+# The wall time, peak RSS, size of the invocation table and number of kernel
+# objects are recorded in a JSON file. The results can be compared against
+# a previous run with '--baseline'.
+#
+# With '--compress' the tool also compresses the loader image, which is the
+# part of the tool that runs across processes (see '--jobs'); the rest of
+# the tool is serial.
+#
+# The kernel, monitor and loader come from a built SDK, so this script is
+# intended to be run after build_sdk.py, both by the CI as well as locally.
+import os
+import re
+from argparse import ArgumentParser
+from dataclasses import dataclass, asdict
+from json import dump as json_dump, load as json_load
+from pathlib import Path
+from random import Random
+from shutil import rmtree
+from struct import Struct
+from subprocess import Popen, STDOUT
+from sys import executable, platform
+
+from typing import Dict, List, Tuple
+
+CWD_DIR = Path.cwd()
+DEFAULT_SDK_PATH = CWD_DIR / "release" / "microkit-sdk-1.2.6"
+DEFAULT_BUILD_DIR = CWD_DIR / "benchmark_build"
+TOOL_SOURCE_DIR = Path(__file__).parent.parent / "tool"
+
+PAGE_SIZE = 0x1000
+MAX_PDS = 63
+MAX_CHANNEL_ID = 62
+
+PD_TEXT_VADDR = 0x200_000
+MR_VADDR = 0x1000_0000
+LARGE_MR_VADDR = 0x4000_0000
+
+
+@dataclass(frozen=True)
+class BenchmarkCase:
+    name: str
+    pds: int
+    mrs: int = 0
+    channels: int = 0
+    # Number of 4 KiB pages in a single large memory region
+    large_mr_pages: int = 0
+    # Size of the code of each program image
+    text_size: int = 0x10_000
+
+
+BENCHMARK_CASES = [
+    BenchmarkCase("pds-8", pds=8),
+    BenchmarkCase("pds-63", pds=63),
+    BenchmarkCase("mrs-1024", pds=16, mrs=1024),
+    BenchmarkCase("channels-1024", pds=63, channels=1024),
+    BenchmarkCase("large-mr-16384", pds=1, large_mr_pages=16384),
+    BenchmarkCase("large-images", pds=16, text_size=0x400_000),
+    BenchmarkCase("everything", pds=63, mrs=1024, channels=1024, large_mr_pages=16384),
+]
+
+
+@dataclass
+class BenchmarkResult:
+    name: str
+    pds: int
+    mrs: int
+    channels: int
+    large_mr_pages: int
+    wall_time: float
+    peak_rss_kib: int
+    builds: int
+    invocation_table_bytes: int
+    kernel_objects: int
+
+
+ELF_IDENT = Struct("<4sBBBBB7x")
+ELF_HEADER = Struct("<HHIQQQIHHHHHH")
+ELF_PROGRAM_HEADER = Struct("<IIQQQQQQ")
+ELF_SECTION_HEADER = Struct("<IIQQQQIIQQ")
+ELF_SYMBOL = Struct("<IBBHQQ")
+
+PT_LOAD = 1
+PF_X, PF_W, PF_R = 1, 2, 4
+SHT_SYMTAB, SHT_STRTAB = 2, 3
+EM_AARCH64 = 183
+
+
+def write_program_image(path: Path, text_size: int, seed: int) -> None:
+    """Write a dummy program image with a code segment of random data, and a
+    data segment holding the symbols that the tool expects to find."""
+    rng = Random(seed)
+    text = rng.randbytes(text_size)
+    data_vaddr = PD_TEXT_VADDR + text_size + PAGE_SIZE - text_size % PAGE_SIZE
+    data = bytes(3 * PAGE_SIZE)
+    symbols = [
+        ("microkit_name", data_vaddr, 64),
+        ("passive", data_vaddr + 64, 1),
+        ("__sel4_ipc_buffer_obj", data_vaddr + PAGE_SIZE, PAGE_SIZE),
+    ]
+
+    strtab = b"\0"
+    symtab = ELF_SYMBOL.pack(0, 0, 0, 0, 0, 0)
+    for name, vaddr, size in symbols:
+        symtab += ELF_SYMBOL.pack(len(strtab), 0x11, 0, 0, vaddr, size)
+        strtab += name.encode() + b"\0"
+    shstrtab = b"\0.symtab\0.strtab\0.shstrtab\0"
+
+    segments = [(PD_TEXT_VADDR, text, PF_R | PF_X), (data_vaddr, data, PF_R | PF_W)]
+    phoff = ELF_IDENT.size + ELF_HEADER.size
+    offset = phoff + len(segments) * ELF_PROGRAM_HEADER.size
+    program_headers = b""
+    for vaddr, contents, flags in segments:
+        program_headers += ELF_PROGRAM_HEADER.pack(PT_LOAD, flags, offset, vaddr, vaddr, len(contents), len(contents), PAGE_SIZE)
+        offset += len(contents)
+
+    symtab_offset = offset
+    strtab_offset = symtab_offset + len(symtab)
+    shstrtab_offset = strtab_offset + len(strtab)
+    shoff = shstrtab_offset + len(shstrtab)
+    section_headers = b"".join([
+        ELF_SECTION_HEADER.pack(0, 0, 0, 0, 0, 0, 0, 0, 0, 0),
+        ELF_SECTION_HEADER.pack(1, SHT_SYMTAB, 0, 0, symtab_offset, len(symtab), 2, 1, 8, ELF_SYMBOL.size),
+        ELF_SECTION_HEADER.pack(9, SHT_STRTAB, 0, 0, strtab_offset, len(strtab), 0, 0, 1, 0),
+        ELF_SECTION_HEADER.pack(17, SHT_STRTAB, 0, 0, shstrtab_offset, len(shstrtab), 0, 0, 1, 0),
+    ])
+
+    with path.open("wb") as f:
+        f.write(ELF_IDENT.pack(b"\x7fELF", 2, 1, 1, 0, 0))
+        f.write(ELF_HEADER.pack(2, EM_AARCH64, 1, PD_TEXT_VADDR, phoff, shoff, 0, ELF_IDENT.size + ELF_HEADER.size,
+                                ELF_PROGRAM_HEADER.size, len(segments), ELF_SECTION_HEADER.size, 4, 3))
+        f.write(program_headers)
+        for _, contents, _ in segments:
+            f.write(contents)
+        f.write(symtab)
+        f.write(strtab)
+        f.write(shstrtab)
+        f.write(section_headers)
+
+
+def channel_ends(pds: int, channels: int) -> List[Tuple[int, int, int, int]]:
+    """Connect pairs of PDs, nearest neighbours first, without any PD using
+    more channel IDs than are available."""
+    next_id = [0] * pds
+    ends = []
+    for distance in range(1, pds):
+        for a in range(pds - distance):
+            if len(ends) == channels:
+                return ends
+            b = a + distance
+            if next_id[a] > MAX_CHANNEL_ID or next_id[b] > MAX_CHANNEL_ID:
+                continue
+            ends.append((a, next_id[a], b, next_id[b]))
+            next_id[a] += 1
+            next_id[b] += 1
+
+    if len(ends) < channels:
+        raise Exception(f"Cannot create {channels} channels between {pds} protection domains")
+
+    return ends
+
+
+def generate_system(case: BenchmarkCase, build_dir: Path) -> Path:
+    assert 1 <= case.pds <= MAX_PDS
+
+    for pd in range(case.pds):
+        write_program_image(build_dir / f"pd{pd}.elf", case.text_size, pd)
+
+    maps: Dict[int, List[str]] = {pd: [] for pd in range(case.pds)}
+    lines = ['<?xml version="1.0" encoding="UTF-8"?>', "<system>"]
+    for mr in range(case.mrs):
+        lines.append(f'    <memory_region name="mr{mr}" size="0x{PAGE_SIZE:x}" />')
+        pd = mr % case.pds
+        vaddr = MR_VADDR + (mr // case.pds) * PAGE_SIZE
+        maps[pd].append(f'<map mr="mr{mr}" vaddr="0x{vaddr:x}" perms="rw" />')
+    if case.large_mr_pages > 0:
+        lines.append(f'    <memory_region name="large" size="0x{case.large_mr_pages * PAGE_SIZE:x}" page_size="0x{PAGE_SIZE:x}" />')
+        maps[0].append(f'<map mr="large" vaddr="0x{LARGE_MR_VADDR:x}" perms="rw" />')
+
+    for pd in range(case.pds):
+        lines.append(f'    <protection_domain name="pd{pd}" priority="{100 + pd % 100}">')
+        lines.append(f'        <program_image path="pd{pd}.elf" />')
+        lines += [f"        {m}" for m in maps[pd]]
+        lines.append("    </protection_domain>")
+
+    for a, id_a, b, id_b in channel_ends(case.pds, case.channels):
+        lines.append(f'    <channel><end pd="pd{a}" id="{id_a}" /><end pd="pd{b}" id="{id_b}" /></channel>')
+    lines.append("</system>")
+
+    system = build_dir / "system.xml"
+    system.write_text("\n".join(lines) + "\n")
+    return system
+
+
+def report_value(report: str, section: str, label: str) -> int:
+    section_start = report.index(f"# {section}")
+    match = re.compile(rf"{re.escape(label)}\s*:\s*([\d,]+)").search(report, section_start)
+    assert match is not None, f"'{label}' not found in report section '{section}'"
+    return int(match.group(1).replace(",", ""))
+
+
+def run_case(case: BenchmarkCase, tool: List[str], env: Dict[str, str], board: str, config: str, build_dir: Path, repeat: int, tool_args: List[str]) -> BenchmarkResult:
+    if build_dir.exists():
+        rmtree(build_dir)
+    build_dir.mkdir(parents=True)
+    system = generate_system(case, build_dir)
+    report = build_dir / "report.txt"
+
+    cmd = tool + [str(system), "--board", board, "--config", config, "-o", str(build_dir / "loader.img"), "-r", str(report)] + tool_args
+    log = build_dir / "tool.log"
+    wall_times = []
+    peak_rss_kib = 0
+    for _ in range(repeat):
+        with log.open("wb") as f:
+            start = os.times().elapsed
+            p = Popen(cmd, cwd=build_dir, env=env, stdout=f, stderr=STDOUT)
+            # Reap the tool directly to get the resource usage of just this process.
+            _, status, rusage = os.wait4(p.pid, 0)
+            wall_times.append(os.times().elapsed - start)
+        p.returncode = os.waitstatus_to_exitcode(status)
+        if p.returncode != 0:
+            raise Exception(f"Tool failed for benchmark '{case.name}':\n{log.read_text()}")
+        # ru_maxrss is in bytes on macOS, and in KiB elsewhere.
+        peak_rss_kib = max(peak_rss_kib, rusage.ru_maxrss // 1024 if platform == "darwin" else rusage.ru_maxrss)
+
+    report_text = report.read_text()
+    return BenchmarkResult(
+        name=case.name,
+        pds=case.pds,
+        mrs=case.mrs,
+        channels=case.channels,
+        large_mr_pages=case.large_mr_pages,
+        wall_time=min(wall_times),
+        peak_rss_kib=peak_rss_kib,
+        builds=log.read_text().count("BUILT:"),
+        invocation_table_bytes=report_value(report_text, "System Kernel Invocations Summary", "size of invocations"),
+        kernel_objects=report_value(report_text, "Allocated Kernel Objects Summary", "# of allocated objects"),
+    )
+
+
+def compare(results: List[BenchmarkResult], baseline_path: Path, threshold: float) -> bool:
+    """Compare the results with a previous run. Returns False if any case
+    got slower, or used more memory, by more than 'threshold'."""
+    with baseline_path.open("r") as f:
+        baseline = {r["name"]: r for r in json_load(f)["results"]}
+
+    ok = True
+    for result in results:
+        if result.name not in baseline:
+            continue
+        for metric in ("wall_time", "peak_rss_kib", "invocation_table_bytes", "kernel_objects"):
+            old = baseline[result.name][metric]
+            new = getattr(result, metric)
+            change = (new - old) / old if old else 0
+            regressed = change > threshold
+            ok = ok and not regressed
+            fmt = ",.3f" if metric == "wall_time" else ",d"
+            print(f"    {result.name:20s} {metric:24s} {old:>14{fmt}} -> {new:>14{fmt}} ({change:+.1%}){' REGRESSION' if regressed else ''}")
+
+    return ok
+
+
+def main() -> int:
+    parser = ArgumentParser()
+    parser.add_argument("--sdk", type=Path, default=DEFAULT_SDK_PATH)
+    parser.add_argument("--board", default="qemu_arm_virt")
+    parser.add_argument("--config", default="debug")
+    parser.add_argument("--build-dir", type=Path, default=DEFAULT_BUILD_DIR)
+    parser.add_argument("--output", type=Path, default=Path("benchmark.json"))
+    parser.add_argument("--case", action="append", choices=[c.name for c in BENCHMARK_CASES], help="only run the given cases")
+    parser.add_argument("--repeat", type=int, default=3, help="number of runs of each case; the fastest is recorded")
+    parser.add_argument("--tool-from-source", action="store_true", default=False, help="run the tool from the Python source rather than from the SDK")
+    parser.add_argument("--baseline", type=Path, help="results of a previous run to compare against")
+    parser.add_argument("--threshold", type=float, default=0.2, help="relative increase of a metric that counts as a regression")
+    parser.add_argument("--compress", action="store_true", default=False, help="have the tool compress the loader image")
+    parser.add_argument("--jobs", type=int, help="number of processes the tool compresses the loader image with")
+    args = parser.parse_args()
+
+    env = os.environ.copy()
+    env["MICROKIT_SDK"] = str(args.sdk.absolute())
+    if args.tool_from_source:
+        env["PYTHONPATH"] = str(TOOL_SOURCE_DIR.absolute())
+        tool = [executable, "-m", "microkit"]
+    else:
+        tool = [str(args.sdk.absolute() / "bin" / "microkit")]
+
+    tool_args = []
+    if args.compress:
+        tool_args.append("--compress")
+    if args.jobs is not None:
+        tool_args += ["--jobs", str(args.jobs)]
+
+    cases = [c for c in BENCHMARK_CASES if args.case is None or c.name in args.case]
+    results = []
+    for case in cases:
+        result = run_case(case, tool, env, args.board, args.config, args.build_dir / case.name, args.repeat, tool_args)
+        print(f"{result.name:20s} {result.wall_time:8.3f}s {result.peak_rss_kib:10,d} KiB  builds={result.builds} "
+              f"invocations={result.invocation_table_bytes:,d} objects={result.kernel_objects:,d}")
+        results.append(result)
+
+    with args.output.open("w") as f:
+        json_dump({"board": args.board, "config": args.config, "tool_args": tool_args, "results": [asdict(r) for r in results]}, f, indent=4)
+
+    if args.baseline is not None:
+        print(f"Comparison against {args.baseline}:")
+        if not compare(results, args.baseline, args.threshold):
+            return 1
+
+    return 0
+
+
+if __name__ == "__main__":
+    exit(main())
@@ -0,0 +1,29 @@
+/*
+ * Copyright 2021, Breakaway Consulting Pty. Ltd.
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+/*
+ * The domain schedule of the kernel.
+ *
+ * This is a placeholder that runs only the first domain. The Microkit tool
+ * writes the domain schedule of the system over it, so the schedule has a
+ * fixed size and is weak, which stops the compiler from assuming the values
+ * here. Under MCS the length of each entry is in milliseconds.
+ *
+ * The placeholder entry is as long as a 32-bit word allows, about 49 days,
+ * so that systems without a domain schedule are not interrupted by domain
+ * switches. The kernel converts it to timer ticks in 64 bits, which does not
+ * overflow for timers of up to 4GHz.
+ */
+#include <config.h>
+#include <object/structures.h>
+#include <model/statedata.h>
+
+#define MICROKIT_MAX_DOMAIN_SCHEDULE 64
+
+const dschedule_t ksDomSchedule[MICROKIT_MAX_DOMAIN_SCHEDULE] __attribute__((weak)) = {
+    { .domain = 0, .length = 0xffffffff },
+};
+
+const word_t ksDomScheduleLength __attribute__((weak)) = 1;
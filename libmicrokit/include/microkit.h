@@ -32,6 +32,73 @@ typedef seL4_MessageInfo_t microkit_msginfo;
 
 #define MICROKIT_MAX_CHANNELS 62
 
+/* Labels for requests to the monitor, keep in sync with monitor/src/main.c */
+#define MICROKIT_MONITOR_LABEL_CPU_STATS 0x100
+#define MICROKIT_MONITOR_LABEL_MR_ALLOC 0x101
+#define MICROKIT_MONITOR_LABEL_MR_FREE 0x102
+
+typedef struct {
+    /* Total budget consumed by the PD, in microseconds */
+    uint64_t consumed;
+    /* Budget consumed since the calling PD's previous request about this PD */
+    uint64_t consumed_window;
+    /* Number of times the PD has been scheduled (benchmark kernels only) */
+    uint64_t schedules;
+    /* Number of times the PD has exhausted its budget (requires `timeout_faults`) */
+    uint64_t exhaustions;
+    char name[64];
+} microkit_cpu_stats;
+
+typedef struct {
+    /* Handle to pass to microkit_mr_free */
+    uint64_t handle;
+    /* Address of the region in the calling PD */
+    uintptr_t vaddr;
+    /* Address of the region in the peer PD, if the region is shared */
+    uintptr_t peer_vaddr;
+} microkit_mr;
+
+/*
+ * Layout of the monitor's fault log, for PDs that map the fault log memory
+ * region to decode it. Keep in sync with monitor/src/main.c.
+ */
+#define MICROKIT_FAULT_RECORD_MRS 8
+
+typedef struct {
+    seL4_Word sequence;
+    seL4_Word badge;
+    seL4_Word label;
+    seL4_Word timestamp;
+    seL4_Word mrs[MICROKIT_FAULT_RECORD_MRS];
+    seL4_UserContext regs;
+} microkit_fault_record;
+
+typedef struct {
+    seL4_Word count;
+    seL4_Word capacity;
+    microkit_fault_record records[];
+} microkit_fault_log;
+
+/*
+ * Layout of the monitor's budget stats, for PDs that map the budget stats
+ * memory region. `pds` is indexed by PD index, and histogram bucket n
+ * counts intervals between exhaustions of [2^n, 2^(n+1)) timestamp ticks.
+ * Keep in sync with monitor/src/main.c.
+ */
+#define MICROKIT_BUDGET_HISTOGRAM_BUCKETS 32
+
+typedef struct {
+    seL4_Word exhaustions;
+    seL4_Word last_timestamp;
+    seL4_Word consumed;
+    seL4_Word histogram[MICROKIT_BUDGET_HISTOGRAM_BUCKETS];
+} microkit_budget_stats;
+
+typedef struct {
+    seL4_Word count;
+    microkit_budget_stats pds[];
+} microkit_budget_stats_table;
+
 /* User provided functions */
 void init(void);
 void notified(microkit_channel ch);
@@ -187,6 +254,83 @@ microkit_mr_get(uint8_t mr)
     return seL4_GetMR(mr);
 }
 
+/*
+ * Query the monitor for the CPU usage of a PD. Requires the calling PD
+ * to have `cpu_stats` set in the system description.
+ *
+ * PDs are identified by their position in the system description,
+ * starting at 1. Returns false if there is no PD with that index.
+ */
+static inline bool
+microkit_cpu_stats_get(microkit_id pd, microkit_cpu_stats *stats)
+{
+    seL4_SetMR(0, pd);
+    seL4_Call(MONITOR_ENDPOINT_CAP, seL4_MessageInfo_new(MICROKIT_MONITOR_LABEL_CPU_STATS, 0, 0, 1));
+    if (seL4_GetMR(0) != 0) {
+        return false;
+    }
+
+    stats->consumed = seL4_GetMR(1);
+    stats->consumed_window = seL4_GetMR(2);
+    stats->schedules = seL4_GetMR(3);
+    stats->exhaustions = seL4_GetMR(4);
+    char *name = (char *)&__sel4_ipc_buffer->msg[5];
+    for (unsigned i = 0; i < sizeof(stats->name); i++) {
+        stats->name[i] = name[i];
+    }
+
+    return true;
+}
+
+static inline bool
+microkit_internal_mr_alloc(uint64_t size, bool shared, microkit_channel ch, microkit_mr *mr)
+{
+    seL4_SetMR(0, size);
+    seL4_SetMR(1, shared);
+    seL4_SetMR(2, ch);
+    seL4_Call(MONITOR_ENDPOINT_CAP, seL4_MessageInfo_new(MICROKIT_MONITOR_LABEL_MR_ALLOC, 0, 0, 3));
+    if (seL4_GetMR(0) != 0) {
+        return false;
+    }
+
+    mr->handle = seL4_GetMR(1);
+    mr->vaddr = seL4_GetMR(2);
+    mr->peer_vaddr = seL4_GetMR(3);
+    return true;
+}
+
+/*
+ * Ask the monitor for a new memory region of `size` bytes, mapped into
+ * the calling PD's MR window. Returns false if the region could not be
+ * allocated.
+ */
+static inline bool
+microkit_mr_alloc(uint64_t size, microkit_mr *mr)
+{
+    return microkit_internal_mr_alloc(size, false, 0, mr);
+}
+
+/*
+ * As microkit_mr_alloc, but the region is also mapped into the MR window
+ * of the PD at the other end of channel `ch`.
+ */
+static inline bool
+microkit_mr_alloc_shared(uint64_t size, microkit_channel ch, microkit_mr *mr)
+{
+    return microkit_internal_mr_alloc(size, true, ch, mr);
+}
+
+/*
+ * Unmap and free a memory region allocated by the calling PD.
+ */
+static inline bool
+microkit_mr_free(microkit_mr *mr)
+{
+    seL4_SetMR(0, mr->handle);
+    seL4_Call(MONITOR_ENDPOINT_CAP, seL4_MessageInfo_new(MICROKIT_MONITOR_LABEL_MR_FREE, 0, 0, 1));
+    return seL4_GetMR(0) == 0;
+}
+
 #if defined(CONFIG_ARM_HYPERVISOR_SUPPORT) || defined(CONFIG_RISCV_HYPERVISOR_SUPPORT)
 static inline void
 // @ivanv: the implementation of this is exactly the same as microkit_pd_restart (same
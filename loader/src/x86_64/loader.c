@@ -30,6 +30,15 @@ _Static_assert(sizeof(uintptr_t) == 8 || sizeof(uintptr_t) == 4, "Expect uintptr
 
 #define FLAG_SEL4_HYP (1UL << 0)
 
+/* Regions of type data are copied from the image. Regions of type zero
+ * have no data in the image, and are filled with zeros instead. Regions
+ * of type LZ4 are decompressed from the image. */
+#define REGION_TYPE_DATA 1
+#define REGION_TYPE_ZERO 2
+#define REGION_TYPE_LZ4 3
+
+#define LZ4_MIN_MATCH 4
+
 struct region {
     uintptr_t load_addr;
     uintptr_t size;
@@ -88,6 +97,78 @@ memcpy(void *dst, const void *src, size_t sz)
     }
 }
 
+static void
+memzero(void *dst, size_t sz)
+{
+    char *dst_ = dst;
+    while (sz > 0 && (uintptr_t)dst_ % sizeof(uintptr_t) != 0) {
+        *dst_++ = 0;
+        sz--;
+    }
+    uintptr_t *dst_word = (uintptr_t *)dst_;
+    while (sz >= sizeof(uintptr_t)) {
+        *dst_word++ = 0;
+        sz -= sizeof(uintptr_t);
+    }
+    dst_ = (char *)dst_word;
+    while (sz-- > 0) {
+        *dst_++ = 0;
+    }
+}
+
+/*
+ * Decompress an LZ4 block to 'dst_size' bytes at 'dst'. Returns the size of
+ * the compressed data.
+ *
+ * The block is a series of sequences, each a token, literals, and a match
+ * at an offset back in the output. The last sequence only has literals.
+ * Matches may overlap the bytes being written, so they are copied forwards
+ * one byte at a time.
+ */
+static uintptr_t
+lz4_decompress(void *dst, const void *src, uintptr_t dst_size)
+{
+    uint8_t *op = dst;
+    uint8_t *oend = op + dst_size;
+    const uint8_t *ip = src;
+
+    for (;;) {
+        uint8_t token = *ip++;
+        uintptr_t len = token >> 4;
+        if (len == 15) {
+            uint8_t extra;
+            do {
+                extra = *ip++;
+                len += extra;
+            } while (extra == 255);
+        }
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+        if (op >= oend) {
+            break;
+        }
+
+        uintptr_t offset = ip[0] | ((uintptr_t)ip[1] << 8);
+        ip += 2;
+        len = token & 0xf;
+        if (len == 15) {
+            uint8_t extra;
+            do {
+                extra = *ip++;
+                len += extra;
+            } while (extra == 255);
+        }
+        len += LZ4_MIN_MATCH;
+        const uint8_t *match = op - offset;
+        while (len-- > 0) {
+            *op++ = *match++;
+        }
+    }
+
+    return ip - (const uint8_t *)src;
+}
+
 #define SBI_CONSOLE_PUTCHAR 1
 
 #define SBI_CALL(which, arg0, arg1, arg2) ({            \
@@ -207,16 +288,51 @@ print_loader_data(void)
     }
 }
 
+/* Returns the count of the timer */
+static uint64_t
+timer_ticks(void)
+{
+    uint64_t ticks;
+    asm volatile("rdtime %0" : "=r"(ticks));
+    return ticks;
+}
+
 static void
 copy_data(void)
 {
     const void *base = &loader_data->regions[loader_data->num_regions];
     for (uint32_t i = 0; i < loader_data->num_regions; i++) {
         const struct region *r = &loader_data->regions[i];
-        puts("LDR|INFO: copying region ");
-        puthex32(i);
-        puts("\n");
-        memcpy((void *)(uintptr_t)r->load_addr, base + r->offset, r->size);
+        if (r->type == REGION_TYPE_ZERO) {
+            puts("LDR|INFO: zeroing region ");
+            puthex32(i);
+            puts("\n");
+            memzero((void *)(uintptr_t)r->load_addr, r->size);
+        } else if (r->type == REGION_TYPE_LZ4) {
+            puts("LDR|INFO: decompressing region ");
+            puthex32(i);
+            puts("\n");
+            uint64_t start = timer_ticks();
+            uintptr_t compressed_size = lz4_decompress((void *)(uintptr_t)r->load_addr, base + r->offset, r->size);
+            uint64_t ticks = timer_ticks() - start;
+            puts("LDR|INFO:   compressed size: ");
+            puthex64(compressed_size);
+            puts("   uncompressed size: ");
+            puthex64(r->size);
+            puts("   ticks: ");
+            puthex64(ticks);
+            puts("\n");
+        } else if ((uintptr_t)r->load_addr == (uintptr_t)(base + r->offset)) {
+            /* The image was loaded with the region already in place */
+            puts("LDR|INFO: region in place ");
+            puthex32(i);
+            puts("\n");
+        } else {
+            puts("LDR|INFO: copying region ");
+            puthex32(i);
+            puts("\n");
+            memcpy((void *)(uintptr_t)r->load_addr, base + r->offset, r->size);
+        }
     }
 }
 
@@ -59,13 +59,18 @@
 #define __thread
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <sel4/sel4.h>
+#if defined(CONFIG_BENCHMARK_TRACK_UTILISATION)
+#include <sel4/benchmark_utilisation_types.h>
+#endif
 
 #include "util.h"
 #include "debug.h"
 
 #define MAX_PDS 64
+#define MAX_CHANNELS 64
 #define MAX_NAME_LEN 64
 #define MAX_TCBS 64
 
@@ -81,6 +86,17 @@
  */
 #define BOOTSTRAP_INVOCATION_DATA_SIZE 150
 
+/*
+ * Labels for requests made to the monitor by PDs over the
+ * monitor endpoint. These must not overlap with the seL4 fault
+ * labels as requests arrive on the same endpoint as faults.
+ *
+ * Keep in sync with libmicrokit/include/microkit.h.
+ */
+#define MONITOR_LABEL_CPU_STATS 0x100
+#define MONITOR_LABEL_MR_ALLOC 0x101
+#define MONITOR_LABEL_MR_FREE 0x102
+
 seL4_IPCBuffer *__sel4_ipc_buffer;
 
 char _stack[4096];
@@ -113,6 +129,181 @@ seL4_Word *system_invocation_data = (void*)0x80000000;
 
 struct untyped_info untyped_info;
 
+/*
+ * Per-PD CPU accounting.
+ *
+ * The monitor has no timer of its own, so sampling is driven by
+ * the consumers: each CPU stats request samples the scheduling
+ * context of the PD asked about. Reading the consumed time from the
+ * kernel resets it, as does a timeout fault, so the monitor keeps the
+ * total. The 'window' is the time since the previous request from the
+ * same PD about the same PD, so that consumers do not disturb each
+ * other.
+ */
+struct cpu_stats {
+    uint64_t consumed;        /* total budget consumed (microseconds) */
+    uint64_t schedules;       /* times scheduled (benchmark kernels only) */
+};
+
+static struct cpu_stats cpu_stats[MAX_PDS];
+/* The total consumed by each PD when each PD last asked about it */
+static uint64_t cpu_stats_seen[MAX_PDS][MAX_PDS];
+
+/*
+ * Binary fault log.
+ *
+ * When the system description names a fault log memory region, the
+ * build tool maps it into the monitor and patches `fault_log` and
+ * `fault_log_size`. Each fault is written as a fixed size record
+ * into a ring in this region so that it can be decoded later by a
+ * (low priority) logger PD, or on the host from a memory dump.
+ *
+ * `count` is the total number of records ever written; the record
+ * for sequence number n lives in slot n % capacity. The sequence
+ * number is stored in the record so readers can detect records that
+ * were overwritten while being read.
+ *
+ * Keep in sync with libmicrokit/include/microkit.h.
+ */
+#define FAULT_RECORD_MRS 8
+
+struct fault_record {
+    seL4_Word sequence;
+    seL4_Word badge;
+    seL4_Word label;
+    seL4_Word timestamp;
+    seL4_Word mrs[FAULT_RECORD_MRS];
+    seL4_UserContext regs;
+};
+
+struct fault_log {
+    seL4_Word count;
+    seL4_Word capacity;
+    struct fault_record records[];
+};
+
+struct fault_log *fault_log;
+seL4_Word fault_log_size;
+/* When false faults are only written to the fault log */
+bool fault_uart = true;
+
+/*
+ * Budget statistics.
+ *
+ * A PD with `timeout_faults` set raises a timeout fault to the monitor
+ * each time it exhausts its budget. The monitor counts these, keeps a
+ * histogram of the time between them, and then resumes the PD. When the
+ * system description names a budget stats memory region the build tool
+ * maps it into the monitor and patches `budget_stats` and
+ * `budget_stats_size`, so that the table can be read by other PDs.
+ * Otherwise the table is private to the monitor.
+ *
+ * The table is indexed by PD index. Histogram bucket n counts intervals
+ * of [2^n, 2^(n+1)) timestamp ticks, with the last bucket also counting
+ * any longer interval.
+ *
+ * Keep in sync with libmicrokit/include/microkit.h.
+ */
+#define BUDGET_HISTOGRAM_BUCKETS 32
+
+struct budget_stats {
+    seL4_Word exhaustions;
+    seL4_Word last_timestamp;
+    seL4_Word consumed;       /* budget consumed, as reported by the last timeout fault */
+    seL4_Word histogram[BUDGET_HISTOGRAM_BUCKETS];
+};
+
+struct budget_stats_table {
+    seL4_Word count;
+    struct budget_stats pds[MAX_PDS];
+};
+
+struct budget_stats_table *budget_stats;
+seL4_Word budget_stats_size;
+static struct budget_stats_table budget_stats_private;
+
+/*
+ * Dynamic memory regions.
+ *
+ * The monitor owns a reserve of memory, split by the build tool into
+ * untyped 'blocks' of the large page size. A PD with an MR window can
+ * ask the monitor for a new memory region, which is mapped into its
+ * window and optionally into the window of the PD at the other end of
+ * one of its channels.
+ *
+ * Each allocation uses whole blocks and whole large page sized slots
+ * of the windows, so a block can be reclaimed simply by revoking its
+ * untyped cap, which deletes (and so unmaps) every frame derived from
+ * it. When a window slot does not already have a page table, and the
+ * allocation covers the whole block, the block is mapped as a single
+ * large page. Page tables come from a pool created by the build tool
+ * and are never returned.
+ *
+ * Keep in sync with libmicrokit/include/microkit.h and the tool.
+ */
+#define MR_BLOCK_SIZE 0x200000
+#define MR_SMALL_PAGE_SIZE 0x1000
+#define MR_BLOCK_FRAMES (MR_BLOCK_SIZE / MR_SMALL_PAGE_SIZE)
+/* Slots for the frames of a block and a copy of each for mapping into the peer */
+#define MR_BLOCK_SLOTS (2 * MR_BLOCK_FRAMES)
+#define MAX_MR_BLOCKS 256
+#define MAX_MR_WINDOW_SLOTS 64
+#define MAX_MR_ALLOCATIONS 64
+
+#if defined(ARCH_aarch64)
+#define MR_SMALL_PAGE_OBJECT seL4_ARM_SmallPageObject
+#define MR_LARGE_PAGE_OBJECT seL4_ARM_LargePageObject
+#define MR_VM_ATTRIBUTES seL4_ARM_Default_VMAttributes
+#define mr_page_map seL4_ARM_Page_Map
+#define mr_page_table_map seL4_ARM_PageTable_Map
+#elif defined(ARCH_riscv64)
+#define MR_SMALL_PAGE_OBJECT seL4_RISCV_4K_Page
+#define MR_LARGE_PAGE_OBJECT seL4_RISCV_Mega_Page
+#define MR_VM_ATTRIBUTES seL4_RISCV_Default_VMAttributes
+#define mr_page_map seL4_RISCV_Page_Map
+#define mr_page_table_map seL4_RISCV_PageTable_Map
+#else
+#error "the MR service is not implemented for this architecture"
+#endif
+
+struct mr_config {
+    seL4_Word root_cnode;
+    seL4_Word cap_address_mask;
+    seL4_Word frame_slot_start;
+    seL4_Word block_cap_start;
+    seL4_Word block_count;
+    seL4_Word pt_cap_start;
+    seL4_Word pt_count;
+};
+
+struct mr_window {
+    seL4_Word vaddr;
+    seL4_Word size;
+};
+
+struct mr_allocation {
+    bool used;
+    seL4_Word owner;
+    seL4_Word peer; /* 0 if the region is not shared */
+    seL4_Word block;
+    seL4_Word count;
+    seL4_Word owner_slot;
+    seL4_Word peer_slot;
+};
+
+seL4_Word vspaces[MAX_PDS];
+struct mr_window mr_windows[MAX_PDS];
+/* Index of the PD at the other end of each channel, 0 if none */
+uint8_t channel_peers[MAX_PDS][MAX_CHANNELS];
+struct mr_config mr_config;
+
+static struct mr_allocation mr_allocations[MAX_MR_ALLOCATIONS];
+static bool mr_block_used[MAX_MR_BLOCKS];
+/* Bitmaps of the large page sized slots of each PD's window */
+static uint64_t mr_window_used[MAX_PDS];
+static uint64_t mr_window_has_pt[MAX_PDS];
+static seL4_Word mr_pt_next;
+
 static char *
 ec_to_string(uintptr_t ec)
 {
@@ -492,6 +683,448 @@ print_registers(seL4_UserContext regs)
 #endif
 }
 
+/*
+ * Timestamps are read from a counter that the kernel lets user level read:
+ * the physical or virtual counter on AArch64, and the time CSR on RISC-V.
+ * HAVE_TIMESTAMP is 0 on AArch64 kernels that export neither counter.
+ */
+#if defined(ARCH_aarch64)
+#if defined(CONFIG_EXPORT_PCNT_USER) || defined(CONFIG_EXPORT_VCNT_USER)
+#define HAVE_TIMESTAMP 1
+#else
+#define HAVE_TIMESTAMP 0
+#endif
+#elif defined(ARCH_riscv64)
+#define HAVE_TIMESTAMP 1
+#else
+#error "timestamp() is not implemented for this architecture"
+#endif
+
+static seL4_Word
+timestamp(void)
+{
+    seL4_Word cnt;
+#if defined(ARCH_aarch64) && defined(CONFIG_EXPORT_PCNT_USER)
+    asm volatile("mrs %0, cntpct_el0" : "=r"(cnt));
+#elif defined(ARCH_aarch64) && defined(CONFIG_EXPORT_VCNT_USER)
+    asm volatile("mrs %0, cntvct_el0" : "=r"(cnt));
+#elif defined(ARCH_riscv64)
+    asm volatile("rdtime %0" : "=r"(cnt));
+#else
+    /* No user accessible counter, readers can still order by sequence number */
+    cnt = 0;
+#endif
+    return cnt;
+}
+
+static void
+fault_log_init(void)
+{
+    if (fault_log == NULL) {
+        return;
+    }
+
+    fault_log->count = 0;
+    fault_log->capacity = (fault_log_size - sizeof(struct fault_log)) / sizeof(struct fault_record);
+    if (fault_log->capacity == 0) {
+        fail("fault log too small to hold a record");
+    }
+
+    puts("MON|INFO: fault log capacity: ");
+    puthex32(fault_log->capacity);
+    puts(" records\n");
+}
+
+static void
+fault_log_write(seL4_Word badge, seL4_Word label, seL4_MessageInfo_t tag)
+{
+    seL4_Word seq = fault_log->count;
+    struct fault_record *record = &fault_log->records[seq % fault_log->capacity];
+    seL4_Word length = seL4_MessageInfo_get_length(tag);
+
+    /* The fault MRs must be saved before reading the registers clobbers them */
+    record->sequence = seq;
+    record->badge = badge;
+    record->label = label;
+    record->timestamp = timestamp();
+    for (unsigned i = 0; i < FAULT_RECORD_MRS; i++) {
+        record->mrs[i] = i < length ? seL4_GetMR(i) : 0;
+    }
+
+    if (badge < MAX_PDS && pd_names[badge][0] != 0) {
+        seL4_TCB_ReadRegisters(tcbs[badge], false, 0, sizeof(seL4_UserContext) / sizeof(seL4_Word), &record->regs);
+    } else {
+        /* volatile so the compiler does not turn this into a call to memset */
+        volatile seL4_Word *regs = (seL4_Word *)&record->regs;
+        for (unsigned i = 0; i < sizeof(seL4_UserContext) / sizeof(seL4_Word); i++) {
+            regs[i] = 0;
+        }
+    }
+
+    /* Publish the record only once it is complete */
+    __atomic_store_n(&fault_log->count, seq + 1, __ATOMIC_RELEASE);
+}
+
+static void
+budget_stats_init(void)
+{
+    if (budget_stats == NULL) {
+        budget_stats = &budget_stats_private;
+        return;
+    }
+
+    if (budget_stats_size < sizeof(struct budget_stats_table)) {
+        fail("budget stats region too small to hold the table");
+    }
+
+    /* volatile so the compiler does not turn this into a call to memset */
+    volatile seL4_Word *table = (seL4_Word *)budget_stats;
+    for (unsigned i = 0; i < sizeof(struct budget_stats_table) / sizeof(seL4_Word); i++) {
+        table[i] = 0;
+    }
+    budget_stats->count = MAX_PDS;
+}
+
+/*
+ * Record a budget exhaustion. This must be called before anything else
+ * overwrites the timeout fault's message registers.
+ */
+static void
+budget_stats_record(seL4_Word badge)
+{
+    struct budget_stats *stats = &budget_stats->pds[badge];
+    seL4_Word now = timestamp();
+    seL4_Word consumed = seL4_GetMR(seL4_Timeout_Consumed);
+
+    /* Without a counter every interval would be 0, so there is no histogram */
+    if (HAVE_TIMESTAMP && stats->exhaustions != 0) {
+        seL4_Word interval = now - stats->last_timestamp;
+        unsigned bucket = interval == 0 ? 0 : 63 - __builtin_clzl(interval);
+        if (bucket >= BUDGET_HISTOGRAM_BUCKETS) {
+            bucket = BUDGET_HISTOGRAM_BUCKETS - 1;
+        }
+        stats->histogram[bucket]++;
+    }
+    stats->consumed = consumed;
+    stats->last_timestamp = now;
+    /* The kernel resets the consumed time of the PD for the fault message */
+    cpu_stats[badge].consumed += consumed;
+    __atomic_store_n(&stats->exhaustions, stats->exhaustions + 1, __ATOMIC_RELEASE);
+}
+
+static void
+sample_cpu_stats(seL4_Word idx)
+{
+    seL4_SchedContext_Consumed_t ret = seL4_SchedContext_Consumed(scheduling_contexts[idx]);
+    if (ret.error != seL4_NoError) {
+        puts("MON|ERROR: could not read consumed time for PD '");
+        puts(pd_names[idx]);
+        puts("'\n");
+        return;
+    }
+    cpu_stats[idx].consumed += ret.consumed;
+
+#if defined(CONFIG_BENCHMARK_TRACK_UTILISATION)
+    seL4_BenchmarkGetThreadUtilisation(tcbs[idx]);
+    uint64_t *buffer = (uint64_t *)&__sel4_ipc_buffer->msg[0];
+    cpu_stats[idx].schedules = buffer[BENCHMARK_TCB_NUMBER_SCHEDULES];
+#endif
+}
+
+/*
+ * Reply to a CPU stats request. MR0 holds the index of the PD to
+ * report on. The reply holds a status word (0 on success) followed
+ * by the PD's total consumed time, the time it consumed since the
+ * caller's previous request about it, the number of times it has been
+ * scheduled, its budget exhaustion count and its name.
+ */
+static void
+handle_cpu_stats(seL4_Word badge)
+{
+    seL4_Word idx = seL4_GetMR(0);
+
+    if (badge >= MAX_PDS || idx == 0 || idx >= MAX_PDS || pd_names[idx][0] == 0) {
+        seL4_SetMR(0, 1);
+        seL4_Send(reply, seL4_MessageInfo_new(0, 0, 0, 1));
+        return;
+    }
+
+    sample_cpu_stats(idx);
+    uint64_t consumed = cpu_stats[idx].consumed;
+    uint64_t consumed_window = consumed - cpu_stats_seen[badge][idx];
+    cpu_stats_seen[badge][idx] = consumed;
+
+    seL4_SetMR(0, 0);
+    seL4_SetMR(1, consumed);
+    seL4_SetMR(2, consumed_window);
+    seL4_SetMR(3, cpu_stats[idx].schedules);
+    seL4_SetMR(4, budget_stats->pds[idx].exhaustions);
+    char *name = (char *)&__sel4_ipc_buffer->msg[5];
+    for (unsigned i = 0; i < MAX_NAME_LEN; i++) {
+        name[i] = pd_names[idx][i];
+    }
+    seL4_Send(reply, seL4_MessageInfo_new(0, 0, 0, 5 + MAX_NAME_LEN / sizeof(seL4_Word)));
+}
+
+static int
+mr_find_free_blocks(seL4_Word count)
+{
+    for (seL4_Word start = 0; start + count <= mr_config.block_count; start++) {
+        seL4_Word i = 0;
+        while (i < count && !mr_block_used[start + i]) {
+            i++;
+        }
+        if (i == count) {
+            return start;
+        }
+    }
+    return -1;
+}
+
+static int
+mr_find_free_window_slots(seL4_Word pd, seL4_Word count)
+{
+    seL4_Word slots = mr_windows[pd].size / MR_BLOCK_SIZE;
+    for (seL4_Word start = 0; start + count <= slots; start++) {
+        seL4_Word i = 0;
+        while (i < count && !(mr_window_used[pd] & (1ULL << (start + i)))) {
+            i++;
+        }
+        if (i == count) {
+            return start;
+        }
+    }
+    return -1;
+}
+
+static void
+mr_window_mark(seL4_Word pd, seL4_Word slot, seL4_Word count, bool used)
+{
+    for (seL4_Word i = slot; i < slot + count; i++) {
+        if (used) {
+            mr_window_used[pd] |= 1ULL << i;
+        } else {
+            mr_window_used[pd] &= ~(1ULL << i);
+        }
+    }
+}
+
+static bool
+mr_window_has_page_table(seL4_Word pd, seL4_Word slot)
+{
+    return mr_window_has_pt[pd] & (1ULL << slot);
+}
+
+static seL4_Error
+mr_map_block(seL4_Word pd, seL4_Word slot, seL4_Word frame_cap, seL4_Word frames, bool large)
+{
+    seL4_Error err;
+    seL4_Word vaddr = mr_windows[pd].vaddr + slot * MR_BLOCK_SIZE;
+
+    if (large) {
+        return mr_page_map(frame_cap, vspaces[pd], vaddr, seL4_ReadWrite, MR_VM_ATTRIBUTES);
+    }
+
+    if (!mr_window_has_page_table(pd, slot)) {
+        if (mr_pt_next == mr_config.pt_count) {
+            return seL4_NotEnoughMemory;
+        }
+        err = mr_page_table_map(mr_config.pt_cap_start + mr_pt_next, vspaces[pd], vaddr, MR_VM_ATTRIBUTES);
+        if (err != seL4_NoError) {
+            return err;
+        }
+        mr_pt_next++;
+        mr_window_has_pt[pd] |= 1ULL << slot;
+    }
+
+    for (seL4_Word i = 0; i < frames; i++) {
+        err = mr_page_map(frame_cap + i, vspaces[pd], vaddr + i * MR_SMALL_PAGE_SIZE, seL4_ReadWrite, MR_VM_ATTRIBUTES);
+        if (err != seL4_NoError) {
+            return err;
+        }
+    }
+
+    return seL4_NoError;
+}
+
+/* Revoking a block deletes every frame retyped from it, which unmaps them */
+static void
+mr_release(struct mr_allocation *allocation)
+{
+    for (seL4_Word i = allocation->block; i < allocation->block + allocation->count; i++) {
+        if (!mr_block_used[i]) {
+            continue;
+        }
+        seL4_Error err = seL4_CNode_Revoke(mr_config.root_cnode, mr_config.block_cap_start + i, seL4_WordBits);
+        if (err != seL4_NoError) {
+            fail("could not revoke MR reserve block");
+        }
+        mr_block_used[i] = false;
+    }
+    mr_window_mark(allocation->owner, allocation->owner_slot, allocation->count, false);
+    if (allocation->peer != 0) {
+        mr_window_mark(allocation->peer, allocation->peer_slot, allocation->count, false);
+    }
+    allocation->used = false;
+}
+
+static seL4_Error
+mr_populate(struct mr_allocation *allocation, seL4_Word size)
+{
+    seL4_Error err;
+
+    for (seL4_Word k = 0; k < allocation->count; k++) {
+        seL4_Word block = allocation->block + k;
+        seL4_Word remaining = size - k * MR_BLOCK_SIZE;
+        seL4_Word owner_slot = allocation->owner_slot + k;
+        seL4_Word peer_slot = allocation->peer_slot + k;
+        bool large = remaining >= MR_BLOCK_SIZE && !mr_window_has_page_table(allocation->owner, owner_slot) &&
+                     (allocation->peer == 0 || !mr_window_has_page_table(allocation->peer, peer_slot));
+        seL4_Word frames = large ? 1 : (remaining < MR_BLOCK_SIZE ? remaining : MR_BLOCK_SIZE) / MR_SMALL_PAGE_SIZE;
+        seL4_Word slot = mr_config.frame_slot_start + block * MR_BLOCK_SLOTS;
+        seL4_Word frame_cap = mr_config.cap_address_mask | slot;
+
+        mr_block_used[block] = true;
+        for (seL4_Word i = 0; i < frames; i += CONFIG_RETYPE_FAN_OUT_LIMIT) {
+            seL4_Word n = frames - i < CONFIG_RETYPE_FAN_OUT_LIMIT ? frames - i : CONFIG_RETYPE_FAN_OUT_LIMIT;
+            err = seL4_Untyped_Retype(mr_config.block_cap_start + block, large ? MR_LARGE_PAGE_OBJECT : MR_SMALL_PAGE_OBJECT,
+                                      0, mr_config.root_cnode, 1, 1, slot + i, n);
+            if (err != seL4_NoError) {
+                return err;
+            }
+        }
+
+        err = mr_map_block(allocation->owner, owner_slot, frame_cap, frames, large);
+        if (err != seL4_NoError) {
+            return err;
+        }
+
+        if (allocation->peer == 0) {
+            continue;
+        }
+
+        for (seL4_Word i = 0; i < frames; i++) {
+            err = seL4_CNode_Copy(mr_config.root_cnode, frame_cap + MR_BLOCK_FRAMES + i, seL4_WordBits,
+                                  mr_config.root_cnode, frame_cap + i, seL4_WordBits, seL4_AllRights);
+            if (err != seL4_NoError) {
+                return err;
+            }
+        }
+        err = mr_map_block(allocation->peer, peer_slot, frame_cap + MR_BLOCK_FRAMES, frames, large);
+        if (err != seL4_NoError) {
+            return err;
+        }
+    }
+
+    return seL4_NoError;
+}
+
+static void
+mr_reply(seL4_Word status, seL4_Word handle, seL4_Word vaddr, seL4_Word peer_vaddr)
+{
+    seL4_SetMR(0, status);
+    seL4_SetMR(1, handle);
+    seL4_SetMR(2, vaddr);
+    seL4_SetMR(3, peer_vaddr);
+    seL4_Send(reply, seL4_MessageInfo_new(0, 0, 0, 4));
+}
+
+/*
+ * MR0 holds the size of the region, MR1 is non-zero if the region is to be
+ * shared over the channel in MR2. The reply holds a status word (0 on success),
+ * a handle for freeing the region, and the region's address in each PD.
+ */
+static void
+handle_mr_alloc(seL4_Word owner)
+{
+    seL4_Word size = seL4_GetMR(0);
+    bool shared = seL4_GetMR(1) != 0;
+    seL4_Word ch = seL4_GetMR(2);
+    seL4_Word peer = 0;
+
+    if (owner >= MAX_PDS || mr_windows[owner].size == 0 || size == 0 || size % MR_SMALL_PAGE_SIZE != 0) {
+        mr_reply(1, 0, 0, 0);
+        return;
+    }
+    if (shared) {
+        peer = ch < MAX_CHANNELS ? channel_peers[owner][ch] : 0;
+        if (peer == 0 || mr_windows[peer].size == 0) {
+            mr_reply(1, 0, 0, 0);
+            return;
+        }
+    }
+
+    struct mr_allocation *allocation = NULL;
+    for (unsigned i = 0; i < MAX_MR_ALLOCATIONS; i++) {
+        if (!mr_allocations[i].used) {
+            allocation = &mr_allocations[i];
+            break;
+        }
+    }
+
+    seL4_Word count = (size + MR_BLOCK_SIZE - 1) / MR_BLOCK_SIZE;
+    int block = mr_find_free_blocks(count);
+    int owner_slot = mr_find_free_window_slots(owner, count);
+    int peer_slot = 0;
+    if (peer != 0) {
+        /* Mark the owner's slots first in case owner and peer are the same PD */
+        if (owner_slot >= 0) {
+            mr_window_mark(owner, owner_slot, count, true);
+        }
+        peer_slot = mr_find_free_window_slots(peer, count);
+        if (owner_slot >= 0) {
+            mr_window_mark(owner, owner_slot, count, false);
+        }
+    }
+    if (allocation == NULL || block < 0 || owner_slot < 0 || peer_slot < 0) {
+        mr_reply(2, 0, 0, 0);
+        return;
+    }
+
+    allocation->used = true;
+    allocation->owner = owner;
+    allocation->peer = peer;
+    allocation->block = block;
+    allocation->count = count;
+    allocation->owner_slot = owner_slot;
+    allocation->peer_slot = peer_slot;
+    mr_window_mark(owner, owner_slot, count, true);
+    if (peer != 0) {
+        mr_window_mark(peer, peer_slot, count, true);
+    }
+
+    seL4_Error err = mr_populate(allocation, size);
+    if (err != seL4_NoError) {
+        puts("MON|ERROR: could not allocate memory region for PD '");
+        puts(pd_names[owner]);
+        puts("': ");
+        puts(sel4_strerror(err));
+        puts("\n");
+        mr_release(allocation);
+        mr_reply(3, 0, 0, 0);
+        return;
+    }
+
+    mr_reply(0, allocation - mr_allocations,
+             mr_windows[owner].vaddr + owner_slot * MR_BLOCK_SIZE,
+             peer == 0 ? 0 : mr_windows[peer].vaddr + peer_slot * MR_BLOCK_SIZE);
+}
+
+/* MR0 holds the handle returned by the allocation. Only the owner may free a region. */
+static void
+handle_mr_free(seL4_Word owner)
+{
+    seL4_Word handle = seL4_GetMR(0);
+
+    if (handle >= MAX_MR_ALLOCATIONS || !mr_allocations[handle].used || mr_allocations[handle].owner != owner) {
+        mr_reply(1, 0, 0, 0);
+        return;
+    }
+
+    mr_release(&mr_allocations[handle]);
+    mr_reply(0, handle, 0, 0);
+}
+
 static void
 monitor(void)
 {
@@ -503,6 +1136,21 @@ monitor(void)
         tag = seL4_Recv(fault_ep, &badge, reply);
         label = seL4_MessageInfo_get_label(tag);
 
+        if (label == MONITOR_LABEL_CPU_STATS) {
+            handle_cpu_stats(badge);
+            continue;
+        }
+
+        if (label == MONITOR_LABEL_MR_ALLOC) {
+            handle_mr_alloc(badge);
+            continue;
+        }
+
+        if (label == MONITOR_LABEL_MR_FREE) {
+            handle_mr_free(badge);
+            continue;
+        }
+
         seL4_Word tcb_cap = tcbs[badge];
 
         if (label == seL4_Fault_NullFault && badge < MAX_PDS) {
@@ -519,6 +1167,25 @@ monitor(void)
             continue;
         }
 
+        if (label == seL4_Fault_Timeout && badge < MAX_PDS) {
+            /* A budget exhaustion is expected behaviour, so it is logged but not reported */
+            budget_stats_record(badge);
+            if (fault_log != NULL) {
+                fault_log_write(badge, label, tag);
+            }
+            /* Replying resumes the PD once its budget is replenished */
+            seL4_Send(reply, seL4_MessageInfo_new(0, 0, 0, 0));
+            continue;
+        }
+
+        if (fault_log != NULL) {
+            fault_log_write(badge, label, tag);
+        }
+
+        if (!fault_uart) {
+            continue;
+        }
+
         puts("MON|ERROR: received message ");
         puthex32(label);
         puts("  badge: ");
@@ -697,5 +1364,8 @@ main(seL4_BootInfo *bi)
 
     puts("MON|INFO: completed system invocations\n");
 
+    fault_log_init();
+    budget_stats_init();
+
     monitor();
 }
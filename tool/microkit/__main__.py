@@ -40,21 +40,24 @@ import sys
 import os
 from argparse import ArgumentParser
 from pathlib import Path
-from dataclasses import dataclass
-from struct import pack, Struct
+from dataclasses import dataclass, replace
+from struct import calcsize, pack, Struct
+from hashlib import sha256
 from os import environ
 from math import log2, ceil
 from sys import argv, executable, stderr
-from json import load as json_load
+from json import load as json_load, dumps as json_dumps
 
-from typing import Dict, List, Optional, Tuple, Union
+from typing import Dict, FrozenSet, List, Optional, Sequence, TextIO, Tuple, Union
 
-from microkit.elf import ElfFile
+from microkit.elf import ElfFile, ElfSegment
+from microkit.cache import BuildCache, CachedBuild, CachedRegion, cache_key, elf_layout
 from microkit.util import kb, mb, lsb, msb, round_up, round_down, mask_bits, is_power_of_two, MemoryRegion, UserError
 from microkit.sel4 import (
     Sel4Aarch64Regs,
     Sel4RiscvRegs,
     Sel4Invocation,
+    serialise_invocations,
     Sel4ARMPageTableMap,
     Sel4RISCVPageTableMap,
     Sel4TcbSetSchedParams,
@@ -64,6 +67,7 @@ from microkit.sel4 import (
     Sel4RISCVTcbWriteRegisters,
     Sel4AsidPoolAssign,
     Sel4TcbBindNotification,
+    Sel4TcbSetTimeoutEndpoint,
     Sel4TcbResume,
     Sel4CnodeMint,
     Sel4CnodeCopy,
@@ -73,6 +77,7 @@ from microkit.sel4 import (
     Sel4SchedControlConfigureFlags,
     Sel4ArmVcpuSetTcb,
     Sel4RiscvVcpuSetTcb,
+    Sel4DomainSetSet,
     Sel4PageMap,
     emulate_kernel_boot,
     emulate_kernel_boot_partial,
@@ -91,6 +96,7 @@ from microkit.sel4 import (
     INIT_VSPACE_CAP_ADDRESS,
     INIT_ASID_POOL_CAP_ADDRESS,
     IRQ_CONTROL_CAP_ADDRESS,
+    DOMAIN_CAP_ADDRESS,
     SMC_CAP_ADDRESS,
     SEL4_SLOT_SIZE,
     SEL4_RIGHTS_ALL,
@@ -103,9 +109,11 @@ from microkit.sel4 import (
     SEL4_RISCV_EXECUTE_NEVER,
     SEL4_OBJECT_TYPE_NAMES,
 )
-from microkit.sysxml import ProtectionDomain, xml2system, SystemDescription, PlatformDescription
+from microkit.sysxml import ProtectionDomain, VirtualMachine, xml2system, SystemDescription, PlatformDescription, MR_BLOCK_SIZE
 from microkit.sysxml import SysMap, SysMemoryRegion # This shouldn't be needed here as such
-from microkit.loader import Loader, _check_non_overlapping
+from microkit.loader import Loader, LoaderData, _check_non_overlapping
+from microkit.sched import SchedAnalysis, analyse_schedulability
+from microkit.placement import place_domains, placed_system_xml
 
 # This is a workaround for: https://github.com/indygreg/PyOxidizer/issues/307
 # Basically, pyoxidizer generates code that results in argv[0] being set to None.
@@ -157,6 +165,32 @@ BASE_TCB_CAP = BASE_IRQ_CAP + 64
 BASE_VM_TCB_CAP = BASE_TCB_CAP + 64
 BASE_VCPU_CAP = BASE_VM_TCB_CAP + 64
 MAX_SYSTEM_INVOCATION_SIZE = mb(128)
+# The fault log is mapped into the monitor directly after the largest possible
+# invocation table, followed by the budget stats. Both are below the monitor image.
+MONITOR_FAULT_LOG_VADDR = 0x8000_0000 + MAX_SYSTEM_INVOCATION_SIZE
+MONITOR_BUDGET_STATS_VADDR = MONITOR_FAULT_LOG_VADDR + 0x200_000
+# The monitor's budget stats table has a count, then for each of its PDs
+# the exhaustions, last timestamp, budget consumed and a histogram, all
+# words. Keep in sync with monitor/src/main.c.
+MONITOR_MAX_PDS = 64
+MONITOR_BUDGET_HISTOGRAM_BUCKETS = 32
+# Each block of the monitor's MR reserve has enough cap slots for the
+# small pages of the block, and a copy of each to map into a peer. These
+# are reserved in the system CNode up front, which is 1024 slots (32KiB on
+# 64-bit) for each 2MiB of the reserve, so 8MiB of CNode for the largest
+# reserve. Keep in sync with monitor/src/main.c.
+MR_BLOCK_SLOTS = 2 * (MR_BLOCK_SIZE // 0x1000)
+# Headroom added to the sizes measured by the first build of the system, to
+# cover the extra caps and invocations that growing the sizes causes.
+SIZING_HEADROOM_INVOCATION_DATA = kb(4)
+SIZING_HEADROOM_CAPS = 64
+# Symbols of a PD program image that the tool reads or patches, in
+# addition to any setvar symbols.
+PD_ELF_SYMBOLS = ("__sel4_ipc_buffer_obj", "microkit_name", "passive")
+# The domain schedule of the kernel, which the SDK builds with room for a
+# fixed number of entries.
+KERNEL_DOMAIN_SCHEDULE_SYMBOL = "ksDomSchedule"
+KERNEL_DOMAIN_SCHEDULE_LENGTH_SYMBOL = "ksDomScheduleLength"
 PD_CAPTABLE_BITS = 12
 PD_CAP_SIZE = 512
 PD_CAP_BITS = int(log2(PD_CAP_SIZE))
@@ -179,6 +213,9 @@ class UntypedAllocator:
     untyped_object: UntypedObject
     allocation_point: int
     allocations: List[KernelAllocation]
+    # Bytes used by objects, i.e. the allocation point less any padding
+    # required to align objects.
+    used: int = 0
 
     @property
     def base(self) -> int:
@@ -188,6 +225,14 @@ class UntypedAllocator:
     def end(self) -> int:
         return self.untyped_object.region.end
 
+    @property
+    def size(self) -> int:
+        return self.untyped_object.region.size
+
+    @property
+    def waste(self) -> int:
+        return self.allocation_point - self.used
+
 class KernelObjectAllocator:
     """Allocator for kernel objects.
 
@@ -199,8 +244,13 @@ class KernelObjectAllocator:
     policy (basically a bump allocator with alignment).
 
     The only 'choice' this allocator has is which untyped object
-    to use. The current algorithm is simply first fit: the first
-    untyped that has sufficient space. This is not optimal.
+    to use. Objects are allocated in the order the system is built,
+    so the allocator can not pack objects by size itself. Instead
+    it picks the untyped that needs the least alignment padding, and
+    of those the one with the least space left over (best fit). Small
+    objects therefore fill the gaps left by earlier allocations and
+    large objects go to untyped that are already aligned for them,
+    leaving the largest untyped whole for as long as possible.
 
     Note: The allocator does not generate the Retype invocations;
     this must be done with more knowledge (specifically the destination
@@ -222,17 +272,43 @@ class KernelObjectAllocator:
 
     def alloc(self, size: int, count: int = 1) -> KernelAllocation:
         assert is_power_of_two(size)
+        best = None
         for ut in self._untyped:
             # See if this fits
             start = round_up(ut.base + ut.allocation_point, size)
-            if start + (count * size) <= ut.end:
-                ut.allocation_point = (start - ut.base) + (count * size)
-                self._allocation_idx += 1
-                allocation = KernelAllocation(ut.untyped_object.cap, start, self._allocation_idx)
-                ut.allocations.append(allocation)
-                return allocation
+            end = start + (count * size)
+            if end > ut.end:
+                continue
+            padding = start - (ut.base + ut.allocation_point)
+            remaining = ut.end - end
+            if best is None or (padding, remaining) < best[0]:
+                best = ((padding, remaining), ut, start)
+
+        if best is None:
+            largest = max((ut.end - round_up(ut.base + ut.allocation_point, size) for ut in self._untyped), default=0)
+            raise Exception(f"Not enough space to allocate 0x{size * count:x} bytes (largest space available: 0x{max(largest, 0):x} bytes)")
+
+        _, ut, start = best
+        ut.allocation_point = (start - ut.base) + (count * size)
+        ut.used += count * size
+        self._allocation_idx += 1
+        allocation = KernelAllocation(ut.untyped_object.cap, start, self._allocation_idx)
+        ut.allocations.append(allocation)
+        return allocation
 
-        raise Exception(f"Not enough space to allocate 0x{size * count:x} bytes")
+    @property
+    def untyped(self) -> List[UntypedAllocator]:
+        return self._untyped
+
+    @property
+    def consumed(self) -> int:
+        """Total bytes consumed in all untyped, including padding."""
+        return sum(ut.allocation_point for ut in self._untyped)
+
+    @property
+    def waste(self) -> int:
+        """Total bytes of padding required to align objects."""
+        return sum(ut.waste for ut in self._untyped)
 
 
 def invocation_to_str(kernel_config: KernelConfig, inv: Sel4Invocation, cap_lookup: Dict[int, str]) -> str:
@@ -303,7 +379,7 @@ def phys_mem_regions_from_elf(elf: ElfFile, alignment: int) -> List[MemoryRegion
     return [
         MemoryRegion(
             round_down(segment.phys_addr, alignment),
-            round_up(segment.phys_addr + len(segment.data), alignment)
+            round_up(segment.phys_addr + segment.mem_size, alignment)
         )
         for segment in elf.segments
     ]
@@ -331,7 +407,7 @@ def virt_mem_regions_from_elf(elf: ElfFile, alignment: int) -> List[MemoryRegion
     return [
         MemoryRegion(
             round_down(segment.virt_addr, alignment),
-            round_up(segment.virt_addr + len(segment.data), alignment)
+            round_up(segment.virt_addr + segment.mem_size, alignment)
         )
         for segment in elf.segments
     ]
@@ -348,6 +424,171 @@ def virt_mem_region_from_elf(elf: ElfFile, alignment: int) -> MemoryRegion:
     return virt_mem_regions_from_elf(elf, alignment)[0]
 
 
+@dataclass(frozen=True)
+class ElfSegmentBacking:
+    """Physical placement of a loadable ELF segment.
+
+    'parts' lists the (vaddr, size, page_size) ranges the segment is mapped
+    with, in address order.
+    """
+    segment: ElfSegment
+    phys_addr: int
+    offset: int
+    parts: Tuple[Tuple[int, int, int], ...]
+    # Set when the frames belong to the identical segment of another PD
+    shared: bool = False
+    # For a segment of a PD with cache colours, the physical address of each
+    # of its pages, which are not contiguous. Otherwise the pages follow
+    # 'phys_addr'.
+    page_phys_addrs: Tuple[int, ...] = ()
+
+
+def identical_program_images(elf_files: Sequence[ElfFile]) -> List[Optional[int]]:
+    """For each ELF file, the index of the first earlier ELF file with an
+    identical layout and identical read-only segments, if any.
+
+    The contents of writable segments are not compared, as those segments
+    are never shared.
+    """
+    first_idx: Dict[bytes, int] = {}
+    identical: List[Optional[int]] = []
+    for idx, elf in enumerate(elf_files):
+        h = sha256()
+        for segment in elf.segments:
+            if not segment.loadable:
+                continue
+            h.update(pack("<QQQQ", segment.virt_addr, len(segment.data), segment.zero_size, int(segment.attrs)))
+            if not segment.is_writable:
+                h.update(segment.data)
+        digest = h.digest()
+        identical.append(first_idx.get(digest))
+        first_idx.setdefault(digest, idx)
+    return identical
+
+
+def elf_segment_backing(
+        elf: ElfFile,
+        phys_addr_next: int,
+        small_page_size: int,
+        large_page_size: int,
+        shared_backing: Sequence[Optional[ElfSegmentBacking]] = (),
+    ) -> Tuple[List[ElfSegmentBacking], int]:
+    """Lay out the loadable segments of an ELF file in physical memory
+    starting from 'phys_addr_next'.
+
+    Any part of a segment that covers whole, aligned large pages is backed
+    by large pages. To make that possible the physical address is padded
+    so that it is congruent with the virtual address modulo the large page
+    size. This assumes 'phys_addr_next' is relative to a large page aligned
+    base. The head and tail of the segment use small pages.
+
+    'shared_backing' optionally gives, for each loadable segment, the
+    backing of an identical segment to reuse instead of allocating frames.
+
+    Returns the backing for each segment, and the next free physical address.
+    """
+    backing: List[ElfSegmentBacking] = []
+    for segment in elf.segments:
+        if not segment.loadable:
+            continue
+
+        if len(backing) < len(shared_backing):
+            shared = shared_backing[len(backing)]
+            if shared is not None:
+                backing.append(replace(shared, segment=segment, shared=True))
+                continue
+
+        base_vaddr = round_down(segment.virt_addr, small_page_size)
+        end_vaddr = round_up(segment.virt_addr + segment.mem_size, small_page_size)
+        large_base_vaddr = round_up(base_vaddr, large_page_size)
+        large_end_vaddr = round_down(end_vaddr, large_page_size)
+
+        if large_base_vaddr < large_end_vaddr:
+            phys_addr_next += (base_vaddr - phys_addr_next) % large_page_size
+            parts = [
+                (base_vaddr, large_base_vaddr - base_vaddr, small_page_size),
+                (large_base_vaddr, large_end_vaddr - large_base_vaddr, large_page_size),
+                (large_end_vaddr, end_vaddr - large_end_vaddr, small_page_size),
+            ]
+        else:
+            parts = [(base_vaddr, end_vaddr - base_vaddr, small_page_size)]
+
+        backing.append(ElfSegmentBacking(
+            segment,
+            phys_addr_next,
+            segment.virt_addr - base_vaddr,
+            tuple(part for part in parts if part[1] > 0)
+        ))
+        phys_addr_next += end_vaddr - base_vaddr
+
+    return backing, phys_addr_next
+
+
+class ColouredPageAllocator:
+    """Allocates pages of given cache colours, in address order, from
+    'base' up. 'base' must be aligned to a page of each colour, so that the
+    colour of an address relative to it is that of the physical address.
+
+    Each colour has its own next free page, so the pages of other colours
+    skipped by one allocation are used by later ones.
+    """
+    def __init__(self, base: int, num_colours: int, page_size: int) -> None:
+        assert base % (num_colours * page_size) == 0
+        self._num_colours = num_colours
+        self._page_size = page_size
+        self._next = [base + colour * page_size for colour in range(num_colours)]
+        self.base = base
+        self.end = base
+
+    def alloc(self, colours: FrozenSet[int]) -> int:
+        colour = min(colours, key=lambda c: (self._next[c], c))
+        addr = self._next[colour]
+        self._next[colour] += self._num_colours * self._page_size
+        self.end = max(self.end, addr + self._page_size)
+        return addr
+
+
+def coloured_elf_segment_backing(
+        elf: ElfFile,
+        pages: ColouredPageAllocator,
+        colours: FrozenSet[int],
+        page_size: int,
+        shared_backing: Sequence[Optional[ElfSegmentBacking]] = (),
+    ) -> List[ElfSegmentBacking]:
+    """Lay out the loadable segments of an ELF file on pages of 'colours'.
+
+    The segments are only backed by small pages, as a large page covers
+    every colour. Otherwise as for elf_segment_backing.
+    """
+    backing: List[ElfSegmentBacking] = []
+    for segment in elf.segments:
+        if not segment.loadable:
+            continue
+
+        if len(backing) < len(shared_backing):
+            shared = shared_backing[len(backing)]
+            if shared is not None:
+                backing.append(replace(shared, segment=segment, shared=True))
+                continue
+
+        base_vaddr = round_down(segment.virt_addr, page_size)
+        end_vaddr = round_up(segment.virt_addr + segment.mem_size, page_size)
+        page_phys_addrs = tuple(pages.alloc(colours) for _ in range((end_vaddr - base_vaddr) // page_size))
+        backing.append(ElfSegmentBacking(
+            segment,
+            page_phys_addrs[0],
+            segment.virt_addr - base_vaddr,
+            ((base_vaddr, end_vaddr - base_vaddr, page_size), ),
+            page_phys_addrs=page_phys_addrs,
+        ))
+
+    return backing
+
+
+def page_colour(kernel_config: KernelConfig, phys_addr: int) -> int:
+    return (phys_addr // kernel_config.minimum_page_size) % kernel_config.cache_colours
+
+
 class PageOverlap(Exception):
     pass
 
@@ -370,6 +611,29 @@ class FixedUntypedAlloc:
         return self._ut.region.base <= address < self._ut.region.end
 
 
+@dataclass(frozen=True)
+class Owner:
+    """What a kernel object or cap belongs to: a PD, a VM, a memory region
+    (for pages shared between PDs) or the monitor."""
+    kind: str
+    name: str
+
+
+MONITOR_OWNER = Owner("monitor", "monitor")
+
+
+def pd_owner(pd: ProtectionDomain) -> Owner:
+    return Owner("PD", pd.name)
+
+
+def vm_owner(vm: VirtualMachine) -> Owner:
+    return Owner("VM", vm.name)
+
+
+def mr_owner(mr: SysMemoryRegion) -> Owner:
+    return Owner("MR", mr.name)
+
+
 @dataclass(frozen=True, eq=True)
 class KernelObject:
     """Represents an allocated kernel object.
@@ -390,6 +654,10 @@ class KernelObject:
     cap_addr: int
     phys_addr: int
     name: str
+    # Bytes of memory used by the object
+    size: int
+    # What the object belongs to, if known
+    owner: Optional[Owner] = None
 
 
 def assert_objects_adjacent(lst: List[KernelObject]) -> None:
@@ -441,6 +709,7 @@ class InitSystem:
             kernel_boot_info: KernelBootInfo,
             invocations: List[Sel4Invocation],
             cap_address_names: Dict[int, str],
+            cap_address_owners: Dict[int, Owner],
         ):
         self._cnode_cap = cnode_cap
         self._cnode_mask = cnode_mask
@@ -451,7 +720,12 @@ class InitSystem:
         self._last_fixed_address = 0
         self._device_untyped = sorted([FixedUntypedAlloc(ut) for ut in kernel_boot_info.untyped_objects if ut.is_device])
         self._cap_address_names = cap_address_names
+        self._cap_address_owners = cap_address_owners
         self._objects: List[KernelObject] = []
+        # Untyped objects of one page for each cache colour, which objects
+        # with cache colours are allocated from, and those with space left.
+        self.colour_untyped: List[List[UntypedAllocator]] = [[] for _ in range(kernel_config.cache_colours)]
+        self._colour_free: List[List[UntypedAllocator]] = [[] for _ in range(kernel_config.cache_colours)]
 
     def reserve(self, allocations: List[Tuple[UntypedObject, int]]) -> None:
         for alloc_ut, alloc_phys_addr in allocations:
@@ -467,10 +741,28 @@ class InitSystem:
             ut.watermark = alloc_phys_addr
 
 
-    def allocate_fixed_objects(self, kernel_config: KernelConfig, phys_address: int, object_type: int, count: int, names: List[str]) -> List[KernelObject]:
+    def reserve_cap_slots(self, count: int) -> int:
+        """Reserve 'count' consecutive cap slots, returning the first."""
+        cap_slot = self._cap_slot
+        self._cap_slot += count
+        return cap_slot
+
+    def allocate_fixed_objects(
+            self,
+            kernel_config: KernelConfig,
+            phys_address: int,
+            object_type: int,
+            count: int,
+            names: List[str],
+            cap_slot: Optional[int] = None,
+            owner: Optional[Owner] = None,
+        ) -> List[KernelObject]:
         """
 
         Note: Fixed objects must be allocated in order!
+
+        'cap_slot' optionally gives a reserved cap slot for the object.
+        'owner' optionally gives what the object belongs to.
         """
         assert phys_address >= self._last_fixed_address
         assert object_type in FIXED_OBJECT_SIZES
@@ -528,8 +820,12 @@ class InitSystem:
                 ))
                 self._cap_slot += 1
 
-        object_cap = self._cap_slot
-        self._cap_slot += 1
+        if cap_slot is None:
+            object_cap = self._cap_slot
+            self._cap_slot += 1
+        else:
+            assert count == 1
+            object_cap = cap_slot
         self._invocations.append(Sel4UntypedRetype(
                 ut._ut.cap,
                 object_type,
@@ -545,12 +841,108 @@ class InitSystem:
         self._last_fixed_address = phys_address + alloc_size
         cap_address = self._cnode_mask | object_cap
         self._cap_address_names[cap_address] = names[0]
-        kernel_objects = [KernelObject(object_type, object_cap, cap_address, phys_address, names[0])]
+        if owner is not None:
+            self._cap_address_owners[cap_address] = owner
+        kernel_objects = [KernelObject(object_type, object_cap, cap_address, phys_address, names[0], alloc_size, owner)]
         self._objects += kernel_objects
         return kernel_objects
 
-    def allocate_objects(self, kernel_config: KernelConfig, object_type: int, names: List[str], size: Optional[int] = None) -> List[KernelObject]:
+    def _split_colour_block(self) -> None:
+        """Split a block of normal memory, with one page of each cache colour,
+        into an untyped object for each page."""
+        page_size = self._kernel_config.minimum_page_size
+        num_colours = self._kernel_config.cache_colours
+        block_size = num_colours * page_size
+        allocation = self._kao.alloc(block_size)
+        block_cap_slot = self._cap_slot
+        self._cap_slot += 1
+        self._invocations.append(Sel4UntypedRetype(
+                allocation.untyped_cap_address,
+                Sel4Object.Untyped,
+                int(log2(block_size)),
+                self._cnode_cap,
+                1,
+                1,
+                block_cap_slot,
+                1
+        ))
+        block_cap_address = self._cnode_mask | block_cap_slot
+        self._cap_address_names[block_cap_address] = f"Untyped: cache colour block @ 0x{allocation.phys_addr:x}"
+
+        base_cap_slot = self._cap_slot
+        self._cap_slot += num_colours
+        to_alloc = num_colours
+        alloc_cap_slot = base_cap_slot
+        while to_alloc:
+            call_count = min(to_alloc, self._kernel_config.fan_out_limit)
+            self._invocations.append(Sel4UntypedRetype(
+                    block_cap_address,
+                    Sel4Object.Untyped,
+                    int(log2(page_size)),
+                    self._cnode_cap,
+                    1,
+                    1,
+                    alloc_cap_slot,
+                    call_count
+            ))
+            to_alloc -= call_count
+            alloc_cap_slot += call_count
+
+        # The block is aligned to its size, so its pages are in colour order
+        for colour in range(num_colours):
+            phys_addr = allocation.phys_addr + colour * page_size
+            cap_address = self._cnode_mask | (base_cap_slot + colour)
+            self._cap_address_names[cap_address] = f"Untyped: cache colour {colour} @ 0x{phys_addr:x}"
+            ut = UntypedAllocator(UntypedObject(cap_address, MemoryRegion(phys_addr, phys_addr + page_size), False), 0, [])
+            self.colour_untyped[colour].append(ut)
+            self._colour_free[colour].append(ut)
+
+    def _alloc_coloured(self, size: int, colours: FrozenSet[int]) -> Tuple[int, int]:
+        """The cap of an untyped object of one of 'colours', and the physical
+        address in it, to create an object of 'size' at. The untyped object
+        is chosen as by the KernelObjectAllocator."""
+        while True:
+            best = None
+            for colour in sorted(colours):
+                for ut in self._colour_free[colour]:
+                    start = round_up(ut.base + ut.allocation_point, size)
+                    end = start + size
+                    if end > ut.end:
+                        continue
+                    padding = start - (ut.base + ut.allocation_point)
+                    if best is None or (padding, ut.end - end) < best[0]:
+                        best = ((padding, ut.end - end), colour, ut, start)
+            if best is not None:
+                break
+            self._split_colour_block()
+
+        _, colour, ut, start = best
+        ut.allocation_point = (start - ut.base) + size
+        ut.used += size
+        if ut.allocation_point == ut.size:
+            self._colour_free[colour].remove(ut)
+        return ut.untyped_object.cap, start
+
+    def allocate_objects(
+            self,
+            kernel_config: KernelConfig,
+            object_type: int,
+            names: List[str],
+            size: Optional[int] = None,
+            colours: Optional[Sequence[Optional[FrozenSet[int]]]] = None,
+            owners: Optional[Sequence[Optional[Owner]]] = None,
+        ) -> List[KernelObject]:
+        """Allocate the objects named 'names', with consecutive caps.
+
+        'colours' optionally gives the cache colours each object must be
+        allocated from. Objects larger than a page span several colours, so
+        are allocated from any colour. 'owners' optionally gives what each
+        object belongs to.
+        """
         count = len(names)
+        if owners is None:
+            owners = [None] * count
+        assert len(owners) == count
         if object_type in FIXED_OBJECT_SIZES:
             assert size is None
             alloc_size = Sel4Object(object_type).get_size(kernel_config)
@@ -560,36 +952,64 @@ class InitSystem:
             assert is_power_of_two(size)
             api_size = int(log2(size))
             alloc_size = size * SEL4_SLOT_SIZE
+        elif object_type == Sel4Object.Untyped:
+            assert size is not None
+            assert is_power_of_two(size)
+            api_size = int(log2(size))
+            alloc_size = size
         else:
             raise Exception(f"Invalid object type: {object_type}")
-        allocation = self._kao.alloc(alloc_size, count)
+
+        # The space for the objects with cache colours is found first, as
+        # that may create more untyped objects, and so use cap slots.
+        coloured: Dict[int, Tuple[int, int]] = {}
+        if colours is not None and alloc_size <= kernel_config.minimum_page_size:
+            assert len(colours) == count
+            for idx, object_colours in enumerate(colours):
+                if object_colours is not None:
+                    coloured[idx] = self._alloc_coloured(alloc_size, object_colours)
+
         base_cap_slot = self._cap_slot
         self._cap_slot += count
-        to_alloc = count
-        alloc_cap_slot = base_cap_slot
-        while to_alloc:
-            call_count = min(to_alloc, self._kernel_config.fan_out_limit)
-            self._invocations.append(Sel4UntypedRetype(
-                    allocation.untyped_cap_address,
-                    object_type,
-                    api_size,
-                    self._cnode_cap,
-                    1,
-                    1,
-                    alloc_cap_slot,
-                    call_count
-            ))
-            to_alloc -= call_count
-            alloc_cap_slot += call_count
         kernel_objects = []
-        phys_addr = allocation.phys_addr
-        for idx in range(count):
-            cap_slot = base_cap_slot + idx
-            cap_address = self._cnode_mask | cap_slot
-            name = names[idx]
-            self._cap_address_names[cap_address] = name
-            kernel_objects.append(KernelObject(object_type, cap_slot, cap_address, phys_addr, name))
-            phys_addr += alloc_size
+        # Each run of objects without cache colours is allocated together
+        idx = 0
+        while idx < count:
+            run_count = 1
+            if idx in coloured:
+                untyped_cap_address, phys_addr = coloured[idx]
+            else:
+                while idx + run_count < count and idx + run_count not in coloured:
+                    run_count += 1
+                allocation = self._kao.alloc(alloc_size, run_count)
+                untyped_cap_address, phys_addr = allocation.untyped_cap_address, allocation.phys_addr
+            to_alloc = run_count
+            alloc_cap_slot = base_cap_slot + idx
+            while to_alloc:
+                call_count = min(to_alloc, self._kernel_config.fan_out_limit)
+                self._invocations.append(Sel4UntypedRetype(
+                        untyped_cap_address,
+                        object_type,
+                        api_size,
+                        self._cnode_cap,
+                        1,
+                        1,
+                        alloc_cap_slot,
+                        call_count
+                ))
+                to_alloc -= call_count
+                alloc_cap_slot += call_count
+            for run_idx in range(idx, idx + run_count):
+                cap_slot = base_cap_slot + run_idx
+                cap_address = self._cnode_mask | cap_slot
+                name = names[run_idx]
+                owner = owners[run_idx]
+                self._cap_address_names[cap_address] = name
+                if owner is not None:
+                    self._cap_address_owners[cap_address] = owner
+                kernel_objects.append(KernelObject(object_type, cap_slot, cap_address, phys_addr, name, alloc_size, owner))
+                phys_addr += alloc_size
+            idx += run_count
 
         self._objects += kernel_objects
         return kernel_objects
@@ -600,16 +1020,70 @@ class Region:
     name: str
     addr: int
     offset: int
-    data: bytearray
+    data: Union[bytearray, memoryview]
+    # Number of zero bytes following the data
+    zero_size: int
+    # For a region holding (part of) a segment of a PD program image: the
+    # index of the PD and the index of the segment in its ELF file, and the
+    # range of the segment data the region holds.
+    pd_elf_segment: Optional[Tuple[int, int, int, int]] = None
 
     def __repr__(self) -> str:
-        return f"<Region name={self.name} addr=0x{self.addr:x} offset=0x{self.offset:x} size={len(self.data)}>"
+        return f"<Region name={self.name} addr=0x{self.addr:x} offset=0x{self.offset:x} size={len(self.data) + self.zero_size}>"
+
+
+def page_run_regions(
+        name: str,
+        page_addrs: Sequence[int],
+        page_size: int,
+        offset: int,
+        data: memoryview,
+        zero_size: int,
+        pd_elf_segment: Optional[Tuple[int, int]] = None,
+    ) -> List[Region]:
+    """The regions to load 'offset' zero bytes, 'data' and 'zero_size' zero
+    bytes into the pages at 'page_addrs', with one region for each run of
+    contiguous pages."""
+    regions = []
+    mem_size = offset + len(data) + zero_size
+    run_start = 0
+    for idx in range(1, len(page_addrs) + 1):
+        if idx < len(page_addrs) and page_addrs[idx] == page_addrs[idx - 1] + page_size:
+            continue
+        start = run_start * page_size
+        end = min(idx * page_size, mem_size)
+        if start < end:
+            region_offset = min(max(offset - start, 0), end - start)
+            data_start = min(max(start - offset, 0), len(data))
+            data_end = min(max(end - offset, 0), len(data))
+            regions.append(Region(
+                name,
+                page_addrs[run_start],
+                region_offset,
+                data[data_start:data_end],
+                end - start - region_offset - (data_end - data_start),
+                None if pd_elf_segment is None else pd_elf_segment + (data_start, data_end),
+            ))
+        run_start = idx
+    return regions
+
+
+@dataclass(frozen=True)
+class PagingStats:
+    """The pages and page tables mapping a PD or VM, and the number there
+    would be without the large pages chosen by the tool."""
+    name: str
+    pages: int
+    small_pages: int
+    page_tables: int
+    small_page_tables: int
 
 
 @dataclass
 class BuiltSystem:
     number_of_system_caps: int
     invocation_data_size: int
+    system_invocation_data: bytearray
     bootstrap_invocations: List[Sel4Invocation]
     system_invocations: List[Sel4Invocation]
     kernel_boot_info: KernelBootInfo
@@ -617,22 +1091,295 @@ class BuiltSystem:
     fault_ep_cap_address: int
     reply_cap_address: int
     cap_lookup: Dict[int, str]
+    # What the object of each cap belongs to, for caps that belong to a PD,
+    # VM or memory region, or to the monitor
+    cap_owners: Dict[int, Owner]
     tcb_caps: List[int]
     sched_caps: List[int]
     ntfn_caps: List[int]
     regions: List[Region]
+    pd_symbol_patches: List[List[Tuple[str, bytes]]]
     kernel_objects: List[KernelObject]
+    untyped_usage: List[UntypedAllocator]
     initial_task_virt_region: MemoryRegion
     initial_task_phys_region: MemoryRegion
+    fault_log_vaddr: int
+    fault_log_size: int
+    budget_stats_vaddr: int
+    budget_stats_size: int
+    vspace_caps: List[int]
+    mr_block_caps: List[int]
+    mr_pt_caps: List[int]
+    mr_frame_slot_start: int
+    root_cnode_cap: int
+    system_cap_address_mask: int
+    paging_stats: List[PagingStats]
+    # The untyped objects of one page of each cache colour
+    colour_untyped: List[List[UntypedAllocator]]
 
 
-def _get_full_path(filename: Path, search_paths: List[Path]) -> Path:
+@dataclass
+class ColourUsage:
+    colour: int
+    # The bytes of the colour used by each PD and memory region with cache
+    # colours, and by everything else as "other"
+    owners: Dict[str, int]
+    # The bytes left in the untyped objects of the colour
+    free: int
+
+
+def cache_colour_usage(kernel_config: KernelConfig, system: SystemDescription, built_system: BuiltSystem) -> List[ColourUsage]:
+    """The use of each cache colour by the kernel objects of at most a page,
+    which are the only ones with a single colour. The pages of program
+    images and memory regions are attributed to their PD or memory region.
+    Empty if no PD or memory region has cache colours."""
+    coloured_owners = {pd_owner(pd) for pd in system.protection_domains if pd.cache_colours is not None}
+    coloured_owners |= {mr_owner(mr) for mr in system.memory_regions if mr.cache_colours is not None}
+
+    if not coloured_owners:
+        return []
+
+    usage = [
+        ColourUsage(colour, {}, sum(ut.size - ut.allocation_point for ut in built_system.colour_untyped[colour]))
+        for colour in range(kernel_config.cache_colours)
+    ]
+    for ko in built_system.kernel_objects:
+        if ko.size > kernel_config.minimum_page_size:
+            continue
+        owners = usage[page_colour(kernel_config, ko.phys_addr)].owners
+        owner = ko.owner.name if ko.owner in coloured_owners else "other"
+        owners[owner] = owners.get(owner, 0) + ko.size
+    return usage
+
+
+def json_report(
+        kernel_config: KernelConfig,
+        system: SystemDescription,
+        built_system: BuiltSystem,
+        pd_elf_files: Dict[ProtectionDomain, ElfFile],
+        invocation_table_size: int,
+        system_cnode_size: int,
+        sched_analysis: SchedAnalysis,
+    ) -> str:
+    """The resources used by the system, in total and for each PD and VM,
+    as JSON.
+
+    Kernel objects are attributed to the PD or VM that owns them, and
+    invocations to the PDs and VMs owning the caps involved. The monitor's
+    own objects, such as the page tables of its MR pool, are reported
+    separately. An invocation is counted for each time it is repeated.
+    """
+    virtual_machines = [pd.virtual_machine for pd in system.protection_domains if pd.virtual_machine is not None]
+    domain_owners = [pd_owner(pd) for pd in system.protection_domains] + [vm_owner(vm) for vm in virtual_machines]
+
+    def invocation_count(invocation: Sel4Invocation) -> int:
+        return getattr(invocation, "_repeat_count", 1)
+
+    objects: Dict[str, Dict[str, int]] = {}
+    owner_objects: Dict[Owner, Dict[str, Dict[str, int]]] = {owner: {} for owner in domain_owners + [MONITOR_OWNER]}
+    for ko in built_system.kernel_objects:
+        type_name = Sel4Object(ko.object_type).name
+        for counts in (objects, ) if ko.owner not in owner_objects else (objects, owner_objects[ko.owner]):
+            entry = counts.setdefault(type_name, {"count": 0, "bytes": 0})
+            entry["count"] += 1
+            entry["bytes"] += ko.size
+
+    domain_caps = {owner: 0 for owner in domain_owners}
+    domain_invocations = {owner: 0 for owner in domain_owners}
+    all_invocations = built_system.bootstrap_invocations + built_system.system_invocations
+    for invocation in all_invocations:
+        caps = [invocation._service] + [getattr(invocation, name) for name in invocation._extra_caps]
+        owners = {built_system.cap_owners.get(cap) for cap in caps}
+        for owner in owners:
+            if owner in domain_invocations:
+                domain_invocations[owner] += invocation_count(invocation)
+        # Caps minted or copied into the CNode of a PD or VM
+        if isinstance(invocation, (Sel4CnodeMint, Sel4CnodeCopy)):
+            owner = built_system.cap_owners.get(invocation._service)
+            if owner in domain_caps and built_system.cap_lookup[invocation._service].startswith("CNode:"):
+                domain_caps[owner] += invocation_count(invocation)
+
+    paging_stats = {stats.name: stats for stats in built_system.paging_stats}
+
+    def domain_report(owner: Owner, maps: Tuple[SysMap, ...], elf: Optional[ElfFile]) -> Dict[str, object]:
+        name = owner.name
+        return {
+            "name": name,
+            "objects": owner_objects[owner],
+            "pages": paging_stats[name].pages,
+            "page_tables": owner_objects[owner].get("PageTable", {}).get("count", 0),
+            "elf_bytes": 0 if elf is None else sum(segment.mem_size for segment in elf.segments if segment.loadable),
+            "mapped_mr_bytes": sum(system.mr_by_name[map.mr].size for map in maps),
+            "caps": domain_caps[owner],
+            "invocations": domain_invocations[owner],
+        }
+
+    report = {
+        "invocation_table_size": invocation_table_size,
+        "invocation_data_size": built_system.invocation_data_size,
+        "system_cnode_size": system_cnode_size,
+        "system_caps": built_system.number_of_system_caps,
+        "totals": {
+            "objects": objects,
+            "bootstrap_invocations": sum(invocation_count(invocation) for invocation in built_system.bootstrap_invocations),
+            "system_invocations": sum(invocation_count(invocation) for invocation in built_system.system_invocations),
+            "pages": sum(stats.pages for stats in built_system.paging_stats),
+        },
+        "untyped": [
+            {
+                "name": built_system.cap_lookup[ut.untyped_object.cap],
+                "base": ut.base,
+                "size": ut.size,
+                "device": ut.untyped_object.is_device,
+                "used": ut.used,
+                "waste": ut.waste,
+                "free": ut.size - ut.allocation_point,
+            }
+            for ut in built_system.untyped_usage
+        ],
+        "monitor": {
+            "objects": owner_objects[MONITOR_OWNER],
+        },
+        "protection_domains": [domain_report(pd_owner(pd), pd.maps, pd_elf_files[pd]) for pd in system.protection_domains],
+        "virtual_machines": [domain_report(vm_owner(vm), vm.maps, None) for vm in virtual_machines],
+        "cache_colours": [
+            {"colour": usage.colour, "free": usage.free, "used": dict(sorted(usage.owners.items()))}
+            for usage in cache_colour_usage(kernel_config, system, built_system)
+        ],
+        "schedulability": {
+            "cpu_utilisation": [float(utilisation) for utilisation in sched_analysis.cpu_utilisation],
+            "response_times": [
+                {
+                    "name": rt.domain.name,
+                    "cpu": rt.domain.cpu,
+                    "priority": rt.domain.priority,
+                    "budget": rt.domain.budget,
+                    "period": rt.domain.period,
+                    "blocking": rt.blocking,
+                    "response": rt.response,
+                }
+                for rt in sched_analysis.response_times
+            ],
+            "flows": [
+                {
+                    "name": fl.flow.name,
+                    "deadline": fl.flow.deadline,
+                    "latency": fl.latency,
+                    "steps": [{"pd": step.pd, "via": step.via, "latency": step.latency} for step in fl.steps],
+                }
+                for fl in sched_analysis.flow_latencies
+            ],
+            "domain_shares": {domain: float(share) for domain, share in sched_analysis.domain_shares.items()},
+            "domain_supply": [
+                {
+                    "name": ds.name,
+                    "cpu": ds.cpu,
+                    "domain": ds.domain,
+                    "budget": ds.budget,
+                    "period": ds.period,
+                    "supply": ds.supply,
+                }
+                for ds in sched_analysis.domain_supply
+            ],
+        },
+    }
+    return json_dumps(report, indent=2) + "\n"
+
+
+def write_cache_colour_report(f: TextIO, colour_usage: List[ColourUsage]) -> None:
+    for usage in colour_usage:
+        used = [f"{owner} 0x{size:x}" for owner, size in sorted(usage.owners.items())]
+        f.write(f"     colour {usage.colour}: {', '.join(used + [f'free 0x{usage.free:x}'])}\n")
+
+
+def write_sched_report(f: TextIO, sched_analysis: SchedAnalysis) -> None:
+    for cpu, utilisation in enumerate(sched_analysis.cpu_utilisation):
+        f.write(f"     CPU {cpu}: {float(utilisation):.1%} utilised\n")
+    for rt in sched_analysis.response_times:
+        response = "exceeds period" if rt.response is None else f"{rt.response}us"
+        f.write(f"     {rt.domain.name}: cpu={rt.domain.cpu} priority={rt.domain.priority} budget={rt.domain.budget}us period={rt.domain.period}us blocking={rt.blocking}us response={response}\n")
+    for fl in sched_analysis.flow_latencies:
+        steps = " -> ".join(f"{step.pd} ({step.via}, {'unbounded' if step.latency is None else f'{step.latency}us'})" for step in fl.steps)
+        latency = "unbounded" if fl.latency is None else f"{fl.latency}us"
+        deadline = "" if fl.flow.deadline is None else f" deadline={fl.flow.deadline}us"
+        f.write(f"     flow {fl.flow.name}: latency={latency}{deadline}: {steps}\n")
+    for domain, share in sched_analysis.domain_shares.items():
+        f.write(f"     domain {domain}: {float(share):.1%} of the schedule\n")
+    for ds in sched_analysis.domain_supply:
+        f.write(f"     {ds.name}: cpu={ds.cpu} domain={ds.domain} budget={ds.budget}us period={ds.period}us supply={ds.supply}us\n")
+
+
+def write_domain_schedule(kernel_config: KernelConfig, kernel_elf: ElfFile, system: SystemDescription) -> None:
+    """Write the domain schedule of the system into the kernel image. Each
+    entry is the number of a domain and its length in milliseconds."""
+    schedule_symbol = kernel_elf.find_symbol_if_exists(KERNEL_DOMAIN_SCHEDULE_SYMBOL)
+    if schedule_symbol is None or kernel_elf.find_symbol_if_exists(KERNEL_DOMAIN_SCHEDULE_LENGTH_SYMBOL) is None:
+        raise UserError("Error: the kernel has no domain schedule for the domain_schedule of the system")
+    _, schedule_size = schedule_symbol
+    word = "Q" if kernel_config.word_size == 64 else "I"
+    max_entries = schedule_size // calcsize(f"<{word}{word}")
+    if len(system.domain_schedule) > max_entries:
+        raise UserError(f"Error: the domain schedule has {len(system.domain_schedule)} entries, but the kernel supports at most {max_entries}")
+
+    schedule = b"".join(
+        pack(f"<{word}{word}", system.domain_names.index(window.domain), window.length // 1000)
+        for window in system.domain_schedule
+    )
+    kernel_elf.write_symbol(KERNEL_DOMAIN_SCHEDULE_SYMBOL, schedule)
+    kernel_elf.write_symbol(KERNEL_DOMAIN_SCHEDULE_LENGTH_SYMBOL, pack(f"<{word}", len(system.domain_schedule)))
+
+
+def cache_colour_count(sel4_config: Dict, page_size: int) -> int:
+    """The number of cache colours from the geometry of the L2 cache, which
+    the SDK adds to the kernel config where it is known. Pages at addresses
+    a multiple of the cache size divided by the ways apart map to the same
+    sets of the cache, which are the pages of one colour."""
+    if "L2_CACHE_SIZE" not in sel4_config:
+        return 1
+    cache_size = sel4_config["L2_CACHE_SIZE"]
+    ways = sel4_config["L2_CACHE_WAYS"]
+    cache_colours = max(1, cache_size // (ways * page_size))
+    # A block of one page of each colour is split from a single untyped
+    if not is_power_of_two(cache_colours):
+        raise UserError(f"Error: an L2 cache of size 0x{cache_size:x} with {ways} ways has {cache_colours} cache colours, which is not a power of two")
+    return cache_colours
+
+
+def next_invocation_table_size(kernel_config: KernelConfig, invocation_data_size: int, headroom: int) -> int:
+    """The size of the invocation table for a build that needs
+    'invocation_data_size' bytes of invocations, plus 'headroom' bytes
+    where the table can be that large."""
+    if invocation_data_size > MAX_SYSTEM_INVOCATION_SIZE:
+        raise UserError(f"Error: the system needs 0x{invocation_data_size:x} bytes of invocation data, but the invocation table can be at most 0x{MAX_SYSTEM_INVOCATION_SIZE:x} bytes")
+    return min(round_up(invocation_data_size + headroom, kernel_config.minimum_page_size), MAX_SYSTEM_INVOCATION_SIZE)
+
+
+def budget_stats_table_size(kernel_config: KernelConfig) -> int:
+    word_bytes = kernel_config.word_size // 8
+    return word_bytes * (1 + MONITOR_MAX_PDS * (3 + MONITOR_BUDGET_HISTOGRAM_BUCKETS))
+
+
+def check_monitor_mrs(kernel_config: KernelConfig, system: SystemDescription) -> None:
+    """Check that the memory regions of the monitor can hold what the
+    monitor writes into them, which it would otherwise only find at boot."""
+    if system.monitor.budget_stats is not None:
+        mr = system.mr_by_name[system.monitor.budget_stats]
+        table_size = budget_stats_table_size(kernel_config)
+        if mr.size < table_size:
+            raise UserError(f"Error: budget stats memory region '{mr.name}' of size 0x{mr.size:x} is smaller than the budget stats table of size 0x{table_size:x}")
+
+
+def pd_elf_symbols(pd: ProtectionDomain) -> Tuple[str, ...]:
+    return PD_ELF_SYMBOLS + tuple(setvar.symbol for setvar in pd.setvars)
+
+
+def _get_full_path(filename: Path, search_paths: List[Path], description: str = "program image") -> Path:
     for search_path in search_paths:
         full_path = search_path / filename
         if full_path.exists():
             return full_path
     else:
-        raise UserError(f"Error: unable to find program image: '{filename}'")
+        raise UserError(f"Error: unable to find {description}: '{filename}'")
 
 
 def build_system(
@@ -642,9 +1389,15 @@ def build_system(
         system: SystemDescription,
         invocation_table_size: int,
         system_cnode_size: int,
-        search_paths: List[Path],
+        pd_elf_files: Dict[ProtectionDomain, ElfFile],
+        mr_data: Dict[str, bytes],
     ) -> BuiltSystem:
-    """Build system as description by the inputs, with a 'BuiltSystem' object as the output."""
+    """Build system as description by the inputs, with a 'BuiltSystem' object as the output.
+
+    'pd_elf_files' holds the program image of each protection domain. The
+    images are patched in place, so they can be reused between builds.
+    'mr_data' holds the initial contents of the memory regions that have any.
+    """
     assert is_power_of_two(system_cnode_size)
     assert invocation_table_size % kernel_config.minimum_page_size == 0
     assert invocation_table_size <= MAX_SYSTEM_INVOCATION_SIZE
@@ -658,7 +1411,10 @@ def build_system(
     cap_address_names[INIT_VSPACE_CAP_ADDRESS] = "VSpace: init"
     cap_address_names[INIT_ASID_POOL_CAP_ADDRESS] = "ASID Pool: init"
     cap_address_names[IRQ_CONTROL_CAP_ADDRESS] = "IRQ Control"
+    cap_address_names[DOMAIN_CAP_ADDRESS] = "Domain Set"
     cap_address_names[SMC_CAP_ADDRESS] = "SMC Cap"
+    # The PD or VM (or the monitor) that each cap's object belongs to
+    cap_address_owners: Dict[int, Owner] = {}
 
     system_cnode_bits = int(log2(system_cnode_size))
 
@@ -669,11 +1425,6 @@ def build_system(
     ## Determine physical memory region used by the monitor
     initial_task_size = phys_mem_region_from_elf(monitor_elf, kernel_config.minimum_page_size).size
 
-    ## Get the elf files for each pd:
-    pd_elf_files = {
-        pd: ElfFile.from_path(_get_full_path(pd.program_image, search_paths))
-        for pd in system.protection_domains
-    }
     ### Here we should validate that ELF files @ivanv: this comment is weird ?
 
     ## Determine physical memory region for 'reserved' memory.
@@ -682,11 +1433,98 @@ def build_system(
     # and allows the monitor (initial task) to create memory regions
     # from this area, which can then be made available to the appropriate
     # protection domains
-    pd_elf_size = sum([
-        sum([r.size for r in phys_mem_regions_from_elf(elf, kernel_config.minimum_page_size)])
-        for elf in pd_elf_files.values()
-    ])
-    reserved_size = invocation_table_size + pd_elf_size
+    #
+    # The invocation table and the ELF segments are mapped with large pages
+    # where they cover whole large pages. The layout is determined relative
+    # to the start of the reserved region, which is then aligned to the large
+    # page size if any large pages are used.
+    SEL4_LARGE_PAGE_SIZE = FIXED_OBJECT_SIZES[Sel4Object.LargePage]
+    #
+    # PDs running identical program images share the frames of their read-only
+    # segments, unless the tool reads or patches a symbol in the segment.
+    #
+    # PDs and memory regions with cache colours are placed after everything
+    # else, page by page on pages of their colours (see ColouredPageAllocator),
+    # so the reserved region is then aligned to a page of each colour.
+    pd_elf_backing: Dict[ProtectionDomain, List[ElfSegmentBacking]] = {}
+    reserved_size = invocation_table_size
+    identical_images = identical_program_images([pd_elf_files[pd] for pd in system.protection_domains])
+
+    def shared_elf_backing(pd: ProtectionDomain, identical_idx: Optional[int]) -> List[Optional[ElfSegmentBacking]]:
+        shared_backing: List[Optional[ElfSegmentBacking]] = []
+        if identical_idx is not None and system.protection_domains[identical_idx].cache_colours == pd.cache_colours:
+            identical_pd = system.protection_domains[identical_idx]
+            symbols = [
+                symbol
+                for symbol in (
+                    pd_elf_files[p].find_symbol_if_exists(name)
+                    for p in (pd, identical_pd)
+                    for name in pd_elf_symbols(p)
+                )
+                if symbol is not None
+            ]
+            for segment_backing in pd_elf_backing[identical_pd]:
+                segment = segment_backing.segment
+                patched = any(
+                    vaddr < segment.virt_addr + segment.mem_size and segment.virt_addr < vaddr + size
+                    for vaddr, size in symbols
+                )
+                shareable = not segment.is_writable and not patched
+                shared_backing.append(segment_backing if shareable else None)
+        return shared_backing
+
+    for pd, identical_idx in zip(system.protection_domains, identical_images):
+        if pd.cache_colours is not None:
+            continue
+        pd_elf_backing[pd], reserved_size = elf_segment_backing(
+            pd_elf_files[pd],
+            reserved_size,
+            kernel_config.minimum_page_size,
+            SEL4_LARGE_PAGE_SIZE,
+            shared_elf_backing(pd, identical_idx)
+        )
+
+    # Memory regions with initial contents are also placed in the reserved
+    # region, as memory the kernel makes into untyped objects is cleared when
+    # the monitor retypes it.
+    mr_data_offsets: Dict[str, int] = {}
+    for mr in system.memory_regions:
+        if mr.data is None or mr.cache_colours is not None:
+            continue
+        reserved_size = round_up(reserved_size, mr.page_size)
+        mr_data_offsets[mr.name] = reserved_size
+        reserved_size += mr.size
+
+    colour_span = kernel_config.cache_colours * kernel_config.minimum_page_size
+    coloured_pages = ColouredPageAllocator(round_up(reserved_size, colour_span), kernel_config.cache_colours, kernel_config.minimum_page_size)
+    for pd, identical_idx in zip(system.protection_domains, identical_images):
+        if pd.cache_colours is None:
+            continue
+        pd_elf_backing[pd] = coloured_elf_segment_backing(
+            pd_elf_files[pd],
+            coloured_pages,
+            pd.cache_colours,
+            kernel_config.minimum_page_size,
+            shared_elf_backing(pd, identical_idx)
+        )
+    mr_data_pages: Dict[str, Tuple[int, ...]] = {}
+    for mr in system.memory_regions:
+        if mr.data is None or mr.cache_colours is None:
+            continue
+        mr_data_pages[mr.name] = tuple(coloured_pages.alloc(mr.cache_colours) for _ in range(mr.page_count))
+    uses_coloured_pages = coloured_pages.end > coloured_pages.base
+    if uses_coloured_pages:
+        reserved_size = coloured_pages.end
+
+    uses_large_pages = invocation_table_size >= SEL4_LARGE_PAGE_SIZE or any(
+        page_size == SEL4_LARGE_PAGE_SIZE
+        for backing in pd_elf_backing.values()
+        for segment_backing in backing
+        for _, _, page_size in segment_backing.parts
+    ) or any(system.mr_by_name[name].page_size == SEL4_LARGE_PAGE_SIZE for name in mr_data_offsets)
+    reserved_alignment = SEL4_LARGE_PAGE_SIZE if uses_large_pages else kernel_config.minimum_page_size
+    if uses_coloured_pages:
+        reserved_alignment = max(reserved_alignment, colour_span)
 
     # Now that the size is determine, find a free region in the physical memory
     # space.
@@ -698,7 +1536,7 @@ def build_system(
     # The kernel relies on the reserved region being allocated above the kernel
     # boot/ELF region, so we have the end of the kernel boot region as the lower
     # bound for allocating the reserved region.
-    reserved_base = available_memory.allocate_from(reserved_size, kernel_boot_region.end)
+    reserved_base = available_memory.allocate_from(reserved_size, kernel_boot_region.end, reserved_alignment)
     assert kernel_boot_region.base < reserved_base
     # The kernel relies on the initial task being allocated above the reserved
     # region, so we have the address of the end of the reserved region as the
@@ -706,46 +1544,30 @@ def build_system(
     initial_task_phys_base = available_memory.allocate_from(initial_task_size, reserved_base + reserved_size)
     assert reserved_base < initial_task_phys_base
 
+    # The physical address of each page of the fixed memory regions whose
+    # pages are not contiguous
+    fixed_page_addrs: Dict[str, Tuple[int, ...]] = {
+        name: tuple(reserved_base + offset for offset in page_offsets)
+        for name, page_offsets in mr_data_pages.items()
+    }
+    memory_regions = tuple(
+        replace(mr, phys_addr=reserved_base + mr_data_offsets[mr.name]) if mr.name in mr_data_offsets else
+        replace(mr, phys_addr=fixed_page_addrs[mr.name][0]) if mr.name in fixed_page_addrs else
+        mr
+        for mr in system.memory_regions
+    )
+    mr_by_name = {mr.name: mr for mr in memory_regions}
+
     initial_task_phys_region = MemoryRegion(initial_task_phys_base, initial_task_phys_base + initial_task_size)
     initial_task_virt_region = virt_mem_region_from_elf(monitor_elf, kernel_config.minimum_page_size)
 
     reserved_region = MemoryRegion(reserved_base, reserved_base + reserved_size)
 
     # Now that the reserved region has been allocated we can determine the specific
-    # region of physical memory required for the inovcation table itself, and
-    # all the ELF segments
+    # region of physical memory required for the inovcation table itself. The
+    # ELF segments follow it, as laid out above.
     invocation_table_region = MemoryRegion(reserved_base, reserved_base + invocation_table_size)
 
-    phys_addr_next = invocation_table_region.end
-    # Now we create additional MRs (and mappings) for the ELF files.
-    for pd in system.protection_domains:
-        for segment in pd_elf_files[pd].segments:
-            if not segment.loadable:
-                continue
-
-            perms = ""
-            if segment.is_readable:
-                perms += "r"
-            if segment.is_writable:
-                perms += "w"
-            if segment.is_executable:
-                perms += "x"
-
-            phys_addr_next = round_up(phys_addr_next + len(segment.data), kernel_config.minimum_page_size)
-
-            # base_vaddr = round_down(segment.virt_addr, kernel_config.minimum_page_size)
-            # end_vaddr = round_up(segment.virt_addr + segment.mem_size, kernel_config.minimum_page_size)
-            # aligned_size = end_vaddr - base_vaddr
-            # name = f"ELF:{pd.name}-{seg_idx}"
-            # mr = SysMemoryRegion(name, "small", aligned_size // kernel_config.minimum_page_size, phys_addr_next)
-            # seg_idx += 1
-            # phys_addr_next += aligned_size
-            # system.mr_by_name[mr.name] = mr
-            # system.memory_regions.append(mr)
-
-            # mp = SysMap(mr.name, base_vaddr, perms=perms, cached=True)
-            # pd.maps.append(mp)
-
     # 1.3 With both the initial task region and reserved region determined the kernel
     # boot can be emulated. This provides the boot info information which is needed
     # for the next steps
@@ -904,39 +1726,54 @@ def build_system(
     # of the reserved region. We can retype multiple frames as a time (
     # which reduces the number of invocations we need). However, it is possible
     # that the region spans multiple untyped objects.
-    # At this point in time we assume we will map the area using the minimum
-    # page size. It would be good in the future to use super pages (when
-    # it makes sense to - this would reduce memory usage, and the number of
-    # invocations required to set up the address space
-    pages_required= invocation_table_size // kernel_config.minimum_page_size
-    remaining_pages = pages_required
+    # When the reserved region is large page aligned, as much of the table as
+    # possible is mapped with large pages, and the remainder with the minimum
+    # page size. This reduces the number of page and page table objects, the
+    # invocations required to set up the address space, and the TLB pressure
+    # when the monitor walks the table.
+    if invocation_table_region.base % SEL4_LARGE_PAGE_SIZE == 0:
+        large_pages_required = invocation_table_size // SEL4_LARGE_PAGE_SIZE
+    else:
+        large_pages_required = 0
+    small_pages_required = (invocation_table_size - large_pages_required * SEL4_LARGE_PAGE_SIZE) // kernel_config.minimum_page_size
     invocation_table_allocations = []
     phys_addr = invocation_table_region.base
     base_page_cap = 0
-    for pta in range(base_page_cap, base_page_cap + pages_required):
+    base_small_page_cap = base_page_cap + large_pages_required
+    for pta in range(base_page_cap, base_small_page_cap):
+        cap_address_names[system_cap_address_mask | pta] = "LargePage: monitor invocation table"
+    for pta in range(base_small_page_cap, base_small_page_cap + small_pages_required):
         cap_address_names[system_cap_address_mask | pta] = "SmallPage: monitor invocation table"
 
+    remaining_pages = {
+        Sel4Object.LargePage: large_pages_required,
+        Sel4Object.SmallPage: small_pages_required,
+    }
     cap_slot = base_page_cap
     for ut in (ut for ut in kernel_boot_info.untyped_objects if ut.is_device):
-        ut_pages = ut.region.size // kernel_config.minimum_page_size
-        retype_page_count = min(ut_pages, remaining_pages)
-        assert retype_page_count <= kernel_config.fan_out_limit, f"retype_page_count: {retype_page_count}, fan_out_limit: {kernel_config.fan_out_limit}"
-        bootstrap_invocations.append(Sel4UntypedRetype(
-                ut.cap,
-                Sel4Object.SmallPage,
-                0,
-                root_cnode_cap,
-                1,
-                1,
-                cap_slot,
-                retype_page_count
-        ))
+        for page_object, remaining in remaining_pages.items():
+            page_size = FIXED_OBJECT_SIZES[page_object]
+            while remaining > 0 and phys_addr + page_size <= ut.region.end:
+                assert phys_addr % page_size == 0
+                retype_page_count = min((ut.region.end - phys_addr) // page_size, remaining, kernel_config.fan_out_limit)
+                bootstrap_invocations.append(Sel4UntypedRetype(
+                        ut.cap,
+                        page_object,
+                        0,
+                        root_cnode_cap,
+                        1,
+                        1,
+                        cap_slot,
+                        retype_page_count
+                ))
+
+                remaining -= retype_page_count
+                cap_slot += retype_page_count
+                phys_addr += retype_page_count * page_size
+            remaining_pages[page_object] = remaining
 
-        remaining_pages -= retype_page_count
-        cap_slot += retype_page_count
-        phys_addr += retype_page_count * kernel_config.minimum_page_size
         invocation_table_allocations.append((ut, phys_addr))
-        if remaining_pages == 0:
+        if sum(remaining_pages.values()) == 0:
             break
 
     # 2.2.1: Now that physical pages have been allocated it is possible to setup
@@ -946,31 +1783,14 @@ def build_system(
     # invocations to occur at system startup. This should be enough for any reasonable
     # sized system.
     #
-    # Before mapping it is necessary to install page tables that can cover the region
+    # Before mapping it is necessary to install page tables that can cover the
+    # part of the region mapped with small pages
     SEL4_PAGE_TABLE_SIZE = FIXED_OBJECT_SIZES[Sel4Object.PageTable]
-    SEL4_LARGE_PAGE_SIZE = FIXED_OBJECT_SIZES[Sel4Object.LargePage]
-    page_tables_required = round_up(invocation_table_size, SEL4_LARGE_PAGE_SIZE) // SEL4_LARGE_PAGE_SIZE
-    page_table_allocation = kao.alloc(SEL4_PAGE_TABLE_SIZE, page_tables_required)
+    large_pages_vaddr = 0x8000_0000
+    small_pages_vaddr = large_pages_vaddr + large_pages_required * SEL4_LARGE_PAGE_SIZE
+    page_tables_required = round_up(small_pages_required * kernel_config.minimum_page_size, SEL4_LARGE_PAGE_SIZE) // SEL4_LARGE_PAGE_SIZE
     base_page_table_cap = cap_slot
 
-    for pta in range(base_page_table_cap, base_page_table_cap + page_tables_required):
-        cap_address_names[system_cap_address_mask | pta] = "PageTable: monitor"
-
-    assert page_tables_required <= kernel_config.fan_out_limit
-    bootstrap_invocations.append(Sel4UntypedRetype(
-            page_table_allocation.untyped_cap_address,
-            Sel4Object.PageTable,
-            0,
-            root_cnode_cap,
-            1,
-            1,
-            cap_slot,
-            page_tables_required
-    ))
-    cap_slot += page_tables_required
-
-    # Now that the page tables are allocated they can be mapped into vspace
-    vaddr = 0x8000_0000
     if kernel_config.arch == KernelArch.AARCH64:
         arch_page_table_map = Sel4ARMPageTableMap
         arch_vm_attributes = SEL4_ARM_DEFAULT_VMATTRIBUTES
@@ -983,15 +1803,34 @@ def build_system(
     else:
         raise Exception(f"Unexpected kernel architecture: {kernel_config.arch}")
 
-    invocation = arch_page_table_map(system_cap_address_mask | base_page_table_cap,
-                                     INIT_VSPACE_CAP_ADDRESS,
-                                     vaddr,
-                                     arch_vm_attributes)
-    invocation.repeat(page_tables_required, page_table=1, vaddr=SEL4_LARGE_PAGE_SIZE)
-    bootstrap_invocations.append(invocation)
+    if page_tables_required > 0:
+        page_table_allocation = kao.alloc(SEL4_PAGE_TABLE_SIZE, page_tables_required)
+
+        for pta in range(base_page_table_cap, base_page_table_cap + page_tables_required):
+            cap_address_names[system_cap_address_mask | pta] = "PageTable: monitor"
+
+        assert page_tables_required <= kernel_config.fan_out_limit
+        bootstrap_invocations.append(Sel4UntypedRetype(
+                page_table_allocation.untyped_cap_address,
+                Sel4Object.PageTable,
+                0,
+                root_cnode_cap,
+                1,
+                1,
+                cap_slot,
+                page_tables_required
+        ))
+        cap_slot += page_tables_required
+
+        # Now that the page tables are allocated they can be mapped into vspace
+        invocation = arch_page_table_map(system_cap_address_mask | base_page_table_cap,
+                                         INIT_VSPACE_CAP_ADDRESS,
+                                         small_pages_vaddr,
+                                         arch_vm_attributes)
+        invocation.repeat(page_tables_required, page_table=1, vaddr=SEL4_LARGE_PAGE_SIZE)
+        bootstrap_invocations.append(invocation)
 
     # Finally, once the page tables are allocated the pages can be mapped
-    vaddr = 0x8000_0000
     if kernel_config.arch == KernelArch.AARCH64:
         arch_vm_attributes = SEL4_ARM_DEFAULT_VMATTRIBUTES | SEL4_ARM_EXECUTE_NEVER
     elif kernel_config.arch == KernelArch.RISCV64:
@@ -1000,14 +1839,20 @@ def build_system(
         arch_vm_attributes = SEL4_X86_DEFAULT_VMATTRIBUTES
     else:
         raise Exception(f"Unexpected kernel architecture: {kernel_config.arch}")
-    invocation = Sel4PageMap(kernel_config.arch,
-                             system_cap_address_mask | base_page_cap,
-                             INIT_VSPACE_CAP_ADDRESS,
-                             vaddr,
-                             SEL4_RIGHTS_READ,
-                             arch_vm_attributes)
-    invocation.repeat(pages_required, page=1, vaddr=kernel_config.minimum_page_size)
-    bootstrap_invocations.append(invocation)
+    for page_cap, vaddr, page_count, page_size in (
+        (base_page_cap, large_pages_vaddr, large_pages_required, SEL4_LARGE_PAGE_SIZE),
+        (base_small_page_cap, small_pages_vaddr, small_pages_required, kernel_config.minimum_page_size),
+    ):
+        if page_count == 0:
+            continue
+        invocation = Sel4PageMap(kernel_config.arch,
+                                 system_cap_address_mask | page_cap,
+                                 INIT_VSPACE_CAP_ADDRESS,
+                                 vaddr,
+                                 SEL4_RIGHTS_READ,
+                                 arch_vm_attributes)
+        invocation.repeat(page_count, page=1, vaddr=page_size)
+        bootstrap_invocations.append(invocation)
 
 
     # 3. Now we can start setting up the system based on the information
@@ -1029,17 +1874,16 @@ def build_system(
     #     as needed by protection domains based on mappings required
 
 
-    phys_addr_next = reserved_base + invocation_table_size
-    # Now we create additional MRs (and mappings) for the ELF files.
-    regions: List[Region] = []
+    # Now we create additional MRs (and mappings) for the ELF files. A segment
+    # backed by both small and large pages is split into one MR per part.
+    # Shared segments are mapped with the MRs of the PD that owns the frames.
     extra_mrs = []
     pd_extra_maps: Dict[ProtectionDomain, Tuple[SysMap, ...]] = {pd: tuple() for pd in system.protection_domains}
-    for pd in list(system.protection_domains):
-        seg_idx = 0
-        for segment in pd_elf_files[pd].segments:
-            if not segment.loadable:
-                continue
-
+    backing_mrs: Dict[int, List[SysMemoryRegion]] = {}
+    elf_mr_owners: Dict[str, Owner] = {}
+    for pd in system.protection_domains:
+        for seg_idx, segment_backing in enumerate(pd_elf_backing[pd]):
+            segment = segment_backing.segment
             perms = ""
             if segment.is_readable:
                 perms += "r"
@@ -1048,22 +1892,30 @@ def build_system(
             if segment.is_executable:
                 perms += "x"
 
-            base_vaddr = round_down(segment.virt_addr, kernel_config.minimum_page_size)
-            end_vaddr = round_up(segment.virt_addr + segment.mem_size, kernel_config.minimum_page_size)
-            aligned_size = end_vaddr - base_vaddr
-            offset_from_aligned = segment.virt_addr - base_vaddr
-            regions.append(Region(f"PD-ELF {pd.name}-{seg_idx}", phys_addr_next, offset_from_aligned, segment.data))
-            name = f"ELF:{pd.name}-{seg_idx}"
-            mr = SysMemoryRegion(name, aligned_size, 0x1000, aligned_size // 0x1000, phys_addr_next)
-            seg_idx += 1
-            phys_addr_next += aligned_size
-            extra_mrs.append(mr)
-
-            mp = SysMap(mr.name, base_vaddr, perms=perms, cached=True, element=None)
-            pd_extra_maps[pd] += (mp, )
-
-    all_mrs = system.memory_regions + tuple(extra_mrs)
+            if not segment_backing.shared:
+                mrs = []
+                phys_addr = reserved_base + segment_backing.phys_addr
+                for part_idx, (vaddr, size, page_size) in enumerate(segment_backing.parts):
+                    name = f"ELF:{pd.name}-{seg_idx}"
+                    if len(segment_backing.parts) > 1:
+                        name += f".{part_idx}"
+                    mrs.append(SysMemoryRegion(name, size, page_size, size // page_size, phys_addr, auto_page_size=True, cache_colours=pd.cache_colours))
+                    elf_mr_owners[name] = pd_owner(pd)
+                    if segment_backing.page_phys_addrs:
+                        fixed_page_addrs[name] = tuple(reserved_base + offset for offset in segment_backing.page_phys_addrs)
+                    phys_addr += size
+                extra_mrs += mrs
+                backing_mrs[segment_backing.phys_addr] = mrs
+
+            for mr, (vaddr, _, _) in zip(backing_mrs[segment_backing.phys_addr], segment_backing.parts):
+                mp = SysMap(mr.name, vaddr, perms=perms, cached=True, element=None)
+                pd_extra_maps[pd] += (mp, )
+
+    all_mrs = memory_regions + tuple(extra_mrs)
     all_mr_by_name = {mr.name: mr for mr in all_mrs}
+    # The pages of an ELF MR belong to its PD, those of other MRs to the MR
+    mr_owners = {mr.name: mr_owner(mr) for mr in all_mrs}
+    mr_owners.update(elf_mr_owners)
 
     system_invocations: List[Sel4Invocation] = []
     init_system = InitSystem(kernel_config,
@@ -1073,7 +1925,8 @@ def build_system(
                              kao,
                              kernel_boot_info,
                              system_invocations,
-                             cap_address_names)
+                             cap_address_names,
+                             cap_address_owners)
     init_system.reserve(invocation_table_allocations)
 
     SUPPORTED_PAGE_SIZES = arch_get_page_sizes(kernel_config.arch)
@@ -1083,17 +1936,33 @@ def build_system(
     page_names_by_size: Dict[int, List[str]] = {
         page_size: [] for page_size in SUPPORTED_PAGE_SIZES
     }
+    page_colours_by_size: Dict[int, List[Optional[FrozenSet[int]]]] = {
+        page_size: [] for page_size in SUPPORTED_PAGE_SIZES
+    }
+    page_owners_by_size: Dict[int, List[Optional[Owner]]] = {
+        page_size: [] for page_size in SUPPORTED_PAGE_SIZES
+    }
     page_names_by_size[0x1000] += [f"Page({human_size_strict(0x1000)}): IPC Buffer PD={pd.name}" for pd in system.protection_domains]
+    page_colours_by_size[0x1000] += [pd.cache_colours for pd in system.protection_domains]
+    page_owners_by_size[0x1000] += [pd_owner(pd) for pd in system.protection_domains]
     for mr in all_mrs:
         if mr.phys_addr is not None:
             continue
         page_size_human = human_size_strict(mr.page_size)
         page_names_by_size[mr.page_size] +=  [f"Page({page_size_human}): MR={mr.name} #{idx}" for idx in range(mr.page_count)]
+        page_colours_by_size[mr.page_size] += [mr.cache_colours] * mr.page_count
+        page_owners_by_size[mr.page_size] += [mr_owners[mr.name]] * mr.page_count
 
     page_objects: Dict[int, List[KernelObject]] = {}
 
     for page_size, page_object in reversed(list(zip(SUPPORTED_PAGE_SIZES, SUPPORTED_PAGE_OBJECTS))):
-        page_objects[page_size] = init_system.allocate_objects(kernel_config, page_object, page_names_by_size[page_size])
+        page_objects[page_size] = init_system.allocate_objects(
+            kernel_config,
+            page_object,
+            page_names_by_size[page_size],
+            colours=page_colours_by_size[page_size],
+            owners=page_owners_by_size[page_size],
+        )
 
     ipc_buffer_objects = page_objects[0x1000][:len(system.protection_domains)]
 
@@ -1115,52 +1984,72 @@ def build_system(
     for mr in all_mrs: #system.memory_regions:
         if mr.phys_addr is None:
             continue
-        phys_addr = mr.phys_addr
-        for idx in range(mr.page_count):
-            fixed_pages.append((phys_addr, mr))
-            phys_addr += mr_page_bytes(mr)
+        page_addrs = fixed_page_addrs.get(mr.name)
+        if page_addrs is None:
+            page_addrs = tuple(mr.phys_addr + idx * mr_page_bytes(mr) for idx in range(mr.page_count))
+        fixed_pages += [(phys_addr, mr) for phys_addr in page_addrs]
 
     fixed_pages.sort()
 
     # FIXME: At this point we can recombine them into
     # groups to optimize allocation
 
+    # The pages of an MR are mapped through consecutive caps, so the caps of
+    # pages that are not contiguous, and so may be interleaved with those of
+    # other MRs, are reserved up front.
+    fixed_page_cap_slots = {
+        mr.name: init_system.reserve_cap_slots(mr.page_count)
+        for mr in all_mrs
+        if mr.name in fixed_page_addrs
+    }
+
     for phys_addr, mr in fixed_pages:
         if mr.page_size not in SUPPORTED_PAGE_SIZES:
             raise Exception(f"Invalid page_size: 0x{mr.page_size:x} for mr {mr}")
         obj_type = PAGE_OBJECT_BY_SIZE[mr.page_size]
         obj_type_name = f"Page({human_size_strict(mr.page_size)})"
         name = f"{obj_type_name}: MR={mr.name} @ {phys_addr:x}"
-        page = init_system.allocate_fixed_objects(kernel_config, phys_addr, obj_type, 1, names=[name])[0]
+        cap_slot = None
+        if mr.name in fixed_page_cap_slots:
+            cap_slot = fixed_page_cap_slots[mr.name] + fixed_page_addrs[mr.name].index(phys_addr)
+        page = init_system.allocate_fixed_objects(kernel_config, phys_addr, obj_type, 1, names=[name], cap_slot=cap_slot, owner=mr_owners[mr.name])[0]
         mr_pages[mr].append(page)
 
+    # The cache colours of the objects of each PD and VM. VMs are not coloured.
+    domain_colours = [pd.cache_colours for pd in system.protection_domains] + [None] * len(virtual_machines)
+    domain_owners = [pd_owner(pd) for pd in system.protection_domains] + [vm_owner(vm) for vm in virtual_machines]
+
     # TCBs
     tcb_names = [f"TCB: PD={pd.name}" for pd in system.protection_domains]
     tcb_names += [f"TCB: VM={vm.name}" for vm in virtual_machines]
-    tcb_objects = init_system.allocate_objects(kernel_config, Sel4Object.Tcb, tcb_names)
+    tcb_objects = init_system.allocate_objects(kernel_config, Sel4Object.Tcb, tcb_names, colours=domain_colours, owners=domain_owners)
     tcb_caps = [tcb_obj.cap_addr for tcb_obj in tcb_objects]
     # VCPUs
     vcpu_names = [f"VCPU: VM={vm.name}" for vm in virtual_machines]
-    vcpu_objects = init_system.allocate_objects(kernel_config, Sel4Object.Vcpu, vcpu_names)
+    vcpu_objects = init_system.allocate_objects(kernel_config, Sel4Object.Vcpu, vcpu_names, owners=[vm_owner(vm) for vm in virtual_machines])
     # SchedContexts
     schedcontext_names = [f"SchedContext: PD={pd.name}" for pd in system.protection_domains]
     schedcontext_names += [f"SchedContext: VM={vm.name}" for vm in virtual_machines]
-    schedcontext_objects = init_system.allocate_objects(kernel_config, Sel4Object.SchedContext, schedcontext_names, size=PD_SCHEDCONTEXT_SIZE)
+    schedcontext_objects = init_system.allocate_objects(kernel_config, Sel4Object.SchedContext, schedcontext_names, size=PD_SCHEDCONTEXT_SIZE, owners=domain_owners)
     schedcontext_caps = [sc.cap_addr for sc in schedcontext_objects]
     # Endpoints
     pds_with_endpoints = [pd for pd in system.protection_domains if pd.needs_ep]
     endpoint_names = ["EP: Monitor Fault"] + [f"EP: PD={pd.name}" for pd in pds_with_endpoints]
     # Replies
     reply_names = ["Reply: Monitor"]+ [f"Reply: PD={pd.name}" for pd in system.protection_domains]
-    reply_objects = init_system.allocate_objects(kernel_config, Sel4Object.Reply, reply_names)
+    reply_colours = [None] + [pd.cache_colours for pd in system.protection_domains]
+    reply_owners = [MONITOR_OWNER] + [pd_owner(pd) for pd in system.protection_domains]
+    reply_objects = init_system.allocate_objects(kernel_config, Sel4Object.Reply, reply_names, colours=reply_colours, owners=reply_owners)
     reply_object = reply_objects[0]
     # FIXME: Probably only need reply objects for PPs
     pd_reply_objects = reply_objects[1:]
-    endpoint_objects = init_system.allocate_objects(kernel_config, Sel4Object.Endpoint, endpoint_names)
+    endpoint_colours = [None] + [pd.cache_colours for pd in pds_with_endpoints]
+    endpoint_owners = [MONITOR_OWNER] + [pd_owner(pd) for pd in pds_with_endpoints]
+    endpoint_objects = init_system.allocate_objects(kernel_config, Sel4Object.Endpoint, endpoint_names, colours=endpoint_colours, owners=endpoint_owners)
     fault_ep_endpoint_object = endpoint_objects[0]
     pd_endpoint_objects = dict(zip(pds_with_endpoints, endpoint_objects[1:]))
     notification_names = [f"Notification: PD={pd.name}" for pd in system.protection_domains]
-    notification_objects = init_system.allocate_objects(kernel_config, Sel4Object.Notification, notification_names)
+    notification_objects = init_system.allocate_objects(kernel_config, Sel4Object.Notification, notification_names, colours=domain_colours[:len(system.protection_domains)], owners=domain_owners[:len(system.protection_domains)])
     notification_objects_by_pd = dict(zip(system.protection_domains, notification_objects))
     notification_caps = [ntfn.cap_addr for ntfn in notification_objects]
 
@@ -1185,6 +2074,7 @@ def build_system(
     uds = []
     ds = []
     pts = []
+    paging_stats: List[PagingStats] = []
     for idx, domain in enumerate(list(system.protection_domains) + virtual_machines):
         is_pd = idx < len(system.protection_domains)
         # For now, we only want to set the IPC buffer symbol on protection domains.
@@ -1212,12 +2102,32 @@ def build_system(
         if is_pd:
             all_maps += pd_extra_maps[domain]
 
+        # The directories covering a PD's MR window are created up front. The
+        # monitor maps page tables into the window on demand from its pool.
+        if is_pd and domain.mr_window is not None:
+            for vaddr in range(domain.mr_window.vaddr, domain.mr_window.vaddr + domain.mr_window.size, MR_BLOCK_SIZE):
+                vaddrs.append((vaddr, MR_BLOCK_SIZE))
+
+        # The pages as if the tool had not chosen any large pages, to report
+        # what the large pages save.
+        small_vaddrs = list(vaddrs)
+        pages = 1 if is_pd else 0
+        small_pages = pages
+
         for map in all_maps:
             mr = all_mr_by_name[map.mr]
             vaddr = map.vaddr
             for _ in range(mr.page_count):
                 vaddrs.append((vaddr, mr.page_size))
                 vaddr += mr_page_bytes(mr)
+            pages += mr.page_count
+            if mr.auto_page_size and mr.page_size != kernel_config.minimum_page_size:
+                small_page_count = mr.size // kernel_config.minimum_page_size
+                small_vaddrs += [(map.vaddr + idx * kernel_config.minimum_page_size, kernel_config.minimum_page_size) for idx in range(small_page_count)]
+            else:
+                small_page_count = mr.page_count
+                small_vaddrs += vaddrs[-mr.page_count:]
+            small_pages += small_page_count
 
         for vaddr, page_size in vaddrs:
             upper_directory_vaddrs.add(mask_bits(vaddr, 12 + 9 + 9 + 9))
@@ -1225,6 +2135,9 @@ def build_system(
             if page_size == 0x1_000:
                 page_table_vaddrs.add(mask_bits(vaddr, 12 + 9))
 
+        small_page_table_vaddrs = {mask_bits(vaddr, 12 + 9) for vaddr, page_size in small_vaddrs if page_size == 0x1_000}
+        paging_stats.append(PagingStats(domain.name, pages, small_pages, len(page_table_vaddrs), len(small_page_table_vaddrs)))
+
         if not (kernel_config.hyp_mode and kernel_config.arm_pa_size_bits == 40):
             uds += [(idx, vaddr) for vaddr in sorted(upper_directory_vaddrs)]
         ds += [(idx, vaddr) for vaddr in sorted(directory_vaddrs)]
@@ -1233,17 +2146,17 @@ def build_system(
     names = [domain.name for domain in list(system.protection_domains) + virtual_machines]
     vspace_names = [f"VSpace: PD={pd.name}" for pd in system.protection_domains]
     vspace_names += [f"VSpace: VM={vm.name}" for vm in virtual_machines]
-    vspace_objects = init_system.allocate_objects(kernel_config, Sel4Object.Vspace, vspace_names)
+    vspace_objects = init_system.allocate_objects(kernel_config, Sel4Object.Vspace, vspace_names, colours=domain_colours, owners=domain_owners)
 
     # @ivanv: fix this so that the name of the object is correct depending if it's
     # a PD or VM
     if kernel_config.arch == KernelArch.AARCH64:
         if not (kernel_config.hyp_mode and kernel_config.arm_pa_size_bits == 40):
             ud_names = [f"PageTable: PD/VM={names[idx]} VADDR=0x{vaddr:x}" for idx, vaddr in uds]
-            ud_objects = init_system.allocate_objects(kernel_config, Sel4Object.PageTable, ud_names)
+            ud_objects = init_system.allocate_objects(kernel_config, Sel4Object.PageTable, ud_names, colours=[domain_colours[idx] for idx, _ in uds], owners=[domain_owners[idx] for idx, _ in uds])
 
         d_names = [f"PageTable: PD/VM={names[idx]} VADDR=0x{vaddr:x}" for idx, vaddr in ds]
-        d_objects = init_system.allocate_objects(kernel_config, Sel4Object.PageTable, d_names)
+        d_objects = init_system.allocate_objects(kernel_config, Sel4Object.PageTable, d_names, colours=[domain_colours[idx] for idx, _ in ds], owners=[domain_owners[idx] for idx, _ in ds])
     elif kernel_config.arch == KernelArch.RISCV64:
         # This code assumes a 64-bit system with Sv39, which is actually all seL4 currently
         # supports.
@@ -1251,17 +2164,51 @@ def build_system(
         assert kernel_config.riscv_page_table_levels == 3
         # Allocating for 3-level page table
         d_names = [f"PageTable: PD/VM={names[idx]} VADDR=0x{vaddr:x}" for idx, vaddr in ds]
-        d_objects = init_system.allocate_objects(kernel_config, Sel4Object.PageTable, d_names)
+        d_objects = init_system.allocate_objects(kernel_config, Sel4Object.PageTable, d_names, colours=[domain_colours[idx] for idx, _ in ds], owners=[domain_owners[idx] for idx, _ in ds])
     else:
         raise Exception(f"Unexpected kernel architecture: {kernel_config.arch}")
 
     pt_names = [f"PageTable: PD/VM={names[idx]} VADDR=0x{vaddr:x}" for idx, vaddr in pts]
-    pt_objects = init_system.allocate_objects(kernel_config, Sel4Object.PageTable, pt_names)
+    pt_objects = init_system.allocate_objects(kernel_config, Sel4Object.PageTable, pt_names, colours=[domain_colours[idx] for idx, _ in pts], owners=[domain_owners[idx] for idx, _ in pts])
+
+    # The monitor writes fault records into the fault log MR, and timeout
+    # fault statistics into the budget stats MR (if any), so these are mapped
+    # into the monitor's own address space. The upper levels of the monitor's
+    # page table already exist as they cover the invocation table.
+    fault_log_mr = mr_by_name.get(system.monitor.fault_log)
+    budget_stats_mr = mr_by_name.get(system.monitor.budget_stats)
+    monitor_mrs: List[Tuple[SysMemoryRegion, int, List[KernelObject]]] = []
+    for mr, vaddr, description in (
+        (fault_log_mr, MONITOR_FAULT_LOG_VADDR, "fault log"),
+        (budget_stats_mr, MONITOR_BUDGET_STATS_VADDR, "budget stats"),
+    ):
+        if mr is None:
+            continue
+        monitor_pt_objects = []
+        if mr.page_size == kernel_config.minimum_page_size:
+            monitor_pt_objects = init_system.allocate_objects(kernel_config, Sel4Object.PageTable, [f"PageTable: monitor {description}"], owners=[MONITOR_OWNER])
+        monitor_mrs.append((mr, vaddr, monitor_pt_objects))
+
+    # The monitor's MR reserve is split into large page sized untypeds, so
+    # that each block can be reclaimed independently by revoking it. Page
+    # tables for the PDs' MR windows come from a pool sized so that every
+    # window can be fully mapped with small pages.
+    mr_block_count = system.monitor.mr_reserve // MR_BLOCK_SIZE
+    mr_block_names = [f"Untyped: monitor MR reserve #{idx}" for idx in range(mr_block_count)]
+    mr_block_objects = init_system.allocate_objects(kernel_config, Sel4Object.Untyped, mr_block_names, size=MR_BLOCK_SIZE, owners=[MONITOR_OWNER] * mr_block_count)
+    mr_pt_names = []
+    mr_pt_colours = []
+    for pd in system.protection_domains:
+        if pd.mr_window is not None:
+            for vaddr in range(pd.mr_window.vaddr, pd.mr_window.vaddr + pd.mr_window.size, MR_BLOCK_SIZE):
+                mr_pt_names.append(f"PageTable: monitor MR pool PD={pd.name} VADDR=0x{vaddr:x}")
+                mr_pt_colours.append(pd.cache_colours)
+    mr_pt_objects = init_system.allocate_objects(kernel_config, Sel4Object.PageTable, mr_pt_names, colours=mr_pt_colours, owners=[MONITOR_OWNER] * len(mr_pt_names))
 
     # Create CNodes - all CNode objects are the same size: 128 slots.
     cnode_names = [f"CNode: PD={pd.name}" for pd in system.protection_domains]
     cnode_names += [f"CNode: VM={vm.name}" for vm in virtual_machines]
-    cnode_objects = init_system.allocate_objects(kernel_config, Sel4Object.CNode, cnode_names, size=PD_CAP_SIZE)
+    cnode_objects = init_system.allocate_objects(kernel_config, Sel4Object.CNode, cnode_names, size=PD_CAP_SIZE, owners=domain_owners)
 
     # @ivanv: make a note why this is okay
     cnode_objects_by_pd = dict(zip(system.protection_domains, cnode_objects))
@@ -1288,6 +2235,7 @@ def build_system(
 
             cap_slot += 1
             cap_address_names[cap_address] = f"IRQ Handler: irq={sysirq.irq:d}"
+            cap_address_owners[cap_address] = pd_owner(pd)
             irq_cap_addresses[pd].append(cap_address)
 
     # This has to be done prior to minting!
@@ -1345,6 +2293,7 @@ def build_system(
 
             for idx in range(len(mr_pages[mr])):
                 cap_address_names[system_cap_address_mask | (cap_slot + idx)] = cap_address_names[mr_pages[mr][0].cap_addr + idx] + " (derived)"
+                cap_address_owners[system_cap_address_mask | (cap_slot + idx)] = domain_owners[domain_idx]
 
             cap_slot += len(mr_pages[mr])
 
@@ -1365,6 +2314,7 @@ def build_system(
                     badge)
             )
             cap_address_names[badged_cap_address] = cap_address_names[notification_obj.cap_addr] + f" (badge=0x{badge:x})"
+            cap_address_owners[badged_cap_address] = pd_owner(pd)
             badged_irq_caps[pd].append(badged_cap_address)
             cap_slot += 1
 
@@ -1425,6 +2375,36 @@ def build_system(
         system_invocations.append(invocation)
         cap_slot += 1
 
+    # Create a timeout fault endpoint cap for each protection domain that
+    # asks for timeout faults. These always go to the monitor, badged with
+    # the PD's index, as the monitor keeps the budget statistics. This also
+    # applies to child PDs: their parent's fault handler cannot reply to
+    # resume them.
+    timeout_fault_eps: Dict[ProtectionDomain, int] = {}
+    for idx, pd in enumerate(system.protection_domains, 1):
+        if not pd.timeout_faults:
+            continue
+
+        invocation = Sel4CnodeMint(
+            system_cnode_cap,
+            cap_slot,
+            system_cnode_bits,
+            root_cnode_cap,
+            fault_ep_endpoint_object.cap_addr,
+            kernel_config.cap_address_bits,
+            SEL4_RIGHTS_ALL,
+            idx
+        )
+        system_invocations.append(invocation)
+        timeout_fault_eps[pd] = system_cap_address_mask | cap_slot
+        cap_address_names[timeout_fault_eps[pd]] = cap_address_names[fault_ep_endpoint_object.cap_addr] + f" (badge=0x{idx:x})"
+        cap_address_owners[timeout_fault_eps[pd]] = pd_owner(pd)
+        cap_slot += 1
+
+    # Reserve the slots the monitor retypes MR reserve frames into at run time
+    mr_frame_slot_start = cap_slot
+    cap_slot += mr_block_count * MR_BLOCK_SLOTS
+
     final_cap_slot = cap_slot
 
     ## Minting in the endpoint (or notification object if protected is not set)
@@ -1619,10 +2599,10 @@ def build_system(
                     pd_b_badge)
             )
 
-    # mint a cap between monitor and passive PDs.
+    # mint a cap between monitor and passive PDs, or PDs using the monitor's CPU stats or MR services.
     # @ivanv: need to handle VMs and add the ability for passive VMs
     for idx, (cnode_obj, pd) in enumerate(zip(cnode_objects, system.protection_domains), 1):
-        if pd.passive:
+        if pd.passive or pd.cpu_stats or pd.mr_window is not None:
             system_invocations.append(Sel4CnodeMint(
                                         cnode_obj.cap_addr,
                                         MONITOR_EP_CAP_IDX,
@@ -1698,6 +2678,29 @@ def build_system(
         invocation.repeat(count, page=1, vaddr=vaddr_incr)
         system_invocations.append(invocation)
 
+    # Map the fault log and budget stats into the monitor
+    for mr, vaddr, monitor_pt_objects in monitor_mrs:
+        if kernel_config.arch == KernelArch.AARCH64:
+            arch_page_table_map = Sel4ARMPageTableMap
+            monitor_mr_attrs = SEL4_ARM_DEFAULT_VMATTRIBUTES | SEL4_ARM_EXECUTE_NEVER
+        elif kernel_config.arch == KernelArch.RISCV64:
+            arch_page_table_map = Sel4RISCVPageTableMap
+            monitor_mr_attrs = SEL4_RISCV_DEFAULT_VMATTRIBUTES | SEL4_RISCV_EXECUTE_NEVER
+        else:
+            raise Exception(f"Unexpected kernel architecture: {kernel_config.arch}")
+
+        for pt_obj in monitor_pt_objects:
+            system_invocations.append(arch_page_table_map(pt_obj.cap_addr, INIT_VSPACE_CAP_ADDRESS, vaddr, default_vm_attributes))
+
+        invocation = Sel4PageMap(kernel_config.arch,
+                                 mr_pages[mr][0].cap_addr,
+                                 INIT_VSPACE_CAP_ADDRESS,
+                                 vaddr,
+                                 SEL4_RIGHTS_READ | SEL4_RIGHTS_WRITE,
+                                 monitor_mr_attrs)
+        invocation.repeat(len(mr_pages[mr]), page=1, vaddr=mr_page_bytes(mr))
+        system_invocations.append(invocation)
+
     # And, finally, map all the IPC buffers
     for vspace_obj, pd, ipc_buffer_obj in zip(vspace_objects, system.protection_domains, ipc_buffer_objects):
         vaddr, _ = pd_elf_files[pd].find_symbol("__sel4_ipc_buffer_obj")
@@ -1737,6 +2740,18 @@ def build_system(
                                                         schedcontext_obj.cap_addr,
                                                         fault_ep_endpoint_object.cap_addr))
 
+    for tcb_obj, pd in zip(tcb_objects, system.protection_domains):
+        if pd in timeout_fault_eps:
+            system_invocations.append(Sel4TcbSetTimeoutEndpoint(tcb_obj.cap_addr, timeout_fault_eps[pd]))
+
+    # Threads are created in the first domain of the schedule, so only the
+    # others are set. A VM runs in the domain of its PD.
+    domain_pds = list(system.protection_domains) + [pd for pd in system.protection_domains if pd.virtual_machine is not None]
+    for tcb_obj, pd in zip(tcb_objects, domain_pds):
+        domain = system.domain_index(pd)
+        if domain != 0:
+            system_invocations.append(Sel4DomainSetSet(DOMAIN_CAP_ADDRESS, domain, tcb_obj.cap_addr))
+
     # @ivanv: This should only be available on the benchmark config
     # Copy the PD's TCB cap into their address space for development purposes.
     for tcb_obj, cnode_obj in zip(tcb_objects, cnode_objects):
@@ -1802,20 +2817,17 @@ def build_system(
 
     # And now we are done. We have all the invocations
 
-    system_invocation_data_array = bytearray()
-    for system_invocation in system_invocations:
-        system_invocation_data_array += system_invocation._get_raw_invocation(kernel_config)
-    system_invocation_data = bytes(system_invocation_data_array)
-
-    for pd in system.protection_domains:
-        # Could use pd.elf_file.write_symbol here to update variables if required.
-        pd_elf_files[pd].write_symbol("microkit_name", pack("<64s", pd.name.encode("utf8")))
-        pd_elf_files[pd].write_symbol("passive", pack("?", pd.passive))
+    system_invocation_data = serialise_invocations(kernel_config, system_invocations)
 
+    pd_symbol_patches: Dict[ProtectionDomain, List[Tuple[str, bytes]]] = {}
     for pd in system.protection_domains:
+        pd_symbol_patches[pd] = [
+            ("microkit_name", pack("<64s", pd.name.encode("utf8"))),
+            ("passive", pack("?", pd.passive)),
+        ]
         for setvar in pd.setvars:
             if setvar.region_paddr is not None:
-                for mr in system.memory_regions:
+                for mr in memory_regions:
                     if mr.name == setvar.region_paddr:
                         break
                 else:
@@ -1823,14 +2835,60 @@ def build_system(
                 value = mr_pages[mr][0].phys_addr
             elif setvar.vaddr is not None:
                 value = setvar.vaddr
+            pd_symbol_patches[pd].append((setvar.symbol, pack("<Q", value)))
+
+    for pd, patches in pd_symbol_patches.items():
+        for symbol, data in patches:
             try:
-                pd_elf_files[pd].write_symbol(setvar.symbol, pack("<Q", value))
+                pd_elf_files[pd].write_symbol(symbol, data)
             except KeyError:
-                raise Exception(f"Unable to patch variable '{setvar.symbol}' in protection domain: '{pd.name}': variable not found.")
+                raise Exception(f"Unable to patch variable '{symbol}' in protection domain: '{pd.name}': variable not found.")
+
+    # The regions are only created once the program images are patched, as
+    # patching may replace the data of a segment.
+    regions: List[Region] = []
+    for pd_idx, pd in enumerate(system.protection_domains):
+        for seg_idx, segment_backing in enumerate(pd_elf_backing[pd]):
+            if segment_backing.shared:
+                continue
+            segment = segment_backing.segment
+            name = f"PD-ELF {pd.name}-{seg_idx}"
+            elf_segment_idx = pd_elf_files[pd].segments.index(segment)
+            if segment_backing.page_phys_addrs:
+                regions += page_run_regions(
+                    name,
+                    [reserved_base + addr for addr in segment_backing.page_phys_addrs],
+                    kernel_config.minimum_page_size,
+                    segment_backing.offset,
+                    memoryview(segment.data),
+                    segment.zero_size,
+                    (pd_idx, elf_segment_idx),
+                )
+                continue
+            regions.append(Region(
+                name,
+                reserved_base + segment_backing.phys_addr,
+                segment_backing.offset,
+                segment.data,
+                segment.zero_size,
+                (pd_idx, elf_segment_idx, 0, len(segment.data)),
+            ))
+    for name in mr_data_offsets:
+        mr = mr_by_name[name]
+        assert mr.phys_addr is not None
+        data = mr_data[name]
+        regions.append(Region(f"MR {name}", mr.phys_addr, 0, memoryview(data), mr.size - len(data)))
+    for name, page_addrs in fixed_page_addrs.items():
+        if name not in mr_data_pages:
+            continue
+        mr = mr_by_name[name]
+        data = mr_data[name]
+        regions += page_run_regions(f"MR {name}", page_addrs, mr.page_size, 0, memoryview(data), mr.size - len(data))
 
     return BuiltSystem(
         number_of_system_caps = final_cap_slot, #init_system._cap_slot,
         invocation_data_size = len(system_invocation_data),
+        system_invocation_data = system_invocation_data,
         bootstrap_invocations = bootstrap_invocations,
         system_invocations = system_invocations,
         kernel_boot_info = kernel_boot_info,
@@ -1838,13 +2896,28 @@ def build_system(
         fault_ep_cap_address = fault_ep_endpoint_object.cap_addr,
         reply_cap_address = reply_object.cap_addr,
         cap_lookup = cap_address_names,
+        cap_owners = cap_address_owners,
         tcb_caps = tcb_caps,
         sched_caps = schedcontext_caps,
         ntfn_caps = notification_caps,
         regions = regions,
+        pd_symbol_patches = [pd_symbol_patches[pd] for pd in system.protection_domains],
         kernel_objects = init_system._objects,
+        untyped_usage = kao.untyped,
         initial_task_phys_region = initial_task_phys_region,
         initial_task_virt_region = initial_task_virt_region,
+        fault_log_vaddr = 0 if fault_log_mr is None else MONITOR_FAULT_LOG_VADDR,
+        fault_log_size = 0 if fault_log_mr is None else fault_log_mr.size,
+        budget_stats_vaddr = 0 if budget_stats_mr is None else MONITOR_BUDGET_STATS_VADDR,
+        budget_stats_size = 0 if budget_stats_mr is None else budget_stats_mr.size,
+        vspace_caps = [vspace_obj.cap_addr for vspace_obj in vspace_objects[:len(system.protection_domains)]],
+        mr_block_caps = [block.cap_addr for block in mr_block_objects],
+        mr_pt_caps = [pt.cap_addr for pt in mr_pt_objects],
+        mr_frame_slot_start = mr_frame_slot_start,
+        root_cnode_cap = root_cnode_cap,
+        system_cap_address_mask = system_cap_address_mask,
+        paging_stats = paging_stats,
+        colour_untyped = init_system.colour_untyped,
     )
 
 
@@ -1873,9 +2946,15 @@ def main() -> int:
     parser.add_argument("system", type=Path)
     parser.add_argument("-o", "--output", type=Path, default=Path("loader.img"))
     parser.add_argument("-r", "--report", type=Path, default=Path("report.txt"))
+    parser.add_argument("--report-json", type=Path, help="also write a report of the resources used by the system as JSON")
     parser.add_argument("--board", required=True, choices=available_boards)
     parser.add_argument("--config", required=True)
     parser.add_argument("--search-path", nargs='*', type=Path)
+    parser.add_argument("--compress", action="store_true", default=False, help="compress the data in the loader image")
+    parser.add_argument("-j", "--jobs", type=int, default=1, help="number of processes to compress the loader image with")
+    parser.add_argument("--cache-dir", type=Path, help="directory for caching builds, to speed up rebuilds that only change PD code or data")
+    parser.add_argument("--place", type=Path, metavar="OUTPUT", help="choose the CPU of each PD and VM, write the system description with them to OUTPUT and the placement to the report, and exit")
+    parser.add_argument("--check-schedulability", action="store_true", default=False, help="fail if a CPU is over-committed or a PD or VM may miss its period")
     args = parser.parse_args()
 
     board_path = boards_path / args.board
@@ -1947,6 +3026,8 @@ def main() -> int:
 
     aarch64_smc_calls = sel4_config.get("ALLOW_SMC_CALLS", False)
 
+    cache_colours = cache_colour_count(sel4_config, kb(4))
+
     kernel_config = KernelConfig(
         arch = arch,
         word_size = sel4_config["WORD_SIZE"],
@@ -1964,6 +3045,8 @@ def main() -> int:
         arm_pa_size_bits = arm_pa_size_bits,
         riscv_page_table_levels = int(sel4_config["PT_LEVELS"]) if "PT_LEVELS" in sel4_config else None,
         x86_xsave_size = int(sel4_config["XSAVE_SIZE"]) if "XSAVE_SIZE" in sel4_config else None,
+        cache_colours = cache_colours,
+        num_domains = int(sel4_config.get("NUM_DOMAINS", 1)),
     )
 
     default_platform_description = PlatformDescription(
@@ -1971,15 +3054,101 @@ def main() -> int:
         num_cpus = kernel_config.num_cpus,
         kernel_is_hypervisor = kernel_config.hyp_mode,
         aarch64_smc_calls_allowed = kernel_config.aarch64_smc_calls,
+        cache_colours = kernel_config.cache_colours,
+        num_domains = kernel_config.num_domains,
     )
     system_description = xml2system(args.system, default_platform_description)
+    check_monitor_mrs(kernel_config, system_description)
+
+    if args.place is not None:
+        placement = place_domains(system_description, kernel_config.num_cpus)
+        args.place.write_text(placed_system_xml(args.system, placement))
+        with args.report.open("w") as f:
+            f.write("# Placement\n\n")
+            for cpu in range(kernel_config.num_cpus):
+                names = [name for name, name_cpu in placement.cpus.items() if name_cpu == cpu]
+                f.write(f"     CPU {cpu}: {' '.join(names)}\n")
+            f.write(f"     cross-CPU channel weight: {placement.cross_cpu_weight} of {placement.total_weight}\n")
+            f.write("\n")
+            f.write("# Schedulability\n\n")
+            write_sched_report(f, placement.analysis)
+        for problem in placement.analysis.problems():
+            print(f"WARNING: {problem}")
+        return 0
+
+    sched_analysis = analyse_schedulability(system_description, kernel_config.num_cpus)
+    for problem in sched_analysis.problems():
+        if args.check_schedulability:
+            raise UserError(f"Error: {problem}")
+        print(f"WARNING: {problem}")
+
+    if system_description.domain_schedule:
+        write_domain_schedule(kernel_config, kernel_elf, system_description)
 
     monitor_elf = ElfFile.from_path(monitor_elf_path)
     if len(monitor_elf.segments) > 1:
         raise Exception(f"Monitor ({monitor_elf_path}) has {len(monitor_elf.segments)} segments; must only have one")
 
+    # The program images are only read once, and patched in place by each build.
+    pd_elf_files = {
+        pd: ElfFile.from_path(_get_full_path(pd.program_image, search_paths))
+        for pd in system_description.protection_domains
+    }
+
+    mr_data_paths = {
+        mr.name: _get_full_path(mr.data, search_paths, "memory region data")
+        for mr in system_description.memory_regions
+        if mr.data is not None
+    }
+    mr_data = {name: path.read_bytes() for name, path in mr_data_paths.items()}
+    for name, data in mr_data.items():
+        if len(data) > system_description.mr_by_name[name].size:
+            raise UserError(f"Error: data of memory region '{name}' is larger than the memory region: '{mr_data_paths[name]}'")
+
+    # When only the contents of PD program images changed since a cached
+    # build, the new segment data is spliced into that build.
+    build_cache = None
+    if args.cache_dir is not None:
+        build_cache = BuildCache(args.cache_dir)
+        # Which program images are identical decides which segments are
+        # shared, so it is part of the layout.
+        identical_images = identical_program_images([pd_elf_files[pd] for pd in system_description.protection_domains])
+        build_key = cache_key(
+            [loader_elf_path, kernel_elf_path, monitor_elf_path, sel4_config_path, args.system] + list(mr_data_paths.values()),
+            [
+                elf_layout(pd_elf_files[pd], pd_elf_symbols(pd)) + (identical_idx, )
+                for pd, identical_idx in zip(system_description.protection_domains, identical_images)
+            ],
+        )
+        cached_build = build_cache.load(build_key)
+        if cached_build is not None:
+            print(f"CACHED: {build_key}")
+            args.report.write_text(cached_build.report)
+            if args.report_json is not None:
+                args.report_json.write_text(cached_build.report_json)
+            loader = Loader(
+                kernel_config,
+                loader_elf_path,
+                kernel_elf,
+                cached_build.monitor_elf,
+                cached_build.initial_task_phys_base,
+                cached_build.reserved_region,
+                cached_build.loader_regions([pd_elf_files[pd] for pd in system_description.protection_domains]),
+            )
+            loader.write_image(args.output, args.compress, args.jobs)
+            return 0
+
+    # The size of the system CNode and of the invocation table are only known
+    # once the system is built, but the build depends on them: the invocation
+    # table is part of the reserved region, which determines the untyped
+    # objects the kernel creates, and so the objects and invocations. The
+    # first build uses the minimum sizes to measure what is required. Growing
+    # the sizes only changes the requirements by a little, so the next build
+    # uses the measured sizes plus some headroom, which is almost always
+    # enough to make it the final build.
     invocation_table_size = kernel_config.minimum_page_size
     system_cnode_size = 2
+    headroom = True
 
     while True:
         built_system = build_system(
@@ -1989,7 +3158,8 @@ def main() -> int:
             system_description,
             invocation_table_size,
             system_cnode_size,
-            search_paths,
+            pd_elf_files,
+            mr_data,
         )
         print(f"BUILT: {system_cnode_size=} {built_system.number_of_system_caps=} {invocation_table_size=} {built_system.invocation_data_size=}")
         if (built_system.number_of_system_caps <= system_cnode_size and
@@ -1997,8 +3167,16 @@ def main() -> int:
             break
 
         # Recalculate the sizes for the next iteration
-        new_invocation_table_size = round_up(built_system.invocation_data_size, kernel_config.minimum_page_size)
-        new_system_cnode_size = 2 ** int(ceil(log2(built_system.number_of_system_caps)))
+        required_system_caps = built_system.number_of_system_caps
+        new_invocation_table_size = next_invocation_table_size(
+            kernel_config,
+            built_system.invocation_data_size,
+            SIZING_HEADROOM_INVOCATION_DATA if headroom else 0,
+        )
+        if headroom:
+            required_system_caps += SIZING_HEADROOM_CAPS
+            headroom = False
+        new_system_cnode_size = 2 ** int(ceil(log2(required_system_caps)))
 
         invocation_table_size = max(invocation_table_size, new_invocation_table_size)
         system_cnode_size = max(system_cnode_size, new_system_cnode_size)
@@ -2031,9 +3209,7 @@ def main() -> int:
 
     _, bootstrap_invocation_data_size = monitor_elf.find_symbol(MONITOR_CONFIG.bootstrap_invocation_data_symbol_name)
 
-    bootstrap_invocation_data = b''
-    for bootstrap_invocation in built_system.bootstrap_invocations:
-        bootstrap_invocation_data += bootstrap_invocation._get_raw_invocation(kernel_config)
+    bootstrap_invocation_data = serialise_invocations(kernel_config, built_system.bootstrap_invocations)
 
     if len(bootstrap_invocation_data) > bootstrap_invocation_data_size:
         print("INTERNAL ERROR: bootstrap invocations too large", file=stderr)
@@ -2048,13 +3224,10 @@ def main() -> int:
     monitor_elf.write_symbol(MONITOR_CONFIG.system_invocation_count_symbol_name, pack("<Q", len(built_system.system_invocations)))
     monitor_elf.write_symbol(MONITOR_CONFIG.bootstrap_invocation_data_symbol_name, bootstrap_invocation_data)
 
-    system_invocation_data_array = bytearray()
-    for system_invocation in built_system.system_invocations:
-        system_invocation_data_array += system_invocation._get_raw_invocation(kernel_config)
-    system_invocation_data = bytes(system_invocation_data_array)
+    system_invocation_data = built_system.system_invocation_data
 
-    regions: List[Tuple[int, Union[bytes, bytearray]]] = [(built_system.reserved_region.base, system_invocation_data)]
-    regions += [(r.addr, bytes([0] * r.offset) + r.data) for r in built_system.regions]
+    regions: List[Tuple[int, LoaderData, int]] = [(built_system.reserved_region.base, system_invocation_data, 0)]
+    regions += [(r.addr, bytes(r.offset) + r.data, r.zero_size) for r in built_system.regions]
 
     tcb_caps = built_system.tcb_caps
     sched_caps = built_system.sched_caps
@@ -2069,6 +3242,36 @@ def main() -> int:
         nm = pd.name.encode("utf8")[:63]
         names_array[idx * 64:idx * 64+len(nm)] = nm
     monitor_elf.write_symbol("pd_names", names_array)
+    monitor_elf.write_symbol("fault_log", pack("<Q", built_system.fault_log_vaddr))
+    monitor_elf.write_symbol("fault_log_size", pack("<Q", built_system.fault_log_size))
+    monitor_elf.write_symbol("budget_stats", pack("<Q", built_system.budget_stats_vaddr))
+    monitor_elf.write_symbol("budget_stats_size", pack("<Q", built_system.budget_stats_size))
+    monitor_elf.write_symbol("fault_uart", pack("?", system_description.monitor.fault_uart))
+
+    # Information for the monitor's MR allocation service
+    vspace_caps = built_system.vspace_caps
+    monitor_elf.write_symbol("vspaces", pack("<Q" + "Q" * len(vspace_caps), 0, *vspace_caps))
+    mr_windows = bytearray(16 * 64)
+    for idx, pd in enumerate(system_description.protection_domains, 1):
+        if pd.mr_window is not None:
+            mr_windows[idx * 16:(idx + 1) * 16] = pack("<QQ", pd.mr_window.vaddr, pd.mr_window.size)
+    monitor_elf.write_symbol("mr_windows", mr_windows)
+    pd_idx = {pd.name: idx for idx, pd in enumerate(system_description.protection_domains, 1)}
+    channel_peers = bytearray(64 * 64)
+    for cc in system_description.channels:
+        channel_peers[pd_idx[cc.pd_a] * 64 + cc.id_a] = pd_idx[cc.pd_b]
+        channel_peers[pd_idx[cc.pd_b] * 64 + cc.id_b] = pd_idx[cc.pd_a]
+    monitor_elf.write_symbol("channel_peers", channel_peers)
+    mr_config = [
+        built_system.root_cnode_cap,
+        built_system.system_cap_address_mask,
+        built_system.mr_frame_slot_start,
+        built_system.mr_block_caps[0] if built_system.mr_block_caps else 0,
+        len(built_system.mr_block_caps),
+        built_system.mr_pt_caps[0] if built_system.mr_pt_caps else 0,
+        len(built_system.mr_pt_caps),
+    ]
+    monitor_elf.write_symbol("mr_config", pack("<" + "Q" * len(mr_config), *mr_config))
 
 
     # B: The loader
@@ -2093,10 +3296,38 @@ def main() -> int:
         f.write("# Monitor (Initial Task) Info\n\n")
         f.write(f"     virtual memory : {built_system.initial_task_virt_region}\n")
         f.write(f"     physical memory: {built_system.initial_task_phys_region}\n")
+        if built_system.fault_log_size > 0:
+            f.write(f"     fault log      : vaddr=0x{built_system.fault_log_vaddr:x} size=0x{built_system.fault_log_size:x} mr={system_description.monitor.fault_log}\n")
+        if built_system.budget_stats_size > 0:
+            f.write(f"     budget stats   : vaddr=0x{built_system.budget_stats_vaddr:x} size=0x{built_system.budget_stats_size:x} mr={system_description.monitor.budget_stats}\n")
+        if system_description.monitor.mr_reserve > 0:
+            f.write(f"     MR reserve     : {human_size_strict(system_description.monitor.mr_reserve)} ({len(built_system.mr_block_caps)} blocks, {len(built_system.mr_pt_caps)} page tables)\n")
+        f.write("\n")
+        f.write("# Large Pages\n\n")
+        for stats in built_system.paging_stats:
+            f.write(f"     {stats.name}: {stats.pages:,d} pages ({stats.small_pages - stats.pages:,d} saved), {stats.page_tables:,d} page tables ({stats.small_page_tables - stats.page_tables:,d} saved)\n")
+        f.write("\n")
+        colour_usage = cache_colour_usage(kernel_config, system_description, built_system)
+        if colour_usage:
+            f.write("# Cache Colours\n\n")
+            write_cache_colour_report(f, colour_usage)
+            f.write("\n")
+        f.write("# Schedulability\n\n")
+        write_sched_report(f, sched_analysis)
         f.write("\n")
         f.write("# Allocated Kernel Objects Summary\n\n")
         f.write(f"     # of allocated objects: {len(built_system.kernel_objects):,d}\n")
         f.write("\n")
+        f.write("# Untyped Utilisation\n\n")
+        for ut in built_system.untyped_usage:
+            if ut.allocation_point == 0:
+                continue
+            f.write(f"     {cap_lookup[ut.untyped_object.cap]}: used 0x{ut.used:x} waste 0x{ut.waste:x} free 0x{ut.size - ut.allocation_point:x} ({100 * ut.allocation_point // ut.size}% consumed)\n")
+        total_used = sum(ut.used for ut in built_system.untyped_usage)
+        total_waste = sum(ut.waste for ut in built_system.untyped_usage)
+        f.write(f"     total used : 0x{total_used:x}\n")
+        f.write(f"     total waste: 0x{total_waste:x}\n")
+        f.write("\n")
         f.write("# Bootstrap Kernel Invocations Summary\n\n")
         f.write(f"     # of invocations   : {len(built_system.bootstrap_invocations):10,d}\n")
         f.write(f"     size of invocations: {len(bootstrap_invocation_data):10,d}\n")
@@ -2117,6 +3348,26 @@ def main() -> int:
         for idx, invocation in enumerate(built_system.system_invocations):
             f.write(f"    0x{idx:04x} {invocation_to_str(kernel_config, invocation, cap_lookup)}\n")
 
+    report_json = json_report(kernel_config, system_description, built_system, pd_elf_files, invocation_table_size, system_cnode_size, sched_analysis)
+    if args.report_json is not None:
+        args.report_json.write_text(report_json)
+
+    if build_cache is not None:
+        cached_regions = [CachedRegion(built_system.reserved_region.base, 0, system_invocation_data, 0, None)]
+        cached_regions += [
+            CachedRegion(r.addr, r.offset, None if r.pd_elf_segment is not None else bytes(r.data), r.zero_size, r.pd_elf_segment)
+            for r in built_system.regions
+        ]
+        build_cache.store(build_key, CachedBuild(
+            monitor_elf = monitor_elf,
+            initial_task_phys_base = built_system.initial_task_phys_region.base,
+            reserved_region = built_system.reserved_region,
+            regions = cached_regions,
+            pd_symbol_patches = built_system.pd_symbol_patches,
+            report = args.report.read_text(),
+            report_json = report_json,
+        ))
+
     # FIXME: Verify that the regions do not overlap!
     loader = Loader(
         kernel_config,
@@ -2127,7 +3378,7 @@ def main() -> int:
         built_system.reserved_region,
         regions,
     )
-    loader.write_image(args.output)
+    loader.write_image(args.output, args.compress, args.jobs)
 
     return 0
 
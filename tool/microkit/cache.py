@@ -0,0 +1,140 @@
+#
+# Copyright 2021, Breakaway Consulting Pty. Ltd.
+#
+# SPDX-License-Identifier: BSD-2-Clause
+#
+"""
+A content-addressed cache of the artefacts of previous builds.
+
+A build is keyed by the contents of everything it depends on, except for
+the contents of the PD program images. For those only the layout is part
+of the key: the loadable segments and the symbols that the tool reads or
+patches. So when only the code or data of PDs change the key stays the
+same, and the loader image can be produced by splicing the new segment
+data into the cached build, without emulating kernel boot or generating
+the invocations again.
+"""
+import os
+import pickle
+import sys
+from dataclasses import dataclass
+from hashlib import sha256
+from pathlib import Path
+
+from typing import List, Optional, Sequence, Tuple
+
+from microkit.elf import ElfFile
+from microkit.util import MemoryRegion
+
+# Must be changed whenever the format of the cached builds changes.
+CACHE_VERSION = 4
+CACHE_MAX_ENTRIES = 16
+
+
+@dataclass
+class CachedRegion:
+    addr: int
+    offset: int
+    # Either the data of the region, or, for regions holding (part of) a
+    # segment of a PD program image, the index of the PD and of the segment,
+    # and the range of the segment data the region holds.
+    data: Optional[bytes]
+    zero_size: int
+    pd_elf_segment: Optional[Tuple[int, int, int, int]]
+
+
+@dataclass
+class CachedBuild:
+    monitor_elf: ElfFile
+    initial_task_phys_base: int
+    reserved_region: MemoryRegion
+    regions: List[CachedRegion]
+    # Symbols patched in the program image of each PD
+    pd_symbol_patches: List[List[Tuple[str, bytes]]]
+    report: str
+    report_json: str
+
+    def loader_regions(self, pd_elf_files: Sequence[ElfFile]) -> List[Tuple[int, bytes, int]]:
+        """Return the loader regions, with the segment data of the PDs
+        taken from 'pd_elf_files'. The symbols of the build are patched
+        into the program images first."""
+        for elf, patches in zip(pd_elf_files, self.pd_symbol_patches):
+            for symbol, data in patches:
+                elf.write_symbol(symbol, data)
+
+        regions = []
+        for region in self.regions:
+            if region.pd_elf_segment is not None:
+                pd_idx, segment_idx, start, end = region.pd_elf_segment
+                data = bytes(pd_elf_files[pd_idx].segments[segment_idx].data[start:end])
+            else:
+                assert region.data is not None
+                data = region.data
+            regions.append((region.addr, bytes(region.offset) + data, region.zero_size))
+
+        return regions
+
+
+def elf_layout(elf: ElfFile, symbols: Sequence[str]) -> Tuple[object, ...]:
+    """The parts of an ELF file that a build depends on, other than the
+    contents of its segments."""
+    segments = tuple(
+        (segment.phys_addr, segment.virt_addr, len(segment.data), segment.zero_size, segment.loadable, int(segment.attrs))
+        for segment in elf.segments
+    )
+    return (elf.word_size, elf.entry, segments, tuple((symbol, elf.find_symbol_if_exists(symbol)) for symbol in symbols))
+
+
+def _tool_digest() -> bytes:
+    h = sha256()
+    if getattr(sys, 'oxidized', False):
+        # The tool is compiled into the executable
+        h.update(Path(sys.executable).read_bytes())
+    else:
+        for path in sorted(Path(__file__).parent.glob("*.py")):
+            h.update(path.read_bytes())
+    return h.digest()
+
+
+def cache_key(input_files: Sequence[Path], pd_layouts: Sequence[Tuple[object, ...]]) -> str:
+    h = sha256()
+    h.update(CACHE_VERSION.to_bytes(4, "little"))
+    h.update(_tool_digest())
+    for path in input_files:
+        h.update(sha256(path.read_bytes()).digest())
+    h.update(repr(tuple(pd_layouts)).encode("utf8"))
+    return h.hexdigest()
+
+
+class BuildCache:
+    def __init__(self, path: Path) -> None:
+        self._path = path
+
+    def _entry_path(self, key: str) -> Path:
+        return self._path / f"{key}.build"
+
+    def load(self, key: str) -> Optional[CachedBuild]:
+        entry_path = self._entry_path(key)
+        try:
+            with entry_path.open("rb") as f:
+                build = pickle.load(f)
+        except Exception:
+            # A missing or corrupt entry is just a miss
+            return None
+        if not isinstance(build, CachedBuild):
+            return None
+        # Keep the recently used entries from being evicted
+        os.utime(entry_path)
+        return build
+
+    def store(self, key: str, build: CachedBuild) -> None:
+        self._path.mkdir(parents=True, exist_ok=True)
+        entry_path = self._entry_path(key)
+        tmp_path = entry_path.with_suffix(f".tmp{os.getpid()}")
+        with tmp_path.open("wb") as f:
+            pickle.dump(build, f, protocol=pickle.HIGHEST_PROTOCOL)
+        os.replace(tmp_path, entry_path)
+
+        entries = sorted(self._path.glob("*.build"), key=lambda p: p.stat().st_mtime, reverse=True)
+        for stale in entries[CACHE_MAX_ENTRIES:]:
+            stale.unlink()
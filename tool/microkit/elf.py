@@ -3,12 +3,13 @@
 #
 # SPDX-License-Identifier: BSD-2-Clause
 #
+import mmap
 from pathlib import Path
 from struct import Struct, pack
 from enum import IntEnum, IntFlag
 from dataclasses import dataclass
 
-from typing import List, Literal, Optional, Tuple
+from typing import Dict, List, Literal, Optional, Tuple, Union
 
 
 class ObjectFileType(IntEnum):
@@ -227,8 +228,16 @@ class ElfSymbol:
 
 
 class ElfSegment:
-    def __init__(self, phys_addr: int, virt_addr: int, data: bytearray, loadable: bool, attrs: SegmentAttributes) -> None:
+    """A segment of an ELF file.
+
+    'data' holds the part of the segment that is backed by the file. For
+    segments read from a file it is a copy-on-write view of the mapped
+    file. It is followed by 'zero_size' bytes of zeros (e.g: .bss), which
+    are not stored.
+    """
+    def __init__(self, phys_addr: int, virt_addr: int, data: Union[bytearray, memoryview], loadable: bool, attrs: SegmentAttributes, zero_size: int = 0) -> None:
         self.data = data
+        self.zero_size = zero_size
         self.phys_addr = phys_addr
         self.virt_addr = virt_addr
         self.loadable = loadable
@@ -237,10 +246,31 @@ class ElfSegment:
     def __repr__(self) -> str:
         return f"<ElfSegment phys_addr=0x{self.phys_addr:x} virt_addr=0x{self.virt_addr:x} mem_size={self.mem_size}>"
 
-    # FIXME: Is this really useful?
+    def __getstate__(self) -> Dict[str, object]:
+        # A view of a mapped file can't be pickled, so the data is copied.
+        state = self.__dict__.copy()
+        state["data"] = bytearray(self.data)
+        return state
+
     @property
     def mem_size(self) -> int:
-        return len(self.data)
+        return len(self.data) + self.zero_size
+
+    def read(self, offset: int, size: int) -> bytes:
+        assert offset + size <= self.mem_size
+        data = bytes(self.data[offset:offset + size])
+        return data + bytes(size - len(data))
+
+    def write(self, offset: int, data: bytes) -> None:
+        """Write 'data' at 'offset'. Any zeros up to the end of the write
+        become part of the stored data."""
+        end = offset + len(data)
+        assert end <= self.mem_size
+        if end > len(self.data):
+            extra = end - len(self.data)
+            self.data = bytearray(self.data) + bytes(extra)
+            self.zero_size -= extra
+        self.data[offset:end] = data
 
     @property
     def is_writable(self) -> bool:
@@ -258,12 +288,15 @@ class ElfSegment:
 class ElfFile:
     def __init__(self, word_size: Literal[32, 64] = 64) -> None:
         self.segments: List[ElfSegment] = []
-        self._symbols: List[Tuple[str, ElfSymbol]] = []
+        # All symbols with each name, so lookups don't scan the symbol table.
+        self._symbols: Dict[str, List[ElfSymbol]] = {}
         self.word_size = word_size
         self.entry: int = 0x0
 
     @classmethod
     def from_path(cls, path: Path) -> "ElfFile":
+        """Read an ELF file. The file is mapped into memory rather than read,
+        so only the parts that are used are read from the file."""
         with path.open("rb") as f:
             magic = f.read(4)
             if magic != ELF_MAGIC:
@@ -294,24 +327,23 @@ class ElfFile:
             hdr: ElfHeader = ElfHeader(**dict(zip(hdr_fields, hdr_fmt.unpack(hdr_raw))))
             elf.entry = hdr.entry
 
-            f.seek(hdr.phoff)
+            # Writes to the segment data (e.g: patching symbols) are private
+            # to this process, and never reach the file.
+            contents = memoryview(mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_COPY))
+
             for idx in range(hdr.phnum):
-                f.seek(hdr.phoff + idx * hdr.phentsize)
-                phent_raw = f.read(hdr.phentsize)
-                phent = ElfProgramHeader(**dict(zip(ph_fields, ph_fmt.unpack_from(phent_raw))))
-                f.seek(phent.offset)
-                data = f.read(phent.filesz)
-                zeros = bytes(phent.memsz - phent.filesz)
-                elf.segments.append(ElfSegment(phent.paddr, phent.vaddr, bytearray(data + zeros), phent.type_ == 1, SegmentAttributes(phent.flags)))
+                phent_offset = hdr.phoff + idx * hdr.phentsize
+                phent = ElfProgramHeader(**dict(zip(ph_fields, ph_fmt.unpack_from(contents, phent_offset))))
+                data = contents[phent.offset:phent.offset + phent.filesz]
+                zero_size = phent.memsz - phent.filesz
+                elf.segments.append(ElfSegment(phent.paddr, phent.vaddr, data, phent.type_ == 1, SegmentAttributes(phent.flags), zero_size))
 
 
             # FIXME: Add support for sections and symbols
-            f.seek(hdr.shoff)
             shents = []
             symtab_shent: Optional[ElfSectionHeader] = None
             for idx in range(hdr.shnum):
-                shent_raw = f.read(hdr.shentsize)
-                shent = ElfSectionHeader(**dict(zip(sh_fields, sh_fmt.unpack_from(shent_raw))))
+                shent = ElfSectionHeader(**dict(zip(sh_fields, sh_fmt.unpack_from(contents, hdr.shoff + idx * hdr.shentsize))))
                 shents.append(shent)
                 if shent.type_ == 3:
                     shstrtab_shent = shent
@@ -322,24 +354,16 @@ class ElfFile:
             if shstrtab_shent is None:
                 raise InvalidElf("Unable to find string table section")
 
-            f.seek(shstrtab_shent.offset)
-
             # Microkit requires the symbol table to exist
             assert symtab_shent is not None, f"The symbol table for the given ELF '{path}' could not be found"
-            f.seek(symtab_shent.offset)
-            _symtab = f.read(symtab_shent.size)
+            _symtab = contents[symtab_shent.offset:symtab_shent.offset + symtab_shent.size]
 
             symtab_str = shents[symtab_shent.link]
-            f.seek(symtab_str.offset)
-            _symtab_str = f.read(symtab_str.size)
+            _symtab_str = bytes(contents[symtab_str.offset:symtab_str.offset + symtab_str.size])
 
-            offset = 0
-            elf._symbols = []
-            while offset < len(_symtab):
-                sym = ElfSymbol(**dict(zip(sym_fields, sym_fmt.unpack_from(_symtab, offset))))
-                name = cls._get_string(_symtab_str, sym.name)
-                offset += sym_fmt.size
-                elf._symbols.append((name, sym))
+            for fields in sym_fmt.iter_unpack(_symtab):
+                sym = ElfSymbol(**dict(zip(sym_fields, fields)))
+                elf.add_symbol(cls._get_string(_symtab_str, sym.name), sym)
 
         return elf
 
@@ -382,7 +406,7 @@ class ElfFile:
                     offset = data_offset,
                     vaddr = segment.virt_addr,
                     paddr = segment.phys_addr,
-                    filesz = segment.mem_size,
+                    filesz = len(segment.data),
                     memsz = segment.mem_size,
                     # FIXME: Need to do something better with permissions in the future!
                     flags = SegmentAttributes.PF_R | SegmentAttributes.PF_W | SegmentAttributes.PF_X,
@@ -403,21 +427,22 @@ class ElfFile:
         self.segments.append(segment)
 
 
+    def add_symbol(self, name: str, symbol: ElfSymbol) -> None:
+        self._symbols.setdefault(name, []).append(symbol)
+
     def get_data(self, vaddr: int, size: int) -> bytes:
         for seg in self.segments:
-            if vaddr >= seg.virt_addr and vaddr + size <= seg.virt_addr + len(seg.data):
-                offset = vaddr - seg.virt_addr
-                return seg.data[offset:offset+size]
+            if vaddr >= seg.virt_addr and vaddr + size <= seg.virt_addr + seg.mem_size:
+                return seg.read(vaddr - seg.virt_addr, size)
 
         raise Exception(f"Unable to find data for vaddr=0x{vaddr:x} size=0x{size:x}")
 
     def write_symbol(self, variable_name: str, data: bytes) -> None:
         vaddr, size = self.find_symbol(variable_name)
         for seg in self.segments:
-            if vaddr >= seg.virt_addr and vaddr + size <= seg.virt_addr + len(seg.data):
-                offset = vaddr - seg.virt_addr
+            if vaddr >= seg.virt_addr and vaddr + size <= seg.virt_addr + seg.mem_size:
                 assert len(data) <= size
-                seg.data[offset:offset+len(data)] = data
+                seg.write(vaddr - seg.virt_addr, data)
 
 
     # def read(self, offset: int, size: int) -> bytes:
@@ -441,15 +466,12 @@ class ElfFile:
         return found_sym
 
     def find_symbol_if_exists(self, variable_name: str) -> Optional[Tuple[int, int]]:
-        found_sym = None
-        for name, sym in self._symbols:
-            if name == variable_name:
-                if found_sym is None:
-                    found_sym = sym
-                else:
-                    raise Exception(f"Multiple symbols with name {variable_name}")
-        if found_sym is None:
+        syms = self._symbols.get(variable_name)
+        if syms is None:
             return None
+        if len(syms) > 1:
+            raise Exception(f"Multiple symbols with name {variable_name}")
+        found_sym = syms[0]
         # symbol_type = found_sym.info & 0xf
         # symbol_binding = found_sym.info >> 4
         #if symbol_type != 1:
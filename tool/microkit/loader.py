@@ -3,15 +3,33 @@
 #
 # SPDX-License-Identifier: BSD-2-Clause
 #
+from concurrent.futures import ProcessPoolExecutor
+from multiprocessing import get_all_start_methods, get_context
 from pathlib import Path
 from struct import pack
 
 from typing import Dict, List, Optional, Tuple, Union
 
 from microkit.elf import ElfFile
+from microkit import lz4
 from microkit.util import kb, mb, round_up, MemoryRegion
 from microkit.sel4 import KernelConfig, KernelArch
 
+# The data of a region in the loader image
+LoaderData = Union[bytes, bytearray, memoryview]
+
+# Regions of type data are copied from the image by the loader. Regions of
+# type zero have no data in the image, and are filled with zeros instead.
+# Regions of type LZ4 are decompressed from the image.
+REGION_TYPE_DATA = 1
+REGION_TYPE_ZERO = 2
+REGION_TYPE_LZ4 = 3
+
+# Regions are compressed in chunks of this size, each becoming a region of
+# its own, so that the chunks can be compressed in parallel. The chunks do
+# not depend on the number of jobs, so the image is always the same.
+LZ4_CHUNK_SIZE = mb(1)
+
 AARCH64_PAGE_TABLE_SIZE = 4096
 
 AARCH64_1GB_BLOCK_BITS = 30
@@ -79,10 +97,10 @@ def riscv_pte_create_leaf(pt_base: int) -> int:
     return (riscv_pte_create_ppn(pt_base) | RISCV_PTE_TYPE_SRWX | RISCV_PTE_VALID)
 
 
-def _check_non_overlapping(regions: List[Tuple[int, bytes]]) -> None:
+def _check_non_overlapping(regions: List[Tuple[int, int]]) -> None:
     checked: List[Tuple[int, int]] = []
-    for base, data in regions:
-        end = base + len(data)
+    for base, size in regions:
+        end = base + size
         # Check that this does not overlap any checked regions
         for b, e in checked:
             if not (end <= b or base >= e):
@@ -99,10 +117,13 @@ class Loader:
         initial_task_elf: ElfFile,
         initial_task_phys_base: Optional[int],
         reserved_region: MemoryRegion,
-        regions: List[Tuple[int, bytes]],
+        regions: List[Tuple[int, LoaderData, int]],
     ) -> None:
         """
 
+        Each region is given by its physical address, its data, and the
+        number of zero bytes that follow the data.
+
         Note: If initial_task_phys_base is not None, then it just this address
         as the base physical address of the initial task, rather than the address
         that comes from the initial_task_elf file.
@@ -124,9 +145,9 @@ class Loader:
         if loader_segment.virt_addr != self._elf.entry:
             raise Exception("The loader entry point must be the first byte in the image")
 
-        self._image = loader_segment.data
+        self._image = bytearray(loader_segment.data) + bytes(loader_segment.zero_size)
 
-        self._regions: List[Tuple[int, Union[bytes, bytearray]]] = []
+        self._regions: List[Tuple[int, LoaderData, int]] = []
 
         kernel_first_vaddr: Optional[int] = None
         kernel_last_vaddr: Optional[int] = None
@@ -134,8 +155,6 @@ class Loader:
         kernel_p_v_offset: Optional[int] = None
         for segment in kernel_elf.segments:
             if segment.loadable:
-                # NOTE: For now we include any zeroes. We could optimize in the future
-
                 if kernel_first_vaddr is None or segment.virt_addr < kernel_first_vaddr:
                     kernel_first_vaddr = segment.virt_addr
 
@@ -153,7 +172,8 @@ class Loader:
 
                 self._regions.append((
                     segment.phys_addr,
-                    segment.data
+                    segment.data,
+                    segment.zero_size,
                 ))
 
 
@@ -174,10 +194,10 @@ class Loader:
         inittask_first_paddr = segment.phys_addr if initial_task_phys_base is None else initial_task_phys_base
         inittask_p_v_offset = inittask_first_vaddr - inittask_first_paddr
 
-        # NOTE: For now we include any zeroes. We could optimize in the future
         self._regions.append((
             inittask_first_paddr,
-            segment.data
+            segment.data,
+            segment.zero_size,
         ))
 
         # Determine the pagetable variables
@@ -221,18 +241,29 @@ class Loader:
 
         self._regions += regions
 
+        # The zeros that follow the data of a region are not stored in the
+        # image, instead they become a separate region for the loader to zero.
+        self._image_regions: List[Tuple[int, int, int, LoaderData]] = []
+        for addr, data, zero_size in self._regions:
+            if len(data) > 0:
+                self._image_regions.append((addr, len(data), REGION_TYPE_DATA, data))
+            if zero_size > 0:
+                self._image_regions.append((addr + len(data), zero_size, REGION_TYPE_ZERO, b""))
+
         # In addition to checking that provided regions (e.g initial task
         # and PD ELFs) do not overlap, we must make sure they do not overlap
         # with the loader itself, as that would (and has) lead to corruption of
         # the loader when copying regions to their respective locations.
-        all_regions = list(self._regions)
-        all_regions.append((loader_segment.virt_addr, self._image))
+        all_regions = [(addr, len(data) + zero_size) for addr, data, zero_size in self._regions]
+        all_regions.append((loader_segment.virt_addr, len(self._image)))
         _check_non_overlapping(all_regions)
 
         # Currently the only flag passed to the loader is whether seL4
         # is configured as a hypervisor or not.
         flags = 1 if kernel_config.hyp_mode else 0
 
+        # The header is completed with the number of regions when the image
+        # is written, as compression splits the regions into chunks.
         self._header = (
             self._magic,
             flags,
@@ -243,7 +274,6 @@ class Loader:
             v_entry,
             extra_device_addr_p,
             extra_device_size,
-            len(self._regions)
         )
 
 
@@ -385,16 +415,48 @@ class Loader:
         }
 
 
-    def write_image(self, path: Path) -> None:
+    def write_image(self, path: Path, compress: bool = False, jobs: int = 1) -> None:
+        """Write out the loader image.
+
+        If 'compress' is set, the data of each region is compressed in
+        chunks, using up to 'jobs' processes. Chunks that do not get smaller
+        are stored uncompressed. The processes are forked, as the tool may be
+        a frozen binary that cannot be started again as a worker, so where
+        fork is not supported the chunks are compressed in this process.
+        """
+        image_regions = self._image_regions
+        if compress:
+            image_regions = []
+            for addr, size, type_, data in self._image_regions:
+                if type_ == REGION_TYPE_DATA:
+                    for offset in range(0, size, LZ4_CHUNK_SIZE):
+                        chunk = bytes(data[offset:offset + LZ4_CHUNK_SIZE])
+                        image_regions.append((addr + offset, len(chunk), type_, chunk))
+                else:
+                    image_regions.append((addr, size, type_, data))
+
+            chunks = [data for _, _, type_, data in image_regions if type_ == REGION_TYPE_DATA]
+            if jobs > 1 and len(chunks) > 1 and "fork" in get_all_start_methods():
+                with ProcessPoolExecutor(min(jobs, len(chunks)), mp_context=get_context("fork")) as executor:
+                    compressed_chunks = iter(list(executor.map(lz4.compress, chunks)))
+            else:
+                compressed_chunks = map(lz4.compress, chunks)
+
+            for idx, (addr, size, type_, data) in enumerate(image_regions):
+                if type_ == REGION_TYPE_DATA:
+                    compressed = next(compressed_chunks)
+                    if len(compressed) < len(data):
+                        image_regions[idx] = (addr, size, REGION_TYPE_LZ4, compressed)
+
         with path.open("wb") as f:
-            header_binary = pack(self._header_struct_fmt, *self._header)
+            header_binary = pack(self._header_struct_fmt, *self._header, len(image_regions))
             offset_list : List[int] = []
             filler_buf = bytearray(15)
             offset = 0
 
-            for addr, data in self._regions:
+            for addr, size, type_, data in image_regions:
                 offset_list.append(offset)
-                header_binary += pack(self._region_struct_fmt, addr, len(data), offset, 1)
+                header_binary += pack(self._region_struct_fmt, addr, size, offset, type_)
                 offset += round_up(len(data), 16)
 
             # Finally write everything out to a file.
@@ -408,7 +470,7 @@ class Loader:
             i  = 0
             # wpos keeps write position
             wpos  = 0
-            for _, data in self._regions:
+            for _, _, _, data in image_regions:
                 f.write(filler_buf[0:offset_list[i] - wpos])
                 f.write(data)
                 wpos = offset_list[i] + len(data)
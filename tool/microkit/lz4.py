@@ -0,0 +1,135 @@
+#
+# Copyright 2021, Breakaway Consulting Pty. Ltd.
+#
+# SPDX-License-Identifier: BSD-2-Clause
+#
+"""
+Compression in the LZ4 block format, as decompressed by the loader.
+
+A block is a sequence of sequences. Each sequence is a token, holding the
+number of literals and the length of the match, followed by the literals,
+the 16-bit offset of the match, and any extra length bytes. The last
+sequence only has literals.
+
+The compressor is a simple greedy one, as the tool is written in Python
+and needs to handle large images. It skips ahead faster when it does not
+find matches, so incompressible data is handled quickly.
+"""
+from struct import pack
+
+MIN_MATCH = 4
+# As per the LZ4 format, the last match must start at least this many
+# bytes before the end, and the last bytes are always literals.
+MF_LIMIT = 12
+LAST_LITERALS = 5
+MAX_OFFSET = 0xffff
+# After this many positions without a match, the step is increased by one.
+SKIP_TRIGGER = 64
+MATCH_CHUNK = 256
+
+
+def _append_length(out: bytearray, length: int) -> None:
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def _append_sequence(out: bytearray, literals: bytes, offset: int, match_length: int) -> None:
+    literal_length = len(literals)
+    token_match = match_length - MIN_MATCH
+    out.append((min(literal_length, 15) << 4) | min(token_match, 15))
+    if literal_length >= 15:
+        _append_length(out, literal_length - 15)
+    out += literals
+    out += pack("<H", offset)
+    if token_match >= 15:
+        _append_length(out, token_match - 15)
+
+
+def _match_length(data: bytes, match: int, pos: int, limit: int) -> int:
+    """Length of the common prefix of the data at 'match' and 'pos', where
+    the data at 'pos' must end before 'limit'."""
+    length = 0
+    # Compare in chunks, so long matches (e.g: runs of zeros) are fast.
+    while pos + length + MATCH_CHUNK <= limit and \
+            data[match + length:match + length + MATCH_CHUNK] == data[pos + length:pos + length + MATCH_CHUNK]:
+        length += MATCH_CHUNK
+    while pos + length < limit and data[match + length] == data[pos + length]:
+        length += 1
+    return length
+
+
+def compress(data: bytes) -> bytes:
+    data = bytes(data)
+    end = len(data)
+    match_limit = end - LAST_LITERALS
+    out = bytearray()
+    table = {}
+    anchor = 0
+    pos = 0
+    misses = 0
+    while pos < end - MF_LIMIT:
+        sequence = data[pos:pos + MIN_MATCH]
+        match = table.get(sequence)
+        table[sequence] = pos
+        if match is None or pos - match > MAX_OFFSET:
+            misses += 1
+            pos += 1 + misses // SKIP_TRIGGER
+            continue
+
+        misses = 0
+        length = MIN_MATCH + _match_length(data, match + MIN_MATCH, pos + MIN_MATCH, match_limit)
+        _append_sequence(out, data[anchor:pos], pos - match, length)
+        pos += length
+        anchor = pos
+        if pos - 2 < end - MF_LIMIT:
+            table[data[pos - 2:pos + 2]] = pos - 2
+
+    # The last literals
+    literals = data[anchor:]
+    out.append(min(len(literals), 15) << 4)
+    if len(literals) >= 15:
+        _append_length(out, len(literals) - 15)
+    out += literals
+
+    return bytes(out)
+
+
+def decompress(data: bytes, size: int) -> bytes:
+    """Decompress a block to 'size' bytes. This does the same as the loader."""
+    out = bytearray()
+    pos = 0
+    while True:
+        token = data[pos]
+        pos += 1
+        length = token >> 4
+        if length == 15:
+            while True:
+                extra = data[pos]
+                pos += 1
+                length += extra
+                if extra != 255:
+                    break
+        out += data[pos:pos + length]
+        pos += length
+        if len(out) >= size:
+            break
+
+        offset = data[pos] | (data[pos + 1] << 8)
+        pos += 2
+        length = token & 0xf
+        if length == 15:
+            while True:
+                extra = data[pos]
+                pos += 1
+                length += extra
+                if extra != 255:
+                    break
+        length += MIN_MATCH
+        start = len(out) - offset
+        for idx in range(length):
+            out.append(out[start + idx])
+
+    assert len(out) == size
+    return bytes(out)
@@ -0,0 +1,199 @@
+#
+# Copyright 2021, Breakaway Consulting Pty. Ltd.
+#
+# SPDX-License-Identifier: BSD-2-Clause
+#
+"""
+Choosing the CPU of each PD and VM.
+
+A placement is scored by the fraction of the channel traffic that crosses
+CPUs, plus the utilisation of the busiest CPU, so it both keeps PDs that
+communicate together and balances the CPUs. Placements in which a CPU is
+over-committed or a domain may miss its period (see sched.py) are only
+chosen when there is no better one.
+
+The traffic of a channel is its weight, which defaults to 1. A VM and the
+PD that is its VMM communicate through faults, which count as a channel
+of weight 1. Passive PDs execute on the CPU of their caller, so channels
+to them are not counted, and they are placed with the caller that has the
+most traffic to them.
+
+The PDs and VMs are first placed greedily, in order of decreasing
+utilisation, then the placement is improved by moving single domains and
+swapping pairs of domains between CPUs until neither improves it. This is
+not guaranteed to find the best placement, but is fast and deterministic.
+"""
+import re
+import xml.etree.ElementTree as ET
+from dataclasses import dataclass, replace
+from pathlib import Path
+
+from typing import Dict, FrozenSet, List, Tuple
+
+from microkit.sched import SchedAnalysis, SchedDomain, analyse_cpu, analyse_domains, sched_domains, server_priorities
+from microkit.sysxml import SystemDescription
+
+# Bounds the time spent improving a placement of a large system
+MAX_IMPROVEMENT_ROUNDS = 100
+
+
+@dataclass
+class Placement:
+    # The CPU of each PD and VM
+    cpus: Dict[str, int]
+    analysis: SchedAnalysis
+    cross_cpu_weight: int
+    total_weight: int
+
+
+def _edges(system: SystemDescription) -> Dict[Tuple[str, str], int]:
+    """The weight of the traffic between each pair of domains."""
+    pd_by_name = {pd.name: pd for pd in system.protection_domains}
+    edges: Dict[Tuple[str, str], int] = {}
+
+    def add(a: str, b: str, weight: int) -> None:
+        key = (a, b) if a < b else (b, a)
+        edges[key] = edges.get(key, 0) + weight
+
+    for cc in system.channels:
+        if not pd_by_name[cc.pd_a].passive and not pd_by_name[cc.pd_b].passive:
+            add(cc.pd_a, cc.pd_b, cc.weight)
+    for pd in system.protection_domains:
+        if pd.virtual_machine is not None and not pd.passive:
+            add(pd.name, pd.virtual_machine.name, 1)
+    return edges
+
+
+class _Placer:
+    def __init__(self, domains: List[SchedDomain], edges: Dict[Tuple[str, str], int], servers: Dict[str, int], num_cpus: int) -> None:
+        self.domains = domains
+        self.servers = servers
+        self.num_cpus = num_cpus
+        self.total_weight = sum(edges.values())
+        self.neighbours: Dict[str, List[Tuple[str, int]]] = {domain.name: [] for domain in domains}
+        for (a, b), weight in edges.items():
+            self.neighbours[a].append((b, weight))
+            self.neighbours[b].append((a, weight))
+        self.utilisation = {
+            domain.name: 0.0 if domain.full_budget else domain.budget / domain.period
+            for domain in domains
+        }
+        # Each domain as if placed on each CPU
+        self.placed = {(domain.name, cpu): replace(domain, cpu=cpu) for domain in domains for cpu in range(num_cpus)}
+        self.problems_cache: Dict[Tuple[int, FrozenSet[str]], int] = {}
+
+    def cross_cpu_weight(self, cpus: Dict[str, int]) -> int:
+        return sum(
+            weight
+            for name, cpu in cpus.items()
+            for neighbour, weight in self.neighbours[name]
+            if neighbour in cpus and cpus[neighbour] != cpu and name < neighbour
+        )
+
+    def score(self, cpus: Dict[str, int]) -> float:
+        cpu_utilisation = [0.0] * self.num_cpus
+        for name, cpu in cpus.items():
+            cpu_utilisation[cpu] += self.utilisation[name]
+        cross = self.cross_cpu_weight(cpus) / self.total_weight if self.total_weight > 0 else 0
+        return cross + max(cpu_utilisation)
+
+    def _domains(self, cpus: Dict[str, int]) -> List[SchedDomain]:
+        return [self.placed[(domain.name, cpus[domain.name])] for domain in self.domains if domain.name in cpus]
+
+    def analyse(self, cpus: Dict[str, int]) -> SchedAnalysis:
+        return analyse_domains(self._domains(cpus), self.servers, self.num_cpus)
+
+    def cpu_problems(self, cpu: int, cpus: Dict[str, int]) -> int:
+        """The number of problems on 'cpu'. These only depend on which of
+        the domains placed so far are on it, so they are cached by that."""
+        key = (len(cpus), frozenset(name for name, name_cpu in cpus.items() if name_cpu == cpu))
+        if key not in self.problems_cache:
+            utilisation, response_times = analyse_cpu(cpu, self._domains(cpus), self.servers)
+            self.problems_cache[key] = int(utilisation > 1) + sum(rt.response is None for rt in response_times)
+        return self.problems_cache[key]
+
+    def cost(self, cpus: Dict[str, int]) -> Tuple[int, float]:
+        return (sum(self.cpu_problems(cpu, cpus) for cpu in range(self.num_cpus)), self.score(cpus))
+
+    def place(self) -> Dict[str, int]:
+        cpus: Dict[str, int] = {}
+        for domain in sorted(self.domains, key=lambda d: -self.utilisation[d.name]):
+            costs = [self.cost({**cpus, domain.name: cpu}) for cpu in range(self.num_cpus)]
+            cpus[domain.name] = costs.index(min(costs))
+
+        names = [domain.name for domain in self.domains]
+        cost = self.cost(cpus)
+        for _ in range(MAX_IMPROVEMENT_ROUNDS):
+            improved = False
+            candidates = [{name: cpu} for name in names for cpu in range(self.num_cpus) if cpu != cpus[name]]
+            candidates += [
+                {a: cpus[b], b: cpus[a]}
+                for idx, a in enumerate(names) for b in names[idx + 1:]
+                if cpus[a] != cpus[b]
+            ]
+            for change in candidates:
+                candidate = {**cpus, **change}
+                # The score is cheap, so only analyse the schedulability of
+                # placements that may be better.
+                if cost[0] == 0 and self.score(candidate) >= cost[1]:
+                    continue
+                candidate_cost = self.cost(candidate)
+                if candidate_cost < cost:
+                    cpus, cost = candidate, candidate_cost
+                    improved = True
+                    break
+            if not improved:
+                break
+
+        return cpus
+
+
+def place_domains(system: SystemDescription, num_cpus: int) -> Placement:
+    pd_by_name = {pd.name: pd for pd in system.protection_domains}
+    domains = sched_domains(system)
+    servers = server_priorities(system)
+    placer = _Placer(
+        [domain for domain in domains if domain.name not in servers],
+        _edges(system),
+        servers,
+        num_cpus,
+    )
+    cpus = placer.place()
+    cross_cpu_weight = placer.cross_cpu_weight(cpus)
+
+    # A passive PD goes with the caller that has the most traffic to it
+    for pd in system.protection_domains:
+        if not pd.passive:
+            continue
+        callers: Dict[str, int] = {}
+        for cc in system.channels:
+            for server, caller in ((cc.pd_a, cc.pd_b), (cc.pd_b, cc.pd_a)):
+                if server == pd.name and not pd_by_name[caller].passive:
+                    callers[caller] = callers.get(caller, 0) + cc.weight
+        cpus[pd.name] = cpus[max(callers, key=lambda c: callers[c])] if callers else pd.cpu_affinity
+
+    analysis = analyse_domains([replace(domain, cpu=cpus[domain.name]) for domain in domains], servers, num_cpus)
+    return Placement(cpus, analysis, cross_cpu_weight, placer.total_weight)
+
+
+def placed_system_xml(path: Path, placement: Placement) -> str:
+    """The system description at 'path' with the 'cpu' attribute of each
+    PD and VM set to its placement."""
+    text = path.read_text()
+    # ElementTree drops anything outside the root element, such as the
+    # copyright header, so it is kept as is.
+    root_start = re.search(r"^<system\b", text, re.MULTILINE)
+    prefix = "" if root_start is None else text[:root_start.start()]
+    root = ET.fromstring(text, parser=ET.XMLParser(target=ET.TreeBuilder(insert_comments=True)))
+
+    utilisation = ", ".join(f"CPU {cpu} {float(u):.1%}" for cpu, u in enumerate(placement.analysis.cpu_utilisation))
+    comment = ET.Comment(f" CPUs placed by the Microkit tool: {utilisation}; cross-CPU channel weight {placement.cross_cpu_weight} of {placement.total_weight} ")
+    comment.tail = root.text
+    root.insert(0, comment)
+
+    for element in root.iter():
+        if element.tag in ("protection_domain", "virtual_machine"):
+            name = element.attrib.get("name")
+            if name in placement.cpus:
+                element.set("cpu", str(placement.cpus[name]))
+    return prefix + ET.tostring(root, encoding="unicode") + "\n"
@@ -0,0 +1,341 @@
+#
+# Copyright 2021, Breakaway Consulting Pty. Ltd.
+#
+# SPDX-License-Identifier: BSD-2-Clause
+#
+"""
+Static schedulability analysis of a system description.
+
+Each PD and VM is scheduled by the kernel as a sporadic server: within
+any period it executes for at most its budget, at its priority, on its
+CPU. So in any window of time 't' a domain can delay the domains of
+lower priority on the same CPU by at most ceil(t / period) * budget. The
+response time of a domain is the smallest fixed point of
+
+    R = budget + blocking + sum(ceil(R / period_j) * budget_j)
+
+over the other domains on the same CPU with a higher or equal priority
+(equal priorities are scheduled round-robin). A domain is schedulable if
+its response time is at most its period.
+
+The budget of a passive PD is bound to its notification, so it is only
+used to handle notifications and IRQs. A protected procedure call into a
+passive PD executes on the budget of the caller, at the priority of the
+callee. As protected calls are only made to higher priorities this is the
+immediate priority ceiling protocol, so a domain is blocked at most once,
+for at most the budget of one domain that calls into a passive PD which
+either it also calls, or which has a priority at least its own.
+
+PDs with a full budget (budget equal to the period) are time-sliced
+rather than reserved a share of the CPU, so they are not analysed, but
+they do delay the domains of lower priority on the same CPU.
+
+The latency of a flow through a sequence of channels is bounded by the
+sum of the latencies of the PDs it passes through. A PD may have used its
+budget just before the flow reaches it, so its latency is its response
+time plus the time until its budget is replenished, period - budget. A
+protected call into a passive PD executes within the latency of the
+caller. The cost of the IPC itself, and of IPIs between CPUs, is not
+included.
+
+With a domain schedule, the PDs of a domain only run in its windows of
+the cyclic schedule. The response times above do not account for this.
+Instead each PD is checked to be guaranteed its budget in every period:
+the least time the windows of its domain give in any interval as long as
+its period, which is for an interval starting as one of the windows ends,
+must be at least its budget. The PDs of a domain on a CPU must also not
+use more of the CPU than the share of the schedule the domain has.
+"""
+from dataclasses import dataclass, field
+from fractions import Fraction
+
+from typing import Dict, FrozenSet, List, Optional, Set, Tuple
+
+from microkit.sysxml import SysDomainWindow, SysFlow, SystemDescription
+
+
+@dataclass(frozen=True)
+class SchedDomain:
+    name: str
+    cpu: int
+    priority: int
+    budget: int
+    period: int
+    # The passive PDs that execute on the budget of this domain when it
+    # calls them, directly or through other passive PDs.
+    servers: FrozenSet[str]
+
+    @property
+    def full_budget(self) -> bool:
+        return self.budget == self.period
+
+
+@dataclass
+class ResponseTime:
+    domain: SchedDomain
+    blocking: int
+    # None when the response time exceeds the period
+    response: Optional[int]
+
+
+@dataclass
+class FlowStep:
+    pd: str
+    # How the flow reaches the PD: "irq", "start", "notification" or
+    # "protected call"
+    via: str
+    # None when it is not bounded
+    latency: Optional[int]
+
+
+@dataclass
+class FlowLatency:
+    flow: SysFlow
+    steps: List[FlowStep]
+
+    @property
+    def latency(self) -> Optional[int]:
+        if any(step.latency is None for step in self.steps):
+            return None
+        return sum(step.latency for step in self.steps if step.latency is not None)
+
+
+@dataclass
+class DomainSupply:
+    """The time the domain schedule guarantees a PD or VM."""
+    name: str
+    cpu: int
+    domain: str
+    budget: int
+    period: int
+    # The least time the windows of the domain give in any interval as
+    # long as the period
+    supply: int
+
+
+@dataclass
+class SchedAnalysis:
+    domains: List[SchedDomain]
+    # The fraction of each CPU reserved by the domains that are analysed
+    cpu_utilisation: List[Fraction]
+    response_times: List[ResponseTime]
+    # The priority of each passive PD
+    server_priorities: Dict[str, int]
+    flow_latencies: List[FlowLatency] = field(default_factory=list)
+    domain_supply: List[DomainSupply] = field(default_factory=list)
+    # The fraction of the domain schedule each domain has
+    domain_shares: Dict[str, Fraction] = field(default_factory=dict)
+    # Protected calls between PDs in different domains, as (caller, callee)
+    cross_domain_calls: List[Tuple[str, str]] = field(default_factory=list)
+
+    def problems(self) -> List[str]:
+        problems = []
+        for cpu, utilisation in enumerate(self.cpu_utilisation):
+            if utilisation > 1:
+                problems.append(f"CPU {cpu} is over-committed: utilisation is {float(utilisation):.1%}")
+        for rt in self.response_times:
+            if rt.response is None:
+                problems.append(f"'{rt.domain.name}' on CPU {rt.domain.cpu} has a worst-case response time greater than its period of {rt.domain.period}us")
+        for fl in self.flow_latencies:
+            deadline = fl.flow.deadline
+            if deadline is not None and (fl.latency is None or fl.latency > deadline):
+                problems.append(f"flow '{fl.flow.name}' may exceed its deadline of {deadline}us")
+        for ds in self.domain_supply:
+            if ds.supply < ds.budget:
+                problems.append(f"'{ds.name}' on CPU {ds.cpu} may not get its budget of {ds.budget}us in its period of {ds.period}us, as domain '{ds.domain}' is only guaranteed {ds.supply}us")
+        for (domain, cpu), utilisation in sorted(self.domain_utilisation().items()):
+            if utilisation > self.domain_shares[domain]:
+                problems.append(f"domain '{domain}' is over-committed on CPU {cpu}: utilisation is {float(utilisation):.1%} of its {float(self.domain_shares[domain]):.1%} of the schedule")
+        pd_domains = {ds.name: ds.domain for ds in self.domain_supply}
+        for caller, callee in self.cross_domain_calls:
+            problems.append(f"'{caller}' in domain '{pd_domains[caller]}' makes protected calls to '{callee}' in domain '{pd_domains[callee]}', which only run in the windows of '{pd_domains[callee]}'")
+        return problems
+
+    def domain_utilisation(self) -> Dict[Tuple[str, int], Fraction]:
+        """The fraction of each CPU used by the PDs and VMs of each domain."""
+        utilisation: Dict[Tuple[str, int], Fraction] = {}
+        for ds in self.domain_supply:
+            if ds.budget < ds.period:
+                key = (ds.domain, ds.cpu)
+                utilisation[key] = utilisation.get(key, Fraction(0)) + Fraction(ds.budget, ds.period)
+        return utilisation
+
+    def domain_latency(self, name: str) -> Optional[int]:
+        """The longest time for the domain to finish handling an event."""
+        domain = next(domain for domain in self.domains if domain.name == name)
+        response = _response_time(domain, self.domains, self.server_priorities).response
+        return None if response is None else domain.period - domain.budget + response
+
+
+def sched_domains(system: SystemDescription) -> List[SchedDomain]:
+    """The domains that the kernel schedules, which are the PDs and VMs."""
+    pd_by_name = {pd.name: pd for pd in system.protection_domains}
+
+    # The passive PDs each PD can call directly
+    calls: Dict[str, Set[str]] = {pd.name: set() for pd in system.protection_domains}
+    for cc in system.channels:
+        if pd_by_name[cc.pd_b].passive and system.is_protected_call(cc.pd_a, cc.pd_b):
+            calls[cc.pd_a].add(cc.pd_b)
+        if pd_by_name[cc.pd_a].passive and system.is_protected_call(cc.pd_b, cc.pd_a):
+            calls[cc.pd_b].add(cc.pd_a)
+
+    def servers(name: str) -> FrozenSet[str]:
+        found: Set[str] = set()
+        pending = list(calls[name])
+        while pending:
+            server = pending.pop()
+            if server not in found:
+                found.add(server)
+                pending += calls[server]
+        return frozenset(found)
+
+    domains = []
+    for pd in system.protection_domains:
+        domains.append(SchedDomain(pd.name, pd.cpu_affinity, pd.priority, pd.budget, pd.period, servers(pd.name)))
+        vm = pd.virtual_machine
+        if vm is not None:
+            domains.append(SchedDomain(vm.name, vm.cpu_affinity, vm.priority, vm.budget, vm.period, frozenset()))
+    return domains
+
+
+def _blocking(domain: SchedDomain, domains: List[SchedDomain], server_priorities: Dict[str, int]) -> int:
+    blocking = 0
+    for other in domains:
+        if other is domain:
+            continue
+        # Higher priorities on the same CPU are already counted as interference
+        if other.cpu == domain.cpu and other.priority >= domain.priority:
+            continue
+        for server in other.servers:
+            if server in domain.servers or (other.cpu == domain.cpu and server_priorities[server] >= domain.priority):
+                blocking = max(blocking, other.budget)
+                break
+    return blocking
+
+
+def response_time(domain: SchedDomain, blocking: int, interfering: List[SchedDomain]) -> Optional[int]:
+    """The worst-case response time of 'domain', or None if it exceeds the
+    period."""
+    response = domain.budget + blocking
+    while response <= domain.period:
+        demand = domain.budget + blocking + sum(-(-response // other.period) * other.budget for other in interfering)
+        if demand == response:
+            return response
+        response = demand
+    return None
+
+
+def _response_time(domain: SchedDomain, domains: List[SchedDomain], server_priorities: Dict[str, int]) -> ResponseTime:
+    interfering = [
+        other for other in domains
+        if other is not domain and other.cpu == domain.cpu and other.priority >= domain.priority
+    ]
+    blocking = _blocking(domain, domains, server_priorities)
+    return ResponseTime(domain, blocking, response_time(domain, blocking, interfering))
+
+
+def analyse_cpu(cpu: int, domains: List[SchedDomain], server_priorities: Dict[str, int]) -> Tuple[Fraction, List[ResponseTime]]:
+    """The utilisation of 'cpu' and the response times of the domains on it.
+    These only depend on which domains are on the CPU, not on where the
+    others are."""
+    utilisation = Fraction(0)
+    response_times = []
+    for domain in domains:
+        if domain.cpu != cpu or domain.full_budget:
+            continue
+        utilisation += Fraction(domain.budget, domain.period)
+        response_times.append(_response_time(domain, domains, server_priorities))
+    return utilisation, response_times
+
+
+def analyse_domains(domains: List[SchedDomain], server_priorities: Dict[str, int], num_cpus: int) -> SchedAnalysis:
+    cpu_utilisation = []
+    cpu_response_times = {}
+    for cpu in range(num_cpus):
+        utilisation, cpu_response_times[cpu] = analyse_cpu(cpu, domains, server_priorities)
+        cpu_utilisation.append(utilisation)
+    # In the order of the system description
+    response_times = {rt.domain.name: rt for rts in cpu_response_times.values() for rt in rts}
+    ordered = [response_times[domain.name] for domain in domains if domain.name in response_times]
+    return SchedAnalysis(domains, cpu_utilisation, ordered, server_priorities)
+
+
+def server_priorities(system: SystemDescription) -> Dict[str, int]:
+    return {pd.name: pd.priority for pd in system.protection_domains if pd.passive}
+
+
+def flow_latency(flow: SysFlow, system: SystemDescription, analysis: SchedAnalysis) -> FlowLatency:
+    first = flow.hops[0]
+    via = "irq" if system.channel_peer(first.pd, first.id_) is None else "start"
+    steps = [FlowStep(first.pd, via, analysis.domain_latency(first.pd))]
+    for hop in flow.hops:
+        peer = system.channel_peer(hop.pd, hop.id_)
+        if peer is None:
+            continue
+        if system.is_protected_call(hop.pd, peer):
+            # A passive PD executes within the latency of the caller
+            latency = 0 if system.pd_by_name[peer].passive else analysis.domain_latency(peer)
+            steps.append(FlowStep(peer, "protected call", latency))
+        else:
+            steps.append(FlowStep(peer, "notification", analysis.domain_latency(peer)))
+    return FlowLatency(flow, steps)
+
+
+def domain_supply_bound(schedule: Tuple[SysDomainWindow, ...], domain: str, interval: int) -> int:
+    """The least time the windows of 'domain' give in any 'interval' of the
+    cyclic 'schedule'."""
+    cycle = sum(window.length for window in schedule)
+    cycles, rest = divmod(interval, cycle)
+    per_cycle = sum(window.length for window in schedule if window.domain == domain)
+    least = None
+    for idx, window in enumerate(schedule):
+        if window.domain != domain:
+            continue
+        # The interval starts as this window ends
+        supply = cycles * per_cycle
+        remaining = rest
+        next_idx = idx + 1
+        while remaining > 0:
+            next_window = schedule[next_idx % len(schedule)]
+            length = min(next_window.length, remaining)
+            if next_window.domain == domain:
+                supply += length
+            remaining -= length
+            next_idx += 1
+        least = supply if least is None else min(least, supply)
+    assert least is not None
+    return least
+
+
+def analyse_domain_schedule(system: SystemDescription, analysis: SchedAnalysis) -> None:
+    schedule = system.domain_schedule
+    cycle = sum(window.length for window in schedule)
+    analysis.domain_shares = {
+        domain: Fraction(sum(window.length for window in schedule if window.domain == domain), cycle)
+        for domain in system.domain_names
+    }
+
+    pd_domains = {}
+    for pd in system.protection_domains:
+        domain = system.domain_names[system.domain_index(pd)]
+        pd_domains[pd.name] = domain
+        runs = [(pd.name, pd.cpu_affinity, pd.budget, pd.period)]
+        vm = pd.virtual_machine
+        if vm is not None:
+            runs.append((vm.name, vm.cpu_affinity, vm.budget, vm.period))
+        for name, cpu, budget, period in runs:
+            supply = domain_supply_bound(schedule, domain, period)
+            analysis.domain_supply.append(DomainSupply(name, cpu, domain, budget, period, supply))
+
+    for cc in system.channels:
+        for caller, callee in ((cc.pd_a, cc.pd_b), (cc.pd_b, cc.pd_a)):
+            if system.is_protected_call(caller, callee) and pd_domains[caller] != pd_domains[callee]:
+                analysis.cross_domain_calls.append((caller, callee))
+
+
+def analyse_schedulability(system: SystemDescription, num_cpus: int) -> SchedAnalysis:
+    analysis = analyse_domains(sched_domains(system), server_priorities(system), num_cpus)
+    analysis.flow_latencies = [flow_latency(flow, system, analysis) for flow in system.flows]
+    if system.domain_schedule:
+        analyse_domain_schedule(system, analysis)
+    return analysis
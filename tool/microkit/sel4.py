@@ -5,8 +5,9 @@
 #
 from dataclasses import dataclass, fields
 from enum import Enum, IntEnum
-from typing import List, Optional, Set, Tuple, Dict
-from struct import pack, Struct
+from operator import attrgetter
+from typing import Callable, Dict, List, Optional, Sequence, Set, Tuple, Type, TypeVar
+from struct import Struct
 
 from microkit.util import MemoryRegion, DisjointMemoryRegion, UserError, lsb, round_down, round_up
 from microkit.elf import ElfFile
@@ -67,6 +68,11 @@ class KernelConfig:
     arm_pa_size_bits: Optional[int]
     riscv_page_table_levels: Optional[int]
     x86_xsave_size: Optional[int]
+    # The number of page colours of the L2 cache, 1 when its geometry is not
+    # known
+    cache_colours: int
+    # The number of domains of the domain scheduler
+    num_domains: int
 
 # Kernel Objects:
 
@@ -858,34 +864,62 @@ class Sel4LabelX86(IntEnum):
 
 ### Invocations
 
+# The structs of invocations by their number of words
+_INVOCATION_STRUCTS: Dict[int, Struct] = {}
+
+
+def _invocation_struct(words: int) -> Struct:
+    if words not in _INVOCATION_STRUCTS:
+        _INVOCATION_STRUCTS[words] = Struct("<" + "Q" * words)
+    return _INVOCATION_STRUCTS[words]
+
+
 class Sel4Invocation:
+    # Large systems have hundreds of thousands of invocations, so they are
+    # kept small by having slots rather than a __dict__ (see
+    # _invocation_dataclass).
+    __slots__ = ("label", "_repeat_count", "_repeat_incr")
+
     label: Sel4Label
     _extra_caps: Tuple[str, ...]
     _object_type: str
     _method_name: str
-
-    def _generic_invocation(self, kernel_config: KernelConfig, extra_caps: Tuple[int, ...], args: Tuple[int, ...]) -> bytes:
-        repeat_count = self._repeat_count if hasattr(self, "_repeat_count") else None
+    # The names of the service field, the cap fields and the other fields,
+    # in the order they are serialised, and a function that gets their
+    # values in that order.
+    _layout: Tuple[str, Tuple[str, ...], Tuple[str, ...]]
+    _layout_values: Callable[["Sel4Invocation"], Tuple[int, ...]]
+
+    def _generic_invocation(self, kernel_config: KernelConfig, extra_caps: Tuple[int, ...], args: Tuple[int, ...]) -> Tuple[int, ...]:
+        repeat_count = getattr(self, "_repeat_count", None)
         tag = self.message_info_new(self.label.get_id(kernel_config), 0, len(extra_caps), len(args))
         if repeat_count:
             tag |= ((repeat_count - 1) << 32)
-        fmt = "<QQ" + ("Q" * (0 + len(extra_caps) + len(args)))
-        all_args = (tag, self._service) + extra_caps + args
-        base = pack(fmt, *all_args)
+        base = (tag, self._service, *extra_caps, *args)
         if repeat_count:
             repeat_incr = self._repeat_incr
-            extra_fmt = "<Q" + ("Q" * (0 + len(extra_caps) + len(args)))
-            service: int = repeat_incr.get(fields(self)[0].name, 0)
-            cap_args: Tuple[int, ...] = tuple(repeat_incr.get(f.name, 0) for f in fields(self)[1:] if f.name in self._extra_caps)
-            val_args: Tuple[int, ...] = tuple(repeat_incr.get(f.name, 0) for f in fields(self)[1:] if f.name not in self._extra_caps)
-            extra = pack(extra_fmt, *((service, ) + cap_args + val_args))
-        else:
-            extra = b''
-        return base + extra
+            service_name, cap_names, val_names = self._layout
+            return base + (
+                repeat_incr.get(service_name, 0),
+                *(repeat_incr.get(name, 0) for name in cap_names),
+                *(repeat_incr.get(name, 0) for name in val_names),
+            )
+        return base
+
+    def _arg_count(self) -> int:
+        """The number of extra caps and arguments of the invocation."""
+        _, cap_names, val_names = self._layout
+        return len(cap_names) + len(val_names)
+
+    def _word_count(self) -> int:
+        """The number of words of the serialised invocation, known without
+        serialising it."""
+        words = 2 + self._arg_count()
+        return 2 * words - 1 if getattr(self, "_repeat_count", None) else words
 
     @property
     def _service(self) -> int:
-        v = getattr(self, fields(self)[0].name)
+        v = getattr(self, self._layout[0])
         assert isinstance(v, int)
         return v
 
@@ -902,10 +936,14 @@ class Sel4Invocation:
         assert length < 0x80
         return label << 12 | caps << 9 | extra_caps << 7 | length
 
+    def _invocation_words(self, kernel_config: KernelConfig) -> Tuple[int, ...]:
+        cap_count = len(self._layout[1])
+        values = self._layout_values(self)
+        return self._generic_invocation(kernel_config, values[1:1 + cap_count], values[1 + cap_count:])
+
     def _get_raw_invocation(self, kernel_config: KernelConfig) -> bytes:
-        cap_args = tuple(val for nm, val in self._args if nm in self._extra_caps)
-        val_args = tuple(val for nm, val in self._args if nm not in self._extra_caps)
-        return self._generic_invocation(kernel_config, cap_args, val_args)
+        words = self._invocation_words(kernel_config)
+        return _invocation_struct(len(words)).pack(*words)
 
     def repeat(self, count: int, **kwargs: int) -> None:
         if count > 1:
@@ -917,7 +955,43 @@ class Sel4Invocation:
             self._repeat_incr = kwargs
 
 
-@dataclass
+InvocationType = TypeVar("InvocationType", bound=Type[Sel4Invocation])
+
+
+def _invocation_dataclass(cls: InvocationType) -> InvocationType:
+    """Make an invocation a dataclass with a slot for each field, as
+    dataclass(slots=True) does from Python 3.10 on."""
+    cls = dataclass(cls)
+    field_names = tuple(f.name for f in fields(cls))
+    cls_dict = dict(cls.__dict__)
+    cls_dict.pop("__dict__", None)
+    cls_dict.pop("__weakref__", None)
+    cls_dict["__slots__"] = field_names
+    service_name = field_names[0]
+    cap_names = tuple(name for name in field_names[1:] if name in cls._extra_caps)
+    val_names = tuple(name for name in field_names[1:] if name not in cls._extra_caps)
+    cls_dict["_layout"] = (service_name, cap_names, val_names)
+    # attrgetter only returns a tuple when given more than one name
+    getter = attrgetter(service_name, *cap_names, *val_names)
+    cls_dict["_layout_values"] = staticmethod(getter if len(field_names) > 1 else lambda inv: (getter(inv), ))
+    return type(cls)(cls.__name__, cls.__bases__, cls_dict)  # type: ignore
+
+
+def serialise_invocations(kernel_config: KernelConfig, invocations: Sequence[Sel4Invocation]) -> bytearray:
+    """The invocations, in the format the monitor reads them. The buffer is
+    sized from the invocations first and each one is then packed into it in
+    place, so no copy of the data is made as it is built."""
+    data = bytearray(8 * sum(invocation._word_count() for invocation in invocations))
+    offset = 0
+    for invocation in invocations:
+        words = invocation._invocation_words(kernel_config)
+        _invocation_struct(len(words)).pack_into(data, offset, *words)
+        offset += 8 * len(words)
+    assert offset == len(data)
+    return data
+
+
+@_invocation_dataclass
 class Sel4UntypedRetype(Sel4Invocation):
     _object_type = "Untyped"
     _method_name = "Retype"
@@ -932,21 +1006,18 @@ class Sel4UntypedRetype(Sel4Invocation):
     node_offset: int
     num_objects: int
 
-    def _get_raw_invocation(self, kernel_config: KernelConfig) -> bytes:
+    def _invocation_words(self, kernel_config: KernelConfig) -> Tuple[int, ...]:
         # @ivanv: HACK
         old_object_type = self.object_type
         self.object_type = Sel4Object.get_id(self.object_type, kernel_config)
 
-        cap_args = tuple(val for nm, val in self._args if nm in self._extra_caps)
-        val_args = tuple(val for nm, val in self._args if nm not in self._extra_caps)
-
-        invocation = self._generic_invocation(kernel_config, cap_args, val_args)
+        invocation = Sel4Invocation._invocation_words(self, kernel_config)
         self.object_type = old_object_type
 
         return invocation
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4TcbSetSchedParams(Sel4Invocation):
     _object_type = "TCB"
     _method_name = "SetSchedParams"
@@ -960,7 +1031,7 @@ class Sel4TcbSetSchedParams(Sel4Invocation):
     fault_ep: int
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4TcbSetSpace(Sel4Invocation):
     _object_type = "TCB"
     _method_name = "SetSpace"
@@ -974,7 +1045,7 @@ class Sel4TcbSetSpace(Sel4Invocation):
     vspace_root_data: int
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4TcbSetIpcBuffer(Sel4Invocation):
     _object_type = "TCB"
     _method_name = "SetIPCBuffer"
@@ -985,7 +1056,7 @@ class Sel4TcbSetIpcBuffer(Sel4Invocation):
     buffer_frame: int
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4TcbResume(Sel4Invocation):
     _object_type = "TCB"
     _method_name = "Resume"
@@ -994,7 +1065,7 @@ class Sel4TcbResume(Sel4Invocation):
     tcb: int
 
 # @ivanv: combine the arch specific TCB write regs
-@dataclass
+@_invocation_dataclass
 class Sel4AARCH64TcbWriteRegisters(Sel4Invocation):
     _object_type = "TCB"
     _method_name = "WriteRegisters"
@@ -1005,7 +1076,10 @@ class Sel4AARCH64TcbWriteRegisters(Sel4Invocation):
     arch_flags: int
     regs: Sel4Aarch64Regs
 
-    def _get_raw_invocation(self, kernel_config: KernelConfig) -> bytes:
+    def _arg_count(self) -> int:
+        return 2 + self.regs.count()
+
+    def _invocation_words(self, kernel_config: KernelConfig) -> Tuple[int, ...]:
         params = (
             self.arch_flags << 8 | 1 if self.resume else 0,
             self.regs.count()
@@ -1014,7 +1088,7 @@ class Sel4AARCH64TcbWriteRegisters(Sel4Invocation):
         return self._generic_invocation(kernel_config, (), params)
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4RISCVTcbWriteRegisters(Sel4Invocation):
     _object_type = "TCB"
     _method_name = "WriteRegisters"
@@ -1025,7 +1099,10 @@ class Sel4RISCVTcbWriteRegisters(Sel4Invocation):
     arch_flags: int
     regs: Sel4RiscvRegs
 
-    def _get_raw_invocation(self, kernel_config: KernelConfig) -> bytes:
+    def _arg_count(self) -> int:
+        return 2 + self.regs.count()
+
+    def _invocation_words(self, kernel_config: KernelConfig) -> Tuple[int, ...]:
         params = (
             self.arch_flags << 8 | 1 if self.resume else 0,
             self.regs.count()
@@ -1034,7 +1111,7 @@ class Sel4RISCVTcbWriteRegisters(Sel4Invocation):
         return self._generic_invocation(kernel_config, (), params)
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4X64TcbWriteRegisters(Sel4Invocation):
     _object_type = "TCB"
     _method_name = "WriteRegisters"
@@ -1045,7 +1122,10 @@ class Sel4X64TcbWriteRegisters(Sel4Invocation):
     arch_flags: int
     regs: Sel4X64Regs
 
-    def _get_raw_invocation(self, kernel_config: KernelConfig) -> bytes:
+    def _arg_count(self) -> int:
+        return 2 + self.regs.count()
+
+    def _invocation_words(self, kernel_config: KernelConfig) -> Tuple[int, ...]:
         params = (
             self.arch_flags << 8 | 1 if self.resume else 0,
             self.regs.count()
@@ -1054,7 +1134,7 @@ class Sel4X64TcbWriteRegisters(Sel4Invocation):
         return self._generic_invocation((), params)
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4TcbBindNotification(Sel4Invocation):
     _object_type = "TCB"
     _method_name = "BindNotification"
@@ -1064,7 +1144,17 @@ class Sel4TcbBindNotification(Sel4Invocation):
     notification: int
 
 
-@dataclass
+@_invocation_dataclass
+class Sel4TcbSetTimeoutEndpoint(Sel4Invocation):
+    _object_type = "TCB"
+    _method_name = "SetTimeoutEndpoint"
+    _extra_caps = ("timeout_fault_ep", )
+    label = Sel4Label.TCBSetTimeoutEndpoint
+    tcb: int
+    timeout_fault_ep: int
+
+
+@_invocation_dataclass
 class Sel4AsidPoolAssign(Sel4Invocation):
     _object_type = "ASID Pool"
     _method_name = "Assign"
@@ -1086,7 +1176,7 @@ class Sel4AsidPoolAssign(Sel4Invocation):
         self.vspace = vspace
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4IrqControlGetTrigger(Sel4Invocation):
     _object_type = "IRQ Control"
     _method_name = "Get"
@@ -1114,7 +1204,7 @@ class Sel4IrqControlGetTrigger(Sel4Invocation):
         self.dest_depth = dest_depth
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4IrqHandlerSetNotification(Sel4Invocation):
     _object_type = "IRQ Handler"
     _method_name = "SetNotification"
@@ -1124,7 +1214,7 @@ class Sel4IrqHandlerSetNotification(Sel4Invocation):
     notification: int
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4ARMPageTableMap(Sel4Invocation):
     _object_type = "Page Table"
     _method_name = "Map"
@@ -1136,7 +1226,7 @@ class Sel4ARMPageTableMap(Sel4Invocation):
     attr: int
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4RISCVPageTableMap(Sel4Invocation):
     _object_type = "Page Table"
     _method_name = "Map"
@@ -1148,7 +1238,7 @@ class Sel4RISCVPageTableMap(Sel4Invocation):
     attr: int
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4PageMap(Sel4Invocation):
     _object_type = "Page"
     _method_name = "Map"
@@ -1176,7 +1266,7 @@ class Sel4PageMap(Sel4Invocation):
         self.attr = attr
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4CnodeMint(Sel4Invocation):
     _object_type = "CNode"
     _method_name = "Mint"
@@ -1192,7 +1282,7 @@ class Sel4CnodeMint(Sel4Invocation):
     badge: int
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4CnodeCopy(Sel4Invocation):
     _object_type = "CNode"
     _method_name = "Copy"
@@ -1207,7 +1297,7 @@ class Sel4CnodeCopy(Sel4Invocation):
     rights: int
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4CnodeMutate(Sel4Invocation):
     _object_type = "CNode"
     _method_name = "Mutate"
@@ -1222,7 +1312,7 @@ class Sel4CnodeMutate(Sel4Invocation):
     badge: int
 
 
-@dataclass
+@_invocation_dataclass
 class Sel4SchedControlConfigureFlags(Sel4Invocation):
     _object_type = "SchedControl"
     _method_name = "ConfigureFlags"
@@ -1237,7 +1327,18 @@ class Sel4SchedControlConfigureFlags(Sel4Invocation):
     flags: int
 
 
-@dataclass
+@_invocation_dataclass
+class Sel4DomainSetSet(Sel4Invocation):
+    _object_type = "Domain Set"
+    _method_name = "Set"
+    _extra_caps = ("tcb", )
+    label = Sel4Label.DomainSetSet
+    domain_set: int
+    domain: int
+    tcb: int
+
+
+@_invocation_dataclass
 class Sel4ArmVcpuSetTcb(Sel4Invocation):
     _object_type = "VCPU"
     _method_name = "Set TCB"
@@ -1246,7 +1347,7 @@ class Sel4ArmVcpuSetTcb(Sel4Invocation):
     vcpu: int
     tcb: int
 
-@dataclass
+@_invocation_dataclass
 class Sel4RiscvVcpuSetTcb(Sel4Invocation):
     _object_type = "VCPU"
     _method_name = "Set TCB"
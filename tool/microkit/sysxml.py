@@ -11,11 +11,24 @@ import sys
 sys.modules['_elementtree'] = None  # type: ignore
 import xml.etree.ElementTree as ET
 
-from typing import Dict, Iterable, Optional, Set, Tuple
+from typing import Dict, FrozenSet, Iterable, List, Optional, Set, Tuple
 
-from microkit.util import str_to_bool, UserError
+from microkit.util import str_to_bool, round_up, UserError
 from microkit.sel4 import Sel4ArmIrqTrigger
 
+# Dynamically allocated memory regions are managed by the monitor in
+# blocks of the large page size. The limits match the monitor's tables.
+MR_BLOCK_SIZE = 0x200_000
+MR_WINDOW_MAX_SIZE = 64 * MR_BLOCK_SIZE
+MR_RESERVE_MAX_SIZE = 256 * MR_BLOCK_SIZE
+
+# Maps without a vaddr are laid out from this address, well above where
+# program images are linked, and within the smallest user address space of
+# the supported architectures (Sv39 on RISC-V).
+AUTO_MAP_VADDR_BASE = 0x800_000_000
+# Placeholder for the vaddr of such maps until they are laid out
+_AUTO_VADDR = -1
+
 # @ivanv: when we parse mappings, should we warn that settings cached doesn't do anything on RISC-V systems?
 
 class MissingAttribute(Exception):
@@ -44,6 +57,10 @@ class PlatformDescription:
     num_cpus: int
     kernel_is_hypervisor: bool
     aarch64_smc_calls_allowed: bool
+    # The number of page colours of the L2 cache, 1 when it is not known
+    cache_colours: int
+    # The number of domains of the kernel's domain scheduler
+    num_domains: int
 
 
 class LineNumberingParser(ET.XMLParser):
@@ -76,6 +93,13 @@ class SysIrq:
     trigger: str
 
 
+@dataclass(frozen=True, eq=True)
+class SysMrWindow:
+    vaddr: int
+    size: int
+    element: ET.Element
+
+
 @dataclass(frozen=True, eq=True)
 class SysSetVar:
     symbol: str
@@ -94,10 +118,19 @@ class ProtectionDomain:
     pp: bool
     passive: bool
     smc: bool
+    cpu_stats: bool
+    timeout_faults: bool
+    # The page colours the PD's memory and kernel objects are allocated
+    # from, or None for any colour
+    cache_colours: Optional[FrozenSet[int]]
+    # The domain of the domain schedule the PD runs in, or None for the
+    # first domain
+    domain: Optional[str]
     program_image: Path
     maps: Tuple[SysMap, ...]
     irqs: Tuple[SysIrq, ...]
     setvars: Tuple[SysSetVar, ...]
+    mr_window: Optional[SysMrWindow]
     child_pds: Tuple["ProtectionDomain", ...]
     parent: Optional["ProtectionDomain"]
     virtual_machine: Optional["VirtualMachine"]
@@ -116,6 +149,13 @@ class SysMemoryRegion:
     page_size: int
     page_count: int
     phys_addr: Optional[int]
+    # Set when the page size was chosen by the tool rather than the system
+    # description.
+    auto_page_size: bool = False
+    # File with the initial contents of the memory region
+    data: Optional[Path] = None
+    # The page colours the frames are allocated from, or None for any colour
+    cache_colours: Optional[FrozenSet[int]] = None
 
 
 @dataclass(frozen=True, eq=True)
@@ -125,6 +165,8 @@ class Channel:
     pd_b: str
     id_b: int
     element: ET.Element
+    # The relative amount of traffic on the channel, for placing PDs
+    weight: int = 1
 
 
 @dataclass(frozen=True, eq=True)
@@ -138,6 +180,40 @@ class VirtualMachine:
     period: int
 
 
+@dataclass(frozen=True, eq=True)
+class SysFlowHop:
+    # The IRQ or channel, by its id in the PD, the flow passes through
+    pd: str
+    id_: int
+    element: ET.Element
+
+
+@dataclass(frozen=True, eq=True)
+class SysFlow:
+    name: str
+    # In microseconds
+    deadline: Optional[int]
+    hops: Tuple[SysFlowHop, ...]
+    element: ET.Element
+
+
+@dataclass(frozen=True, eq=True)
+class SysDomainWindow:
+    domain: str
+    # In microseconds
+    length: int
+    element: ET.Element
+
+
+@dataclass(frozen=True, eq=True)
+class SysMonitor:
+    fault_log: Optional[str] = None
+    fault_uart: bool = True
+    mr_reserve: int = 0
+    budget_stats: Optional[str] = None
+    element: Optional[ET.Element] = None
+
+
 def _pd_tree_to_list(root_pd: ProtectionDomain, parent_pd: Optional[ProtectionDomain]) -> Tuple[ProtectionDomain, ...]:
     # Check child PDs have unique identifiers
     child_ids = set()
@@ -167,11 +243,23 @@ class SystemDescription:
         self,
         memory_regions: Iterable[SysMemoryRegion],
         protection_domains: Iterable[ProtectionDomain],
-        channels: Iterable[Channel]
+        channels: Iterable[Channel],
+        monitor: SysMonitor = SysMonitor(),
+        flows: Iterable[SysFlow] = (),
+        domain_schedule: Iterable[SysDomainWindow] = (),
     ) -> None:
         self.memory_regions = tuple(memory_regions)
         self.protection_domains = _pd_flatten(protection_domains)
         self.channels = tuple(channels)
+        self.monitor = monitor
+        self.flows = tuple(flows)
+        self.domain_schedule = tuple(domain_schedule)
+        # The domains in the order they first appear in the schedule, which
+        # is the number the kernel knows them by
+        self.domain_names: List[str] = []
+        for window in self.domain_schedule:
+            if window.domain not in self.domain_names:
+                self.domain_names.append(window.domain)
 
         # Note: These could be dict comprehensions, but
         # we want to perform duplicate checks as we
@@ -241,6 +329,33 @@ class SystemDescription:
             ch_ids[cc.pd_a].add(cc.id_a)
             ch_ids[cc.pd_b].add(cc.id_b)
 
+        # Ensure flows follow the channels. Each hop after the first must be
+        # in the PD at the other end of the channel of the previous hop or,
+        # after protected calls, in one of the callers once the calls have
+        # returned. Only the first hop may be an IRQ.
+        flow_names = set()
+        for flow in self.flows:
+            if flow.name in flow_names:
+                raise UserError(f"Duplicate flow name '{flow.name}'.")
+            flow_names.add(flow.name)
+            expected_pds: List[str] = []
+            for idx, hop in enumerate(flow.hops):
+                if hop.pd not in self.pd_by_name:
+                    raise UserError(f"Protection domain with name '{hop.pd}' on element '{hop.element.tag}' does not exist: {hop.element._loc_str}")  # type: ignore
+                if idx > 0 and hop.pd not in expected_pds:
+                    raise UserError(f"Flow '{flow.name}' continues in '{hop.pd}' rather than '{expected_pds[-1]}': {hop.element._loc_str}")  # type: ignore
+                peer = self.channel_peer(hop.pd, hop.id_)
+                if peer is None:
+                    is_irq = any(sysirq.id_ == hop.id_ for sysirq in self.pd_by_name[hop.pd].irqs)
+                    if idx > 0 or not is_irq:
+                        raise UserError(f"Flow '{flow.name}' has no channel {hop.id_} in '{hop.pd}': {hop.element._loc_str}")  # type: ignore
+                    expected_pds = [hop.pd]
+                elif self.is_protected_call(hop.pd, peer):
+                    callers = expected_pds[:expected_pds.index(hop.pd)] if hop.pd in expected_pds else []
+                    expected_pds = callers + [hop.pd, peer]
+                else:
+                    expected_pds = [peer]
+
         # Ensure that all maps are correct
         for pd in self.protection_domains:
             maps = pd.maps
@@ -255,6 +370,42 @@ class SystemDescription:
                 if extra != 0:
                     raise UserError(f"Invalid vaddr alignment on '{map.element.tag}' @ {map.element._loc_str}")  # type: ignore
 
+        # Ensure the monitor's fault log is a valid memory region. It is mapped
+        # into the monitor's address space using a single page table.
+        if monitor.fault_log is not None:
+            if monitor.fault_log not in self.mr_by_name:
+                raise UserError(f"Invalid memory region name '{monitor.fault_log}' on 'monitor' @ {monitor.element._loc_str}")  # type: ignore
+            if self.mr_by_name[monitor.fault_log].size > 0x200_000:
+                raise UserError(f"Fault log memory region '{monitor.fault_log}' must not be larger than 2MiB on 'monitor' @ {monitor.element._loc_str}")  # type: ignore
+
+        # Likewise for the budget stats, which the monitor updates on every
+        # timeout fault.
+        if monitor.budget_stats is not None:
+            if monitor.budget_stats not in self.mr_by_name:
+                raise UserError(f"Invalid memory region name '{monitor.budget_stats}' on 'monitor' @ {monitor.element._loc_str}")  # type: ignore
+            if self.mr_by_name[monitor.budget_stats].size > 0x200_000:
+                raise UserError(f"Budget stats memory region '{monitor.budget_stats}' must not be larger than 2MiB on 'monitor' @ {monitor.element._loc_str}")  # type: ignore
+            if monitor.budget_stats == monitor.fault_log:
+                raise UserError(f"Budget stats and fault log must be different memory regions on 'monitor' @ {monitor.element._loc_str}")  # type: ignore
+
+        # Ensure dynamic MR windows have a reserve to allocate from, and do
+        # not overlap any static mappings.
+        for pd in self.protection_domains:
+            if pd.mr_window is None:
+                continue
+            window = pd.mr_window
+            if monitor.mr_reserve == 0:
+                raise UserError(f"mr_window requires the monitor to have an mr_reserve on '{window.element.tag}' @ {window.element._loc_str}")  # type: ignore
+            for map in pd.maps:
+                mr = self.mr_by_name[map.mr]
+                if map.vaddr < window.vaddr + window.size and window.vaddr < map.vaddr + mr.size:
+                    raise UserError(f"mr_window overlaps map of '{map.mr}' on '{window.element.tag}' @ {window.element._loc_str}")  # type: ignore
+
+        # Ensure PDs are only in domains of the domain schedule
+        for pd in self.protection_domains:
+            if pd.domain is not None and pd.domain not in self.domain_names:
+                raise UserError(f"Domain '{pd.domain}' of protection domain '{pd.name}' is not in the domain schedule @ {pd.element._loc_str}")  # type: ignore
+
         # Note: Overlapping memory is checked in the build.
 
         # Ensure all memory regions are used at least once. This only generates
@@ -268,12 +419,56 @@ class SystemDescription:
                 if m.mr in check_mrs:
                     check_mrs.remove(m.mr)
 
+        for monitor_mr in (monitor.fault_log, monitor.budget_stats):
+            if monitor_mr in check_mrs:
+                check_mrs.remove(monitor_mr)
+
         for mr_ in check_mrs:
             print(f"WARNING: Unused memory region: {mr_}")
 
+    def is_protected_call(self, caller: str, callee: str) -> bool:
+        """Whether 'caller' can make protected calls to 'callee'. A channel
+        between PDs that cannot is only used for notifications."""
+        callee_pd = self.pd_by_name[callee]
+        return callee_pd.pp and callee_pd.priority > self.pd_by_name[caller].priority
+
+    def domain_index(self, pd: ProtectionDomain) -> int:
+        """The number of the domain 'pd' runs in. A VM runs in the domain of
+        the PD it belongs to."""
+        return 0 if pd.domain is None else self.domain_names.index(pd.domain)
+
+    def channel_peer(self, pd_name: str, id_: int) -> Optional[str]:
+        """The PD at the other end of channel 'id_' of 'pd_name', if any."""
+        for cc in self.channels:
+            if cc.pd_a == pd_name and cc.id_a == id_:
+                return cc.pd_b
+            if cc.pd_b == pd_name and cc.id_b == id_:
+                return cc.pd_a
+        return None
+
+
+def _parse_cache_colours(value: str, plat_desc: PlatformDescription) -> FrozenSet[int]:
+    """Parse a list of cache colours and ranges of them, such as "0-3,8"."""
+    if plat_desc.cache_colours == 1:
+        raise ValueError("cache_colours is set, but the platform has no known L2 cache geometry")
+    colours: Set[int] = set()
+    for part in value.split(","):
+        first, _, last = part.partition("-")
+        try:
+            start = int(first, base=0)
+            end = start if last == "" else int(last, base=0)
+        except ValueError:
+            raise ValueError(f"invalid cache_colours '{value}'")
+        if start > end:
+            raise ValueError(f"invalid cache colour range '{part}'")
+        if start < 0 or end >= plat_desc.cache_colours:
+            raise ValueError(f"cache colours must be between 0 and {plat_desc.cache_colours - 1}")
+        colours.update(range(start, end + 1))
+    return frozenset(colours)
+
 
 def xml2mr(mr_xml: ET.Element, plat_desc: PlatformDescription) -> SysMemoryRegion:
-    _check_attrs(mr_xml, ("name", "size", "page_size", "phys_addr"))
+    _check_attrs(mr_xml, ("name", "size", "page_size", "phys_addr", "data", "cache_colours"))
     name = checked_lookup(mr_xml, "name")
     size = int(checked_lookup(mr_xml, "size"), base=0)
     page_size_str = mr_xml.attrib.get("page_size")
@@ -286,12 +481,141 @@ def xml2mr(mr_xml: ET.Element, plat_desc: PlatformDescription) -> SysMemoryRegio
     paddr = None if paddr_str is None else int(paddr_str, base=0)
     if paddr is not None and paddr % page_size != 0:
         raise ValueError("phys_addr is not aligned to the page size")
+    data_str = mr_xml.attrib.get("data")
+    data = None if data_str is None else Path(data_str)
+    # The tool places the contents in memory it reserves for the loader
+    if data is not None and paddr is not None:
+        raise ValueError("data and phys_addr must not both be specified")
+    colours_str = mr_xml.attrib.get("cache_colours")
+    colours = None if colours_str is None else _parse_cache_colours(colours_str, plat_desc)
+    # Larger pages span several colours
+    if colours is not None and page_size != min(plat_desc.page_sizes):
+        raise ValueError("cache_colours requires the smallest page size")
+    if colours is not None and paddr is not None:
+        raise ValueError("cache_colours and phys_addr must not both be specified")
     page_count = size // page_size
-    return SysMemoryRegion(name, size, page_size, page_count, paddr)
+    return SysMemoryRegion(name, size, page_size, page_count, paddr, page_size_str is None, data, colours)
+
+
+def _layout_maps(pd: ProtectionDomain, mr_by_name: Dict[str, SysMemoryRegion], plat_desc: PlatformDescription) -> ProtectionDomain:
+    """Choose the vaddr of the maps of a PD (and its children) that do not
+    have one.
+
+    The maps are packed together from AUTO_MAP_VADDR_BASE, around the other
+    maps and the MR window of the PD, so they share as few page tables as
+    possible. Each map is aligned to the largest page size the memory region
+    can use, and the maps with the largest alignment are placed first so the
+    small pages end up next to each other.
+    """
+    child_pds = tuple(_layout_maps(child, mr_by_name, plat_desc) for child in pd.child_pds)
+
+    used = [(map.vaddr, map.vaddr + mr_by_name[map.mr].size) for map in pd.maps if map.vaddr != _AUTO_VADDR and map.mr in mr_by_name]
+    if pd.mr_window is not None:
+        used.append((pd.mr_window.vaddr, pd.mr_window.vaddr + pd.mr_window.size))
+    used.sort()
+
+    def alignment(map: SysMap) -> int:
+        mr = mr_by_name[map.mr]
+        if not mr.auto_page_size:
+            return mr.page_size
+        return max(
+            page_size for page_size in plat_desc.page_sizes
+            if mr.size % page_size == 0 and (mr.phys_addr is None or mr.phys_addr % page_size == 0)
+        )
+
+    # Maps of unknown memory regions are reported when the system is checked
+    auto_maps = [map for map in pd.maps if map.vaddr == _AUTO_VADDR and map.mr in mr_by_name]
+    vaddrs: Dict[int, int] = {}
+    next_vaddr = AUTO_MAP_VADDR_BASE
+    for map in sorted(auto_maps, key=alignment, reverse=True):
+        size = mr_by_name[map.mr].size
+        vaddr = round_up(next_vaddr, alignment(map))
+        for base, end in used:
+            if vaddr < end and base < vaddr + size:
+                vaddr = round_up(end, alignment(map))
+        vaddrs[id(map)] = vaddr
+        next_vaddr = vaddr + size
+
+    maps = []
+    setvars = list(pd.setvars)
+    for map in pd.maps:
+        if id(map) in vaddrs:
+            map = replace(map, vaddr=vaddrs[id(map)])
+            assert map.element is not None
+            setvar_vaddr = map.element.attrib.get("setvar_vaddr")
+            if setvar_vaddr:
+                setvars.append(SysSetVar(setvar_vaddr, vaddr=map.vaddr))
+        maps.append(map)
+
+    return replace(pd, maps=tuple(maps), setvars=tuple(setvars), child_pds=child_pds)
+
+
+def _inherit_cache_colours(
+        memory_regions: Iterable[SysMemoryRegion],
+        protection_domains: Iterable[ProtectionDomain],
+    ) -> Tuple[SysMemoryRegion, ...]:
+    """Give each memory region without cache colours, that is only mapped
+    by PDs with the same cache colours, the colours of those PDs.
+
+    Memory regions at a fixed physical address, or with an explicit page
+    size, keep any colour.
+    """
+    map_colours: Dict[str, Set[Optional[FrozenSet[int]]]] = {}
+    for pd in _pd_flatten(protection_domains):
+        for map in pd.maps:
+            map_colours.setdefault(map.mr, set()).add(pd.cache_colours)
+        if pd.virtual_machine:
+            for map in pd.virtual_machine.maps:
+                map_colours.setdefault(map.mr, set()).add(None)
+
+    inherited = []
+    for mr in memory_regions:
+        colours = map_colours.get(mr.name, {None})
+        if mr.cache_colours is None and mr.phys_addr is None and mr.auto_page_size and len(colours) == 1:
+            mr = replace(mr, cache_colours=colours.pop())
+        inherited.append(mr)
+
+    return tuple(inherited)
+
+
+def _promote_page_sizes(
+        memory_regions: Iterable[SysMemoryRegion],
+        protection_domains: Iterable[ProtectionDomain],
+        monitor: SysMonitor,
+        plat_desc: PlatformDescription,
+    ) -> Tuple[SysMemoryRegion, ...]:
+    """Use the largest supported page size for each memory region without an
+    explicit page size, where its size, its physical address and the virtual
+    address of every map of it are aligned to that page size.
+
+    The monitor's memory regions, and those with cache colours, keep the
+    smallest page size.
+    """
+    map_vaddrs: Dict[str, List[int]] = {}
+    for pd in _pd_flatten(protection_domains):
+        maps = pd.maps
+        if pd.virtual_machine:
+            maps += pd.virtual_machine.maps
+        for map in maps:
+            map_vaddrs.setdefault(map.mr, []).append(map.vaddr)
+
+    promoted = []
+    for mr in memory_regions:
+        if mr.auto_page_size and mr.cache_colours is None and mr.name not in (monitor.fault_log, monitor.budget_stats):
+            for page_size in sorted(plat_desc.page_sizes, reverse=True):
+                if page_size <= mr.page_size:
+                    break
+                aligned = mr.size % page_size == 0 and (mr.phys_addr is None or mr.phys_addr % page_size == 0)
+                if aligned and all(vaddr % page_size == 0 for vaddr in map_vaddrs.get(mr.name, [])):
+                    mr = replace(mr, page_size=page_size, page_count=mr.size // page_size)
+                    break
+        promoted.append(mr)
+
+    return tuple(promoted)
 
 
 def xml2pd(pd_xml: ET.Element, plat_desc: PlatformDescription, is_child: bool=False) -> ProtectionDomain:
-    root_attrs = ("name", "priority", "pp", "budget", "period", "cpu", "passive", "smc")
+    root_attrs = ("name", "priority", "pp", "budget", "period", "cpu", "passive", "smc", "cpu_stats", "timeout_faults", "cache_colours", "domain")
     child_attrs = root_attrs + ("id", )
     _check_attrs(pd_xml, child_attrs if is_child else root_attrs)
     program_image: Optional[Path] = None
@@ -324,9 +648,23 @@ def xml2pd(pd_xml: ET.Element, plat_desc: PlatformDescription, is_child: bool=Fa
     if smc and not plat_desc.aarch64_smc_calls_allowed:
         raise ValueError(f"SMC call forwarding is set on PD '{name}', but it is not supported by the platform")
 
+    cpu_stats = str_to_bool(pd_xml.attrib.get("cpu_stats", "false"))
+
+    # A PD whose budget equals its period is never throttled, so it can
+    # never raise a timeout fault.
+    timeout_faults = str_to_bool(pd_xml.attrib.get("timeout_faults", "false"))
+    if timeout_faults and budget == period:
+        raise ValueError("timeout_faults requires budget to be less than period")
+
+    colours_str = pd_xml.attrib.get("cache_colours")
+    cache_colours = None if colours_str is None else _parse_cache_colours(colours_str, plat_desc)
+
+    domain = pd_xml.attrib.get("domain")
+
     maps = []
     irqs = []
     setvars = []
+    mr_window = None
     child_pds = []
     virtual_machine = None
     for child in pd_xml:
@@ -339,7 +677,8 @@ def xml2pd(pd_xml: ET.Element, plat_desc: PlatformDescription, is_child: bool=Fa
             elif child.tag == "map":
                 _check_attrs(child, ("mr", "vaddr", "perms", "cached", "setvar_vaddr"))
                 mr = checked_lookup(child, "mr")
-                vaddr = int(checked_lookup(child, "vaddr"), base=0)
+                vaddr_str = child.attrib.get("vaddr")
+                vaddr = _AUTO_VADDR if vaddr_str is None else int(vaddr_str, base=0)
                 perms = child.attrib.get("perms", "rw")
                 # On all architectures, the kernel does not allow write-only mappings
                 if perms == "w":
@@ -348,8 +687,9 @@ def xml2pd(pd_xml: ET.Element, plat_desc: PlatformDescription, is_child: bool=Fa
                 cached = str_to_bool(child.attrib.get("cached", "true"))
                 maps.append(SysMap(mr, vaddr, perms, cached, child))
 
+                # The vaddr of maps without one is only set once laid out
                 setvar_vaddr = child.attrib.get("setvar_vaddr")
-                if setvar_vaddr:
+                if setvar_vaddr and vaddr != _AUTO_VADDR:
                     setvars.append(SysSetVar(setvar_vaddr, vaddr=vaddr))
             elif child.tag == "irq":
                 _check_attrs(child, ("irq", "id", "trigger"))
@@ -368,6 +708,17 @@ def xml2pd(pd_xml: ET.Element, plat_desc: PlatformDescription, is_child: bool=Fa
                 symbol = checked_lookup(child, "symbol")
                 region_paddr = checked_lookup(child, "region_paddr")
                 setvars.append(SysSetVar(symbol, region_paddr=region_paddr))
+            elif child.tag == "mr_window":
+                _check_attrs(child, ("vaddr", "size"))
+                if mr_window is not None:
+                    raise ValueError("mr_window must only be specified once")
+                vaddr = int(checked_lookup(child, "vaddr"), base=0)
+                size = int(checked_lookup(child, "size"), base=0)
+                if vaddr % MR_BLOCK_SIZE != 0 or size % MR_BLOCK_SIZE != 0:
+                    raise ValueError("vaddr and size must be multiples of 2MiB")
+                if size == 0 or size > MR_WINDOW_MAX_SIZE:
+                    raise ValueError(f"size must be between 2MiB and {MR_WINDOW_MAX_SIZE // 0x100_000}MiB")
+                mr_window = SysMrWindow(vaddr, size, child)
             elif child.tag == "protection_domain":
                 child_pds.append(xml2pd(child, plat_desc, is_child=True))
             elif child.tag == "virtual_machine":
@@ -394,10 +745,15 @@ def xml2pd(pd_xml: ET.Element, plat_desc: PlatformDescription, is_child: bool=Fa
         pp,
         passive,
         smc,
+        cpu_stats,
+        timeout_faults,
+        cache_colours,
+        domain,
         program_image,
         tuple(maps),
         tuple(irqs),
         tuple(setvars),
+        mr_window,
         tuple(child_pds),
         None,
         virtual_machine,
@@ -407,12 +763,15 @@ def xml2pd(pd_xml: ET.Element, plat_desc: PlatformDescription, is_child: bool=Fa
 
 
 def xml2channel(ch_xml: ET.Element) -> Channel:
-    _check_attrs(ch_xml, ())
+    _check_attrs(ch_xml, ("weight", ))
+    weight = int(ch_xml.attrib.get("weight", "1"), base=0)
+    if weight < 0:
+        raise ValueError("weight must be >= 0")
     ends = []
     for child in ch_xml:
         try:
             if child.tag == "end":
-                _check_attrs(ch_xml, ("pd", "id"))
+                _check_attrs(child, ("pd", "id"))
                 pd = checked_lookup(child, "pd")
                 pd_id = int(checked_lookup(child, "id"))
                 if pd_id >= 64:
@@ -428,7 +787,29 @@ def xml2channel(ch_xml: ET.Element) -> Channel:
     if len(ends) != 2:
         raise ValueError("exactly two end elements must be specified")
 
-    return Channel(ends[0][0], ends[0][1], ends[1][0], ends[1][1], ch_xml)
+    return Channel(ends[0][0], ends[0][1], ends[1][0], ends[1][1], ch_xml, weight)
+
+
+def xml2flow(flow_xml: ET.Element) -> SysFlow:
+    _check_attrs(flow_xml, ("name", "deadline"))
+    name = checked_lookup(flow_xml, "name")
+    deadline_str = flow_xml.attrib.get("deadline")
+    deadline = None if deadline_str is None else int(deadline_str, base=0)
+    hops = []
+    for child in flow_xml:
+        try:
+            if child.tag == "hop":
+                _check_attrs(child, ("pd", "id"))
+                hops.append(SysFlowHop(checked_lookup(child, "pd"), int(checked_lookup(child, "id"), base=0), child))
+            else:
+                raise UserError(f"Invalid XML element '{child.tag}': {child._loc_str}")  # type: ignore
+        except ValueError as e:
+            raise UserError(f"Error: {e} on element '{child.tag}': {child._loc_str}")  # type: ignore
+
+    if len(hops) == 0:
+        raise ValueError("at least one hop must be specified")
+
+    return SysFlow(name, deadline, tuple(hops), flow_xml)
 
 
 def xml2vm(vm_xml: ET.Element, plat_desc: PlatformDescription) -> VirtualMachine:
@@ -473,6 +854,54 @@ def xml2vm(vm_xml: ET.Element, plat_desc: PlatformDescription) -> VirtualMachine
     )
 
 
+def xml2domain_schedule(schedule_xml: ET.Element, plat_desc: PlatformDescription) -> Tuple[SysDomainWindow, ...]:
+    _check_attrs(schedule_xml, ())
+    if plat_desc.num_cpus > 1:
+        raise ValueError("domain_schedule is set, but domains are not supported on multicore kernels")
+    if plat_desc.num_domains == 1:
+        raise ValueError("domain_schedule is set, but the kernel is built with a single domain")
+    windows = []
+    for child in schedule_xml:
+        try:
+            if child.tag == "domain":
+                _check_attrs(child, ("name", "length"))
+                length = int(checked_lookup(child, "length"), base=0)
+                # The kernel counts the length of a domain in milliseconds
+                if length <= 0 or length % 1000 != 0:
+                    raise ValueError("length must be a positive multiple of 1000us")
+                windows.append(SysDomainWindow(checked_lookup(child, "name"), length, child))
+            else:
+                raise UserError(f"Invalid XML element '{child.tag}': {child._loc_str}")  # type: ignore
+        except ValueError as e:
+            raise UserError(f"Error: {e} on element '{child.tag}': {child._loc_str}")  # type: ignore
+
+    if len(windows) == 0:
+        raise ValueError("at least one domain must be specified")
+    num_domains = len({window.domain for window in windows})
+    if num_domains > plat_desc.num_domains:
+        raise ValueError(f"the schedule has {num_domains} domains, but the kernel supports at most {plat_desc.num_domains}")
+
+    return tuple(windows)
+
+
+def xml2monitor(monitor_xml: ET.Element) -> SysMonitor:
+    _check_attrs(monitor_xml, ("fault_log", "fault_uart", "mr_reserve", "budget_stats"))
+    fault_log = monitor_xml.attrib.get("fault_log")
+    fault_uart = str_to_bool(monitor_xml.attrib.get("fault_uart", "true"))
+    if fault_log is None and not fault_uart:
+        raise ValueError("fault_uart can only be disabled when a fault_log is specified")
+
+    mr_reserve = int(monitor_xml.attrib.get("mr_reserve", "0"), base=0)
+    if mr_reserve % MR_BLOCK_SIZE != 0:
+        raise ValueError("mr_reserve must be a multiple of 2MiB")
+    if mr_reserve > MR_RESERVE_MAX_SIZE:
+        raise ValueError(f"mr_reserve must not be larger than {MR_RESERVE_MAX_SIZE // 0x100_000}MiB")
+
+    budget_stats = monitor_xml.attrib.get("budget_stats")
+
+    return SysMonitor(fault_log, fault_uart, mr_reserve, budget_stats, monitor_xml)
+
+
 def _check_no_text(el: ET.Element) -> None:
     if not (el.text is None or el.text.strip() == ""):
         raise UserError(f"Error: unexpected text found in element '{el.tag}' @ {el._loc_str}")  # type: ignore
@@ -493,6 +922,9 @@ def xml2system(filename: Path, plat_desc: PlatformDescription) -> SystemDescript
     memory_regions = []
     protection_domains = []
     channels = []
+    flows = []
+    monitor = None
+    domain_schedule: Optional[Tuple[SysDomainWindow, ...]] = None
 
     # Ensure there is no non-whitespace text
     _check_no_text(root)
@@ -505,6 +937,16 @@ def xml2system(filename: Path, plat_desc: PlatformDescription) -> SystemDescript
                 protection_domains.append(xml2pd(child, plat_desc))
             elif child.tag == "channel":
                 channels.append(xml2channel(child))
+            elif child.tag == "flow":
+                flows.append(xml2flow(child))
+            elif child.tag == "monitor":
+                if monitor is not None:
+                    raise ValueError("monitor must only be specified once")
+                monitor = xml2monitor(child)
+            elif child.tag == "domain_schedule":
+                if domain_schedule is not None:
+                    raise ValueError("domain_schedule must only be specified once")
+                domain_schedule = xml2domain_schedule(child, plat_desc)
             else:
                 raise UserError(f"Invalid XML element '{child.tag}': {child._loc_str}")  # type: ignore
         except ValueError as e:
@@ -512,8 +954,19 @@ def xml2system(filename: Path, plat_desc: PlatformDescription) -> SystemDescript
         except MissingAttribute as e:
             raise UserError(f"Error: Missing required attribute '{e.attribute_name}' on element '{e.element.tag}': {e.element._loc_str}")  # type: ignore
 
+    if monitor is None:
+        monitor = SysMonitor()
+
+    mr_by_name = {mr.name: mr for mr in memory_regions}
+    protection_domains = [_layout_maps(pd, mr_by_name, plat_desc) for pd in protection_domains]
+
+    memory_regions = list(_inherit_cache_colours(memory_regions, protection_domains))
+
     return SystemDescription(
-        memory_regions=memory_regions,
+        memory_regions=_promote_page_sizes(memory_regions, protection_domains, monitor, plat_desc),
         protection_domains=protection_domains,
         channels=channels,
+        monitor=monitor,
+        flows=flows,
+        domain_schedule=() if domain_schedule is None else domain_schedule,
     )
@@ -197,14 +197,20 @@ class DisjointMemoryRegion:
 
         return region.base
 
-    def allocate_from(self, size: int, lower_bound: int) -> int:
+    def allocate_from(self, size: int, lower_bound: int, alignment: int = 1) -> int:
+        """Allocate region of 'size' bytes from a region based at or above
+        'lower_bound'.
+
+        The returned base address is aligned to 'alignment'. Any memory
+        skipped to meet the alignment stays in the disjoint memory region."""
         for region in self._regions:
-            if size <= region.size and region.base >= lower_bound:
+            base = round_up(region.base, alignment)
+            if base + size <= region.end and region.base >= lower_bound:
                 break
         else:
             raise ValueError(f"Unable to allocate 0x{size:x} bytes.")
 
-        self.remove_region(region.base, region.base + size)
+        self.remove_region(base, base + size)
 
-        return region.base
+        return base
 
@@ -3,10 +3,30 @@
 #
 # SPDX-License-Identifier: BSD-2-Clause
 #
+from dataclasses import replace
+from json import loads as json_loads
 from pathlib import Path
+import re
+from struct import pack
+from tempfile import TemporaryDirectory
+from typing import Dict, Optional, Tuple
 import unittest
-
-from microkit.sysxml import xml2system, UserError, PlatformDescription
+from unittest.mock import patch
+
+from microkit.sysxml import xml2system, UserError, PlatformDescription, SystemDescription
+from microkit.sel4 import KernelBootInfo, UntypedObject, KernelConfig, KernelArch, Sel4Label, Sel4TcbResume, Sel4CnodeCopy, Sel4CnodeMint, Sel4DomainSetSet, Sel4PageMap, serialise_invocations
+from microkit.util import MemoryRegion, round_up
+from microkit.elf import ElfFile, ElfSegment, ElfSymbol, SegmentAttributes
+from microkit import lz4
+from microkit.loader import Loader
+from microkit.sched import analyse_schedulability, domain_supply_bound
+from microkit.placement import place_domains, placed_system_xml
+from microkit.cache import BuildCache, CachedBuild, CachedRegion, elf_layout
+from microkit.__main__ import (
+    BuiltSystem, ColouredPageAllocator, KernelObjectAllocator, coloured_elf_segment_backing, elf_segment_backing,
+    build_system, cache_colour_count, check_monitor_mrs, identical_program_images, json_report, next_invocation_table_size, page_run_regions,
+    write_domain_schedule, MAX_SYSTEM_INVOCATION_SIZE, MONITOR_EP_CAP_IDX,
+)
 
 
 plat_desc = PlatformDescription(
@@ -16,19 +36,66 @@ plat_desc = PlatformDescription(
     num_cpus = 4,
     kernel_is_hypervisor = True,
     aarch64_smc_calls_allowed = False,
+    cache_colours = 16,
+    num_domains = 16,
 )
 
 def _file(filename: str) -> Path:
     return Path(__file__).parent / filename
 
 
+def _kernel_elf() -> ElfFile:
+    """A kernel image with just what the tool needs to emulate its boot,
+    which is 1GiB of RAM at 0x4000_0000."""
+    elf = ElfFile()
+    data = bytearray(0x20_0000)
+    data[0x1000:0x1010] = pack("<QQ", 0x4000_0000, 0x8000_0000)
+    elf.add_segment(ElfSegment(0x4000_0000, 0x4000_0000, data, True, SegmentAttributes.PF_R | SegmentAttributes.PF_W | SegmentAttributes.PF_X))
+    for name, vaddr, size in (("avail_p_regs", 0x4000_1000, 16), ("ki_boot_end", 0x4008_0000, 0), ("ki_end", 0x4010_0000, 0)):
+        elf.add_symbol(name, ElfSymbol(0, 0, 0, 0, vaddr, size))
+    elf.entry = 0x4000_0000
+    return elf
+
+
+def _pd_elf() -> ElfFile:
+    """A small program image, with 0x2000 bytes of code and 0x3000 bytes of
+    data."""
+    elf = ElfFile()
+    elf.add_segment(ElfSegment(0x20_0000, 0x20_0000, bytearray(0x2000), True, SegmentAttributes.PF_R | SegmentAttributes.PF_X))
+    elf.add_segment(ElfSegment(0x21_0000, 0x21_0000, bytearray(0x3000), True, SegmentAttributes.PF_R | SegmentAttributes.PF_W))
+    for name, vaddr, size in (("__sel4_ipc_buffer_obj", 0x21_2000, 0x1000), ("microkit_name", 0x21_0000, 64), ("passive", 0x21_0040, 1)):
+        elf.add_symbol(name, ElfSymbol(0, 0, 0, 0, vaddr, size))
+    elf.entry = 0x20_0000
+    return elf
+
+
+def _build(
+        filename: str,
+        kernel_config: KernelConfig,
+        mr_data: Optional[Dict[str, bytes]] = None,
+        platform: PlatformDescription = plat_desc,
+    ) -> Tuple[SystemDescription, BuiltSystem]:
+    """Build a system from a description in which every PD has the same
+    small program image."""
+    system = xml2system(_file(filename), platform)
+    monitor_elf = ElfFile()
+    monitor_elf.add_segment(ElfSegment(0x8a00_0000, 0x8a00_0000, bytearray(0x4_0000), True, SegmentAttributes.PF_R | SegmentAttributes.PF_W | SegmentAttributes.PF_X))
+    monitor_elf.entry = 0x8a00_0000
+    pd_elf_files = {pd: _pd_elf() for pd in system.protection_domains}
+    # The invocation table and system CNode are large enough for any of
+    # the test systems, so a single build is enough.
+    return system, build_system(kernel_config, _kernel_elf(), monitor_elf, system, 0x10_0000, 0x1000, pd_elf_files, {} if mr_data is None else mr_data)
+
+
 class ExtendedTestCase(unittest.TestCase):
+    plat_desc = plat_desc
+
     def assertStartsWith(self, v, check):
         self.assertTrue(v.startswith(check), f"'{v}' does not start with '{check}'")
 
     def _check_error(self, filename, message):
         with self.assertRaises(UserError) as e:
-            xml2system(_file(filename), plat_desc)
+            xml2system(_file(filename), self.plat_desc)
         self.assertStartsWith(str(e.exception), message)
 
     def _check_missing(self, filename, attr, element):
@@ -49,6 +116,9 @@ class MemoryRegionParseTests(ExtendedTestCase):
     def test_addr_not_aligned_to_page_size(self):
         self._check_error("mr_addr_not_aligned_to_page_size.xml", "Error: phys_addr is not aligned to the page size on element 'memory_region'")
 
+    def test_data_with_phys_addr(self):
+        self._check_error("mr_data_with_phys_addr.xml", "Error: data and phys_addr must not both be specified on element 'memory_region'")
+
     def test_missing_size(self):
         self._check_missing("mr_missing_size.xml", "size", "memory_region")
 
@@ -58,6 +128,49 @@ class MemoryRegionParseTests(ExtendedTestCase):
     def test_invalid_attrs(self):
         self._check_error("mr_invalid_attrs.xml", "Error: invalid attribute 'page_count' on element 'memory_region': ")
 
+    def test_large_page_promotion(self):
+        system = xml2system(_file("mr_large_page_promotion.xml"), plat_desc)
+        page_sizes = {mr.name: mr.page_size for mr in system.memory_regions}
+        self.assertEqual(page_sizes, {"aligned": 0x200_000, "unaligned_map": 0x1000, "unaligned_size": 0x1000, "explicit": 0x1000})
+        self.assertEqual(system.mr_by_name["aligned"].page_count, 2)
+
+
+class MemoryRegionDataTests(unittest.TestCase):
+    def test_placement(self):
+        system, built_system = _build("mr_data.xml", InvocationTests.kernel_config, {"table": b"abc", "firmware": bytes([1]) * 0x1800})
+        # The contents follow the program images in the reserved region,
+        # aligned to the page size of each memory region
+        self.assertEqual(built_system.reserved_region, MemoryRegion(0x4020_0000, 0x4060_0000))
+        self.assertEqual([(r.name, r.addr, bytes(r.data[:3]), r.zero_size) for r in built_system.regions if r.name.startswith("MR ")], [
+            ("MR table", 0x4030_8000, b"abc", 0x2000 - 3),
+            ("MR firmware", 0x4040_0000, bytes([1]) * 3, 0x20_0000 - 0x1800),
+        ])
+        # Every PD maps the same frames
+        maps = [
+            (built_system.cap_lookup[inv.page], inv.vaddr)
+            for inv in built_system.system_invocations
+            if isinstance(inv, Sel4PageMap) and inv.vaddr >= 0x100_0000
+        ]
+        self.assertEqual(maps, [
+            ("Page(4 KiB): MR=table @ 40308000 (derived)", 0x100_0000),
+            ("Page(2 MiB): MR=firmware @ 40400000 (derived)", 0x200_0000),
+            ("Page(4 KiB): MR=table @ 40308000 (derived)", 0x300_0000),
+        ])
+
+
+class MonitorInterfaceTests(unittest.TestCase):
+    def test_labels(self):
+        # The labels of requests to the monitor must agree between
+        # libmicrokit and the monitor
+        def labels(path: Path, prefix: str) -> Dict[str, int]:
+            pattern = re.compile(rf"^#define {prefix}MONITOR_LABEL_(\w+) (\w+)$", re.MULTILINE)
+            return {name: int(value, 0) for name, value in pattern.findall(path.read_text())}
+
+        root = Path(__file__).parent.parent.parent
+        microkit_labels = labels(root / "libmicrokit" / "include" / "microkit.h", "MICROKIT_")
+        self.assertEqual(microkit_labels, labels(root / "monitor" / "src" / "main.c", ""))
+        self.assertEqual(microkit_labels["CPU_STATS"], 0x100)
+
 
 class ProtectionDomainParseTests(ExtendedTestCase):
     def test_missing_name(self):
@@ -69,8 +182,16 @@ class ProtectionDomainParseTests(ExtendedTestCase):
     def test_missing_mr(self):
         self._check_missing("pd_missing_mr.xml", "mr", "map")
 
-    def test_missing_vaddr(self):
-        self._check_missing("pd_missing_vaddr.xml", "vaddr", "map")
+    def test_auto_vaddr(self):
+        system = xml2system(_file("pd_auto_vaddr.xml"), plat_desc)
+        pd = system.pd_by_name["test"]
+        self.assertEqual([(map.mr, map.vaddr) for map in pd.maps], [
+            ("small", 0x800_600_000),
+            ("large", 0x800_200_000),
+            ("fixed", 0x800_000_000),
+        ])
+        self.assertEqual([(setvar.symbol, setvar.vaddr) for setvar in pd.setvars], [("small_vaddr", 0x800_600_000)])
+        self.assertEqual(system.mr_by_name["large"].page_size, 0x200_000)
 
     def test_missing_irq(self):
         self._check_missing("pd_missing_irq.xml", "irq", "irq")
@@ -105,6 +226,30 @@ class ProtectionDomainParseTests(ExtendedTestCase):
     def test_write_only_mr(self):
         self._check_error("pd_write_only_mr.xml", f"Error: perms must not be 'w', write-only mappings are not allowed on element 'map':")
 
+    def test_cpu_stats(self):
+        system = xml2system(_file("pd_cpu_stats.xml"), plat_desc)
+        self.assertEqual([(pd.name, pd.cpu_stats) for pd in system.protection_domains], [("worker", False), ("stats", True)])
+
+    def test_cpu_stats_malformed(self):
+        self._check_error("pd_cpu_stats_malformed.xml", "Error: invalid boolean value on element 'protection_domain':")
+
+    def test_cpu_stats_monitor_cap(self):
+        _, built_system = _build("pd_cpu_stats.xml", InvocationTests.kernel_config)
+        # Only the PD with cpu_stats gets a cap to the monitor. It is badged
+        # with the index of the PD, which the monitor keeps a window for.
+        monitor_caps = [
+            (built_system.cap_lookup[inv.cnode], inv.badge)
+            for inv in built_system.system_invocations
+            if isinstance(inv, Sel4CnodeMint) and inv.dest_index == MONITOR_EP_CAP_IDX and inv.src_obj == built_system.fault_ep_cap_address
+        ]
+        self.assertEqual(monitor_caps, [("CNode: PD=stats", 2)])
+
+    def test_mr_window_not_aligned(self):
+        self._check_error("pd_mr_window_not_aligned.xml", "Error: vaddr and size must be multiples of 2MiB on element 'mr_window':")
+
+    def test_timeout_faults_without_period(self):
+        self._check_error("pd_timeout_faults_without_period.xml", "Error: timeout_faults requires budget to be less than period on element 'protection_domain':")
+
 
 class VirtualMachineParseTests(ExtendedTestCase):
     def test_duplicate_name(self):
@@ -163,4 +308,498 @@ class SystemParseTests(ExtendedTestCase):
         self._check_error("sys_map_not_aligned.xml", "Invalid vaddr alignment on 'map' @ ")
 
     def test_too_many_pds(self):
-        self._check_error("sys_too_many_pds.xml", "Too many protection domains (64) defined. Maximum is 63.")
\ No newline at end of file
+        self._check_error("sys_too_many_pds.xml", "Too many protection domains (64) defined. Maximum is 63.")
+
+    def test_monitor_invalid_fault_log(self):
+        self._check_error("sys_monitor_invalid_fault_log.xml", "Invalid memory region name 'fault_log' on 'monitor' @ ")
+
+    def test_monitor_fault_uart_without_log(self):
+        self._check_error("sys_monitor_fault_uart_without_log.xml", "Error: fault_uart can only be disabled when a fault_log is specified on element 'monitor'")
+
+    def test_monitor_small_budget_stats(self):
+        system = xml2system(_file("sys_monitor_small_budget_stats.xml"), plat_desc)
+        with self.assertRaises(UserError) as e:
+            check_monitor_mrs(InvocationTests.kernel_config, system)
+        # A count, then 35 words for each of the monitor's 64 PDs
+        self.assertEqual(str(e.exception), "Error: budget stats memory region 'budget_stats' of size 0x4000 is smaller than the budget stats table of size 0x4608")
+
+    def test_mr_window_without_reserve(self):
+        self._check_error("sys_mr_window_without_reserve.xml", "mr_window requires the monitor to have an mr_reserve on 'mr_window' @ ")
+
+    def test_flow_broken_chain(self):
+        self._check_error("sys_flow_broken_chain.xml", "Flow 'flow' continues in 'test1' rather than 'test2': ")
+
+    def test_flow_invalid_channel(self):
+        self._check_error("sys_flow_invalid_channel.xml", "Flow 'flow' has no channel 1 in 'test1': ")
+
+
+class SchedulabilityTests(unittest.TestCase):
+    def test_analysis(self):
+        system = xml2system(_file("sched_analysis.xml"), plat_desc)
+        analysis = analyse_schedulability(system, plat_desc.num_cpus)
+        self.assertEqual([float(u) for u in analysis.cpu_utilisation], [0.6, 1.2, 0.0, 0.0])
+        # The PD with a full budget is time-sliced
+        self.assertEqual([(rt.domain.name, rt.blocking, rt.response) for rt in analysis.response_times], [
+            # Notifications of the passive server wait for calls into it
+            ("server", 300, 400),
+            # Blocked while 'low' executes in the server on its budget
+            ("high", 300, 600),
+            ("low", 0, 600),
+            ("over1", 0, 600),
+            ("over2", 0, None),
+        ])
+        self.assertEqual(analysis.problems(), [
+            "CPU 1 is over-committed: utilisation is 120.0%",
+            "'over2' on CPU 1 has a worst-case response time greater than its period of 1000us",
+        ])
+
+    def test_flows(self):
+        system = xml2system(_file("sched_flows.xml"), plat_desc)
+        analysis = analyse_schedulability(system, plat_desc.num_cpus)
+        rx, tx = analysis.flow_latencies
+        # Each PD may wait for its budget to be replenished, then respond,
+        # except for the passive PD, which runs on the budget of its caller.
+        self.assertEqual([(step.pd, step.via, step.latency) for step in rx.steps], [
+            ("eth_outer", "irq", 900 + 350),
+            ("pass", "notification", 800 + 350),
+            ("crypto", "protected call", 0),
+            ("eth_inner", "notification", 400 + 100),
+        ])
+        self.assertEqual((rx.latency, tx.latency), (2900, 2900))
+        self.assertEqual(analysis.problems(), ["flow 'rx' may exceed its deadline of 2000us"])
+
+
+class DomainScheduleTests(ExtendedTestCase):
+    # Domains are only supported on single core kernels
+    plat_desc = replace(plat_desc, num_cpus=1)
+
+    def test_analysis(self):
+        system = xml2system(_file("domain_schedule.xml"), self.plat_desc)
+        self.assertEqual(system.domain_names, ["control", "network"])
+        # PDs without a domain are in the first one
+        self.assertEqual([system.domain_index(pd) for pd in system.protection_domains], [0, 0, 1])
+        analysis = analyse_schedulability(system, self.plat_desc.num_cpus)
+        self.assertEqual([(ds.name, ds.domain, ds.supply) for ds in analysis.domain_supply], [
+            ("ctrl", "control", 7000),
+            ("rest", "control", 7000),
+            # No window of 'network' fits in the 4ms after one ends
+            ("eth", "network", 0),
+            # The VM is in the domain of its PD
+            ("vm", "network", 6000),
+        ])
+        self.assertEqual(analysis.problems(), [
+            "'eth' on CPU 0 may not get its budget of 500us in its period of 4000us, as domain 'network' is only guaranteed 0us",
+            "domain 'control' is over-committed on CPU 0: utilisation is 80.0% of its 70.0% of the schedule",
+            "'eth' in domain 'network' makes protected calls to 'ctrl' in domain 'control', which only run in the windows of 'control'",
+        ])
+
+    def test_supply_bound(self):
+        system = xml2system(_file("domain_schedule.xml"), self.plat_desc)
+        # The worst interval starts as the second 'control' window ends
+        self.assertEqual(domain_supply_bound(system.domain_schedule, "control", 6000), 3000)
+        self.assertEqual(domain_supply_bound(system.domain_schedule, "network", 15000), 3000)
+
+    def test_domain_not_in_schedule(self):
+        self._check_error("pd_domain_not_in_schedule.xml", "Domain 'network' of protection domain 'test' is not in the domain schedule @")
+
+    def test_bad_length(self):
+        self._check_error("domain_schedule_bad_length.xml", "Error: length must be a positive multiple of 1000us on element 'domain':")
+
+    def test_multicore(self):
+        with self.assertRaises(UserError) as e:
+            xml2system(_file("domain_schedule.xml"), plat_desc)
+        self.assertStartsWith(str(e.exception), "Error: domain_schedule is set, but domains are not supported on multicore kernels on element 'domain_schedule':")
+
+    def test_set_domain(self):
+        kernel_config = InvocationTests.kernel_config
+        label = Sel4Label.DomainSetSet.get_id(kernel_config)
+        self.assertEqual(Sel4DomainSetSet(11, 2, 0x40)._get_raw_invocation(kernel_config), pack("<4Q", label << 12 | 1 << 7 | 1, 11, 0x40, 2))
+
+    def test_build_sets_domains(self):
+        kernel_config = replace(InvocationTests.kernel_config, hyp_mode=True, num_domains=16)
+        _, built_system = _build("domain_schedule.xml", kernel_config, platform=self.plat_desc)
+        # Only the threads that are not in the first domain are moved, and
+        # the VM goes with its PD
+        self.assertEqual(
+            [
+                (inv.domain, built_system.cap_lookup[inv.tcb])
+                for inv in built_system.system_invocations
+                if isinstance(inv, Sel4DomainSetSet)
+            ],
+            [(1, "TCB: PD=eth"), (1, "TCB: VM=vm")],
+        )
+
+    def _kernel_elf(self, max_entries: int) -> ElfFile:
+        elf = _kernel_elf()
+        elf.add_symbol("ksDomSchedule", ElfSymbol(0, 0, 0, 0, 0x4000_2000, max_entries * 16))
+        elf.add_symbol("ksDomScheduleLength", ElfSymbol(0, 0, 0, 0, 0x4000_3000, 8))
+        return elf
+
+    def test_write_schedule(self):
+        system = xml2system(_file("domain_schedule.xml"), self.plat_desc)
+        kernel_elf = self._kernel_elf(64)
+        write_domain_schedule(InvocationTests.kernel_config, kernel_elf, system)
+        # Each entry is the number of the domain and its length in ms
+        self.assertEqual(kernel_elf.get_data(0x4000_2000, 0x40), pack("<6Q", 0, 5, 1, 3, 0, 2) + bytes(0x10))
+        self.assertEqual(kernel_elf.get_data(0x4000_3000, 8), pack("<Q", 3))
+
+    def test_schedule_too_long(self):
+        system = xml2system(_file("domain_schedule.xml"), self.plat_desc)
+        with self.assertRaises(UserError) as e:
+            write_domain_schedule(InvocationTests.kernel_config, self._kernel_elf(2), system)
+        self.assertEqual(str(e.exception), "Error: the domain schedule has 3 entries, but the kernel supports at most 2")
+
+    def test_kernel_without_schedule(self):
+        system = xml2system(_file("domain_schedule.xml"), self.plat_desc)
+        with self.assertRaises(UserError) as e:
+            write_domain_schedule(InvocationTests.kernel_config, _kernel_elf(), system)
+        self.assertEqual(str(e.exception), "Error: the kernel has no domain schedule for the domain_schedule of the system")
+
+
+class CacheColourTests(ExtendedTestCase):
+    def test_parse_and_inherit(self):
+        system = xml2system(_file("cache_colours.xml"), plat_desc)
+        colours = frozenset([0, 1, 2, 3, 8])
+        self.assertEqual(system.pd_by_name["a"].cache_colours, colours)
+        self.assertIsNone(system.pd_by_name["c"].cache_colours)
+        mr_colours = {mr.name: mr.cache_colours for mr in system.memory_regions}
+        self.assertEqual(mr_colours, {"private": colours, "same": colours, "different": None, "explicit": frozenset([15])})
+        # Coloured memory regions are not promoted to large pages
+        self.assertEqual(system.mr_by_name["private"].page_size, 0x1000)
+
+    def test_out_of_range(self):
+        self._check_error("pd_cache_colours_out_of_range.xml", "Error: cache colours must be between 0 and 15 on element 'protection_domain':")
+
+    def test_malformed(self):
+        self._check_error("pd_cache_colours_malformed.xml", "Error: invalid cache colour range '3-1' on element 'protection_domain':")
+
+    def test_with_phys_addr(self):
+        self._check_error("mr_cache_colours_with_phys_addr.xml", "Error: cache_colours and phys_addr must not both be specified on element 'memory_region'")
+
+    def test_large_page(self):
+        self._check_error("mr_cache_colours_large_page.xml", "Error: cache_colours requires the smallest page size on element 'memory_region'")
+
+    def test_coloured_pages(self):
+        pages = ColouredPageAllocator(0x10_0000, 16, 0x1000)
+        first = [pages.alloc(frozenset([2, 3])) for _ in range(3)]
+        self.assertEqual(first, [0x10_2000, 0x10_3000, 0x11_2000])
+        # Pages of other colours skipped by earlier allocations are used
+        self.assertEqual(pages.alloc(frozenset([0])), 0x10_0000)
+        self.assertEqual(pages.end, 0x11_3000)
+
+    def test_coloured_segments(self):
+        elf = ElfFile()
+        elf.add_segment(ElfSegment(0x200_800, 0x200_800, bytearray(range(256)) * 16, True, SegmentAttributes.PF_R))
+        pages = ColouredPageAllocator(0, 16, 0x1000)
+        backing = coloured_elf_segment_backing(elf, pages, frozenset([5, 9]), 0x1000)
+        page_addrs = backing[0].page_phys_addrs
+        self.assertEqual(page_addrs, (0x5000, 0x9000))
+        self.assertEqual(backing[0].parts, ((0x200_000, 0x2000, 0x1000), ))
+        regions = page_run_regions("seg", page_addrs, 0x1000, backing[0].offset, memoryview(elf.segments[0].data), 0x100)
+        self.assertEqual([(r.addr, r.offset, len(r.data), r.zero_size) for r in regions], [(0x5000, 0x800, 0x800, 0), (0x9000, 0, 0x800, 0x100)])
+
+    def test_colour_count(self):
+        self.assertEqual(cache_colour_count({}, 0x1000), 1)
+        self.assertEqual(cache_colour_count({"L2_CACHE_SIZE": 0x10_0000, "L2_CACHE_WAYS": 16}, 0x1000), 16)
+        with self.assertRaises(UserError) as e:
+            cache_colour_count({"L2_CACHE_SIZE": 0x18_0000, "L2_CACHE_WAYS": 16}, 0x1000)
+        self.assertEqual(str(e.exception), "Error: an L2 cache of size 0x180000 with 16 ways has 24 cache colours, which is not a power of two")
+
+
+class PlacementTests(unittest.TestCase):
+    def test_placement(self):
+        system = xml2system(_file("placement.xml"), plat_desc)
+        placement = place_domains(system, 2)
+        cpus = placement.cpus
+        # The pairs with the most traffic are kept together, as neither CPU
+        # can fit more than one pair.
+        self.assertEqual(cpus["p1"], cpus["p2"])
+        self.assertEqual(cpus["p3"], cpus["p4"])
+        self.assertNotEqual(cpus["p1"], cpus["p3"])
+        self.assertEqual(cpus["sliced"], cpus["p2"])
+        # The passive PD goes with its busiest caller
+        self.assertEqual(cpus["server"], cpus["p3"])
+        self.assertEqual((placement.cross_cpu_weight, placement.total_weight), (1, 22))
+        self.assertEqual(placement.analysis.problems(), [])
+
+    def test_placed_system(self):
+        system = xml2system(_file("placement.xml"), plat_desc)
+        placement = place_domains(system, 2)
+        with TemporaryDirectory() as tmp_dir:
+            path = Path(tmp_dir) / "placed.xml"
+            path.write_text(placed_system_xml(_file("placement.xml"), placement))
+            self.assertIn("Copyright", path.read_text())
+            placed = xml2system(path, plat_desc)
+        self.assertEqual({pd.name: pd.cpu_affinity for pd in placed.protection_domains}, placement.cpus)
+
+
+class InvocationTests(unittest.TestCase):
+    kernel_config = KernelConfig(
+        arch=KernelArch.AARCH64, word_size=64, minimum_page_size=0x1000, paddr_user_device_top=1 << 40,
+        kernel_frame_size=0x1000, root_cnode_bits=12, cap_address_bits=64, fan_out_limit=256,
+        have_fpu=True, hyp_mode=False, aarch64_smc_calls=False, num_cpus=1, arm_pa_size_bits=40,
+        riscv_page_table_levels=None, x86_xsave_size=None, cache_colours=1, num_domains=1,
+    )
+
+    def test_no_dict(self):
+        self.assertFalse(hasattr(Sel4CnodeCopy(1, 2, 3, 4, 5, 6, 7), "__dict__"))
+
+    def test_table_size(self):
+        self.assertEqual(next_invocation_table_size(self.kernel_config, 0x1800, 0x1000), 0x3000)
+        # The headroom does not take the table past its maximum size
+        self.assertEqual(next_invocation_table_size(self.kernel_config, MAX_SYSTEM_INVOCATION_SIZE, 0x1000), MAX_SYSTEM_INVOCATION_SIZE)
+        with self.assertRaises(UserError) as e:
+            next_invocation_table_size(self.kernel_config, MAX_SYSTEM_INVOCATION_SIZE + 1, 0)
+        self.assertEqual(str(e.exception), "Error: the system needs 0x8000001 bytes of invocation data, but the invocation table can be at most 0x8000000 bytes")
+
+    def test_serialise(self):
+        resume = Sel4TcbResume(0x10)
+        resume.repeat(3, tcb=1)
+        copy = Sel4CnodeCopy(1, 2, 3, 4, 5, 6, 7)
+        label = Sel4Label.TCBResume.get_id(self.kernel_config)
+        # The repeat count and the increment of each word follow the invocation
+        self.assertEqual(
+            serialise_invocations(self.kernel_config, [resume, copy]),
+            pack("<QQQ", label << 12 | 2 << 32, 0x10, 1) + copy._get_raw_invocation(self.kernel_config),
+        )
+        # The cap arguments come before the other arguments
+        copy_label = Sel4Label.CNodeCopy.get_id(self.kernel_config)
+        self.assertEqual(copy._get_raw_invocation(self.kernel_config), pack("<8Q", copy_label << 12 | 1 << 7 | 5, 1, 4, 2, 3, 5, 6, 7))
+
+
+class JsonReportTests(unittest.TestCase):
+    def test_domain_totals(self):
+        kernel_config = InvocationTests.kernel_config
+        system, built_system = _build("json_report.xml", kernel_config)
+        pd_elf_files = {pd: _pd_elf() for pd in system.protection_domains}
+        report = json_loads(json_report(kernel_config, system, built_system, pd_elf_files, 0x10_0000, 0x1000, analyse_schedulability(system, 1)))
+
+        def counts(objects):
+            return {type_name: entry["count"] for type_name, entry in objects.items()}
+
+        # The page tables of the monitor's MR pool are the monitor's, even
+        # though they are mapped into the MR window of a PD
+        self.assertEqual(counts(report["monitor"]["objects"]), {"Reply": 1, "Endpoint": 1, "Untyped": 1, "PageTable": 2})
+        common = {"Tcb": 1, "SchedContext": 1, "Reply": 1, "Notification": 1, "Vspace": 1, "CNode": 1}
+        # Each PD has its IPC buffer and program image pages, except for the
+        # code that "client" shares with "net driver". The pages of the
+        # shared MR are not any one PD's.
+        self.assertEqual(
+            [(pd["name"], counts(pd["objects"]), pd["page_tables"]) for pd in report["protection_domains"]],
+            [
+                ("net driver", {**common, "SmallPage": 6, "PageTable": 5}, 5),
+                ("client", {**common, "SmallPage": 4, "PageTable": 4}, 4),
+            ],
+        )
+        self.assertEqual(report["totals"]["objects"]["SmallPage"]["count"], 11)
+        self.assertEqual(report["totals"]["objects"]["PageTable"]["count"], 11)
+
+
+class KernelObjectAllocatorTests(unittest.TestCase):
+    # Untyped objects as the kernel creates them: naturally aligned, and
+    # of various sizes.
+    UNTYPED_REGIONS = [
+        (0x4000_0000, 0x8_0000),
+        (0x4034_3000, 0x1000),
+        (0x4034_4000, 0x4000),
+        (0x4034_8000, 0x8000),
+        (0x4035_0000, 0x1_0000),
+        (0x4036_0000, 0x2_0000),
+        (0x4038_0000, 0x8_0000),
+        (0x4040_0000, 0x40_0000),
+        (0x4080_0000, 0x80_0000),
+    ]
+
+    # The allocations made for a system with 60 PDs, in the order the
+    # tool makes them: (object size, count)
+    ALLOCATIONS = [
+        (0x40, 1),        # root CNode
+        (0x2_0000, 1),    # system CNode
+        (0x1000, 1),      # monitor page table
+        (0x1000, 762),    # pages
+        (0x800, 60),      # TCBs
+        (0x2000, 60),     # scheduling contexts
+        (0x20, 61),       # replies
+        (0x10, 31),       # endpoints
+        (0x40, 60),       # notifications
+        (0x1000, 60),     # vspaces
+        (0x1000, 60),     # upper directories
+        (0x1000, 60),     # directories
+        (0x1000, 120),    # page tables
+        (0x4000, 60),     # PD CNodes
+    ]
+
+    def _boot_info(self):
+        untyped_objects = [
+            UntypedObject(cap, MemoryRegion(base, base + size), False)
+            for cap, (base, size) in enumerate(self.UNTYPED_REGIONS, 100)
+        ]
+        return KernelBootInfo(0, 0, 0, 0, untyped_objects, 100 + len(untyped_objects))
+
+    def _first_fit_consumed(self):
+        allocation_points = [0 for _ in self.UNTYPED_REGIONS]
+        for size, count in self.ALLOCATIONS:
+            for idx, (base, ut_size) in enumerate(self.UNTYPED_REGIONS):
+                start = round_up(base + allocation_points[idx], size)
+                if start + size * count <= base + ut_size:
+                    allocation_points[idx] = start - base + size * count
+                    break
+            else:
+                self.fail("first fit could not allocate the system")
+        return sum(allocation_points)
+
+    def test_consumes_less_than_first_fit(self):
+        kao = KernelObjectAllocator(self._boot_info())
+        for size, count in self.ALLOCATIONS:
+            kao.alloc(size, count)
+        used = sum(size * count for size, count in self.ALLOCATIONS)
+        self.assertEqual(kao.consumed, used + kao.waste)
+        self.assertLess(kao.consumed, self._first_fit_consumed())
+
+    def test_allocations_aligned(self):
+        kao = KernelObjectAllocator(self._boot_info())
+        for size, count in self.ALLOCATIONS:
+            allocation = kao.alloc(size, count)
+            self.assertEqual(allocation.phys_addr % size, 0)
+
+    def test_not_enough_space(self):
+        kao = KernelObjectAllocator(self._boot_info())
+        with self.assertRaises(Exception) as e:
+            kao.alloc(0x100_0000)
+        self.assertTrue(str(e.exception).startswith("Not enough space to allocate 0x1000000 bytes"))
+
+
+class ElfSegmentTests(unittest.TestCase):
+    def test_zero_fill_not_stored(self):
+        segment = ElfSegment(0, 0, bytearray(b"\x01" * 0x10), True, SegmentAttributes.PF_R, zero_size=0x100_0000)
+        self.assertEqual(segment.mem_size, 0x100_0010)
+        self.assertEqual(len(segment.data), 0x10)
+        self.assertEqual(segment.read(0xc, 8), b"\x01" * 4 + bytes(4))
+
+    def test_write_into_zero_fill(self):
+        segment = ElfSegment(0, 0, bytearray(b"\x01" * 0x10), True, SegmentAttributes.PF_R, zero_size=0x20)
+        segment.write(0x18, b"\x02\x02")
+        self.assertEqual(segment.mem_size, 0x30)
+        self.assertEqual(len(segment.data), 0x1a)
+        self.assertEqual(segment.read(0x10, 0x10), bytes(8) + b"\x02\x02" + bytes(6))
+
+    def test_duplicate_symbol(self):
+        elf = ElfFile()
+        elf.add_symbol("a", ElfSymbol(0, 0, 0, 0, 0x1000, 8))
+        self.assertEqual(elf.find_symbol("a"), (0x1000, 8))
+        self.assertIsNone(elf.find_symbol_if_exists("b"))
+        elf.add_symbol("a", ElfSymbol(0, 0, 0, 0, 0x2000, 8))
+        with self.assertRaises(Exception):
+            elf.find_symbol("a")
+
+
+class SharedSegmentTests(unittest.TestCase):
+    def _elf(self, code: int, data: int) -> ElfFile:
+        elf = ElfFile()
+        elf.add_segment(ElfSegment(0x200_000, 0x200_000, bytearray([code] * 0x2000), True, SegmentAttributes.PF_R | SegmentAttributes.PF_X))
+        elf.add_segment(ElfSegment(0x210_000, 0x210_000, bytearray([data] * 0x1000), True, SegmentAttributes.PF_R | SegmentAttributes.PF_W))
+        return elf
+
+    def test_identical_images(self):
+        elfs = [self._elf(1, 1), self._elf(2, 1), self._elf(1, 2), self._elf(2, 2)]
+        self.assertEqual(identical_program_images(elfs), [None, None, 0, 1])
+
+    def test_shared_backing(self):
+        backing, size = elf_segment_backing(self._elf(1, 1), 0, 0x1000, 0x200_000)
+        self.assertEqual(size, 0x3000)
+        shared, size = elf_segment_backing(self._elf(1, 2), size, 0x1000, 0x200_000, [backing[0], None])
+        self.assertEqual(size, 0x4000)
+        self.assertTrue(shared[0].shared)
+        self.assertEqual(shared[0].phys_addr, backing[0].phys_addr)
+        self.assertFalse(shared[1].shared)
+        self.assertEqual(shared[1].phys_addr, 0x3000)
+
+
+class BuildCacheTests(unittest.TestCase):
+    def _elf(self, fill: int, size: int = 0x2000) -> ElfFile:
+        elf = ElfFile()
+        elf.add_segment(ElfSegment(0x200_000, 0x200_000, bytearray([fill] * size), True, SegmentAttributes.PF_R))
+        elf.add_symbol("passive", ElfSymbol(0, 0, 0, 0, 0x200_010, 1))
+        elf.entry = 0x200_000
+        return elf
+
+    def test_layout_ignores_segment_contents(self):
+        self.assertEqual(elf_layout(self._elf(1), ["passive"]), elf_layout(self._elf(2), ["passive"]))
+        self.assertNotEqual(elf_layout(self._elf(1), ["passive"]), elf_layout(self._elf(1, 0x3000), ["passive"]))
+        self.assertNotEqual(elf_layout(self._elf(1), ["passive"]), elf_layout(self._elf(1), ["passive", "missing"]))
+
+    def test_splice_segment_data(self):
+        build = CachedBuild(
+            monitor_elf = self._elf(0),
+            initial_task_phys_base = 0x8000_0000,
+            reserved_region = MemoryRegion(0x9000_0000, 0x9100_0000),
+            regions = [
+                CachedRegion(0x9000_0000, 0, b"invocations", 0, None),
+                CachedRegion(0x9010_0000, 0x10, None, 0x1000, (0, 0, 0, 0x2000)),
+            ],
+            pd_symbol_patches = [[("passive", b"\x01")]],
+            report = "report",
+            report_json = "{}",
+        )
+        with TemporaryDirectory() as cache_dir:
+            cache = BuildCache(Path(cache_dir))
+            self.assertIsNone(cache.load("key"))
+            cache.store("key", build)
+            cached_build = cache.load("key")
+
+        self.assertIsNotNone(cached_build)
+        regions = cached_build.loader_regions([self._elf(7)])
+        expected = bytearray([7] * 0x2000)
+        expected[0x10] = 1
+        self.assertEqual(regions, [(0x9000_0000, b"invocations", 0), (0x9010_0000, bytes(0x10) + expected, 0x1000)])
+
+
+class Lz4Tests(unittest.TestCase):
+    def _check_roundtrip(self, data: bytes) -> bytes:
+        compressed = lz4.compress(data)
+        self.assertEqual(lz4.decompress(compressed, len(data)), data)
+        return compressed
+
+    def test_empty(self):
+        self._check_roundtrip(b"")
+
+    def test_short(self):
+        self._check_roundtrip(b"abcdefgh")
+
+    def test_zeros(self):
+        compressed = self._check_roundtrip(bytes(0x100_000))
+        self.assertLess(len(compressed), 0x100_000 // 200)
+
+    def test_mixed(self):
+        data = b"".join(bytes([idx % 251]) * (idx % 17) + b"microkit" * (idx % 5) for idx in range(2000))
+        compressed = self._check_roundtrip(data)
+        self.assertLess(len(compressed), len(data))
+
+    def test_last_literals(self):
+        # The last bytes of a block are always literals
+        compressed = self._check_roundtrip(bytes(64))
+        self.assertEqual(compressed[-lz4.LAST_LITERALS:], bytes(lz4.LAST_LITERALS))
+
+
+class LoaderTests(unittest.TestCase):
+    def test_compress_jobs(self):
+        # The loader image needs a loader with its boot page tables
+        loader_elf = ElfFile()
+        loader_elf.add_segment(ElfSegment(0x7000_0000, 0x7000_0000, bytearray(0x6000), True, SegmentAttributes.PF_R | SegmentAttributes.PF_W | SegmentAttributes.PF_X))
+        for idx, name in enumerate(("boot_lvl0_lower", "boot_lvl1_lower", "boot_lvl0_upper", "boot_lvl1_upper", "boot_lvl2_upper")):
+            loader_elf.add_symbol(name, ElfSymbol(0, 0, 0, 0, 0x7000_1000 + idx * 0x1000, 0x1000))
+        loader_elf.entry = 0x7000_0000
+        monitor_elf = ElfFile()
+        monitor_elf.add_segment(ElfSegment(0x8a00_0000, 0x8a00_0000, bytearray(0x1000), True, SegmentAttributes.PF_R | SegmentAttributes.PF_X))
+        monitor_elf.entry = 0x8a00_0000
+        # Several chunks, of which some do not compress
+        data = b"".join(pack("<I", idx * 0x9e37_79b9 & 0xffff_ffff) for idx in range(0x1_0000)) + b"microkit" * 0x4_0000
+        regions = [(0x9000_0000, data, 0x1000)]
+        with patch("microkit.loader.ElfFile.from_path", return_value=loader_elf):
+            loader = Loader(InvocationTests.kernel_config, Path("loader.elf"), _kernel_elf(), monitor_elf, 0x8800_0000, MemoryRegion(0x9000_0000, 0xa000_0000), regions)
+
+        with TemporaryDirectory() as tmp_dir:
+            serial, parallel = Path(tmp_dir) / "serial.img", Path(tmp_dir) / "parallel.img"
+            loader.write_image(serial, compress=True, jobs=1)
+            loader.write_image(parallel, compress=True, jobs=2)
+            self.assertEqual(serial.read_bytes(), parallel.read_bytes())